@@ -0,0 +1,18 @@
+/* Shared library with a few exported functions and debug info. */
+#include <stdlib.h>
+#include <string.h>
+
+char *shared_reverse(const char *s) {
+	size_t n = strlen(s);
+	char *out = malloc(n + 1);
+	if (!out) return NULL;
+	for (size_t i = 0; i < n; ++i) out[i] = s[n - 1 - i];
+	out[n] = '\0';
+	return out;
+}
+
+int shared_sum(const int *v, size_t n) {
+	int total = 0;
+	for (size_t i = 0; i < n; ++i) total += v[i];
+	return total;
+}
@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Small CLI-style program: parses its arguments and prints a checksum. */
+static unsigned long checksum(const char *s) {
+	unsigned long h = 5381;
+	while (*s) h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+int main(int argc, char **argv) {
+	unsigned long total = 0;
+	for (int i = 1; i < argc; ++i) total ^= checksum(argv[i]);
+	printf("%lu\n", total);
+	return 0;
+}
@@ -0,0 +1,64 @@
+// Template-heavy program with debug info; stands in for large C++ services.
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef TEMPLATE_COUNT
+#define TEMPLATE_COUNT 64
+#endif
+
+template <int N>
+struct Tag {
+	int value = N;
+	bool operator<(const Tag &o) const { return value < o.value; }
+	bool operator==(const Tag &o) const { return value == o.value; }
+};
+
+template <int N>
+struct std::hash<Tag<N>> {
+	std::size_t operator()(const Tag<N> &t) const { return std::hash<int>()(t.value); }
+};
+
+template <typename T>
+static std::string describe(const std::vector<T> &items) {
+	std::map<T, int> counts;
+	std::set<T> seen;
+	std::unordered_map<T, std::size_t> index;
+	for (std::size_t i = 0; i < items.size(); ++i) {
+		++counts[items[i]];
+		seen.insert(items[i]);
+		index.emplace(items[i], i);
+	}
+	std::vector<T> sorted(seen.begin(), seen.end());
+	std::sort(sorted.begin(), sorted.end());
+	std::ostringstream os;
+	os << counts.size() << ' ' << sorted.size() << ' ' << index.size();
+	return os.str();
+}
+
+template <int N>
+static std::string instantiate() {
+	std::vector<Tag<N>> items(N % 7 + 3);
+	auto fn = std::make_shared<std::function<std::string()>>([&] { return describe(items); });
+	return (*fn)();
+}
+
+template <int... Ns>
+static std::vector<std::string> instantiateAll(std::integer_sequence<int, Ns...>) {
+	return {instantiate<Ns>()...};
+}
+
+int main() {
+	auto out = instantiateAll(std::make_integer_sequence<int, TEMPLATE_COUNT>());
+	std::size_t total = std::accumulate(out.begin(), out.end(), std::size_t{0}, [](std::size_t acc, const std::string &s) { return acc + s.size(); });
+	std::cout << total << "\n";
+	return 0;
+}
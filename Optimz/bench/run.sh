@@ -0,0 +1,137 @@
+#!/bin/sh
+# Builds the benchmark corpus and runs Opt over it once per tool
+# combination, plain and as a tar layer (--tar), reporting throughput,
+# per-step latency and size reduction.
+#
+# Environment:
+#   OPT          Opt binary to measure (default: build src/main.cpp into the work dir)
+#   BENCH_WORK   work directory (default: a fresh mktemp -d)
+#   BENCH_RUNS   repetitions per combination, the median run is reported (default: 3)
+#   BENCH_JOBS   value passed to -j (default: 1, keeps step latencies comparable)
+#   BENCH_PASSES passes per file (default: 3)
+#   CC, CXX      compilers for Opt and the corpus (default: cc, c++)
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+work=${BENCH_WORK:-$(mktemp -d)}
+runs=${BENCH_RUNS:-3}
+jobs=${BENCH_JOBS:-1}
+passes=${BENCH_PASSES:-3}
+cc=${CC:-cc}
+cxx=${CXX:-c++}
+
+command -v python3 >/dev/null 2>&1 || { echo "python3 is required to summarize results" >&2; exit 1; }
+mkdir -p "$work/corpus" "$work/shims" "$work/results"
+
+if [ -z "${OPT:-}" ]; then
+	echo "Building Opt" >&2
+	"$cxx" -O2 -std=c++17 -Wall -Wextra -Wpedantic -pthread -o "$work/Opt" "$root/src/main.cpp"
+	OPT=$work/Opt
+fi
+
+echo "Building corpus in $work/corpus" >&2
+corpus=$work/corpus
+"$cc" -O2 -g -o "$corpus/small" "$here/corpus/small.c"
+"$cxx" -O1 -g -std=c++17 -o "$corpus/templates" "$here/corpus/templates.cpp"
+"$cc" -O2 -g -shared -fPIC -o "$corpus/libshared.so" "$here/corpus/libshared.c"
+chmod +x "$corpus/libshared.so"
+if "$cc" -O2 -g -static-pie -o "$corpus/static-pie" "$here/corpus/small.c" 2>/dev/null; then
+	:
+else
+	echo "Static libc not available; skipping the static-PIE sample" >&2
+fi
+
+# An image layer with a non-ELF member first, for the --tar runs
+mkdir -p "$work/layer/bin" "$work/layer/lib"
+cp "$here/corpus/notes.txt" "$work/layer/"
+cp "$corpus/small" "$corpus/templates" "$work/layer/bin/"
+cp "$corpus/libshared.so" "$work/layer/lib/"
+tar -cf "$work/layer.tar" -C "$work/layer" notes.txt bin lib
+
+# A shim directory holds symlinks to exactly the tools of one combination,
+# so Opt's PATH lookup sees nothing else.
+mkshim() {
+	dir=$work/shims/$1
+	shift
+	rm -rf "$dir"
+	mkdir -p "$dir"
+	for tool in "$@"; do
+		if path=$(command -v "$tool" 2>/dev/null); then
+			ln -s "$path" "$dir/$tool"
+		fi
+	done
+	echo "$dir"
+}
+
+# name|engine option|tools
+combos="native|--engine=native|
+binutils|--engine=tool|llvm-strip strip llvm-objcopy objcopy
+native+objcopy|--engine=native|llvm-objcopy objcopy
+full|--engine=native|llvm-strip strip llvm-objcopy objcopy patchelf sstrip upx"
+
+echo "$combos" | while IFS='|' read -r name engine tools; do
+	# shellcheck disable=SC2086
+	shim=$(mkshim "$name" $tools)
+	if [ -n "$tools" ] && [ -z "$(ls "$shim")" ]; then
+		echo "No tools for combination '$name'; skipping" >&2
+		continue
+	fi
+	i=1
+	while [ "$i" -le "$runs" ]; do
+		dir=$work/runs/$name-$i
+		rm -rf "$dir"
+		mkdir -p "$dir"
+		cp "$corpus"/* "$dir"/
+		echo "Running $name ($i/$runs)" >&2
+		PATH=$shim "$OPT" --no-cache "$engine" --report=json -j "$jobs" "$dir"/* "-$passes" >"$work/results/$name-$i.json" 2>"$work/results/$name-$i.log" || {
+			echo "Opt failed for $name, see $work/results/$name-$i.log" >&2
+		}
+		PATH=$shim "$OPT" --no-cache "$engine" --report=json -j "$jobs" --tar "$work/layer.tar" -o "$dir/layer.tar" "-$passes" >"$work/results/$name-tar-$i.json" 2>"$work/results/$name-tar-$i.log" || {
+			echo "Opt --tar failed for $name, see $work/results/$name-tar-$i.log" >&2
+		}
+		i=$((i + 1))
+	done
+done
+
+python3 - "$work/results" <<'EOF'
+import json
+import os
+import statistics
+import sys
+
+results = sys.argv[1]
+runs = {}
+for name in sorted(os.listdir(results)):
+    if not name.endswith(".json"):
+        continue
+    combo = name[: name.rindex("-")]
+    try:
+        with open(os.path.join(results, name)) as f:
+            runs.setdefault(combo, []).append(json.load(f))
+    except ValueError:
+        continue
+
+print("%-20s %6s %12s %12s %8s %10s %8s" % ("combination", "files", "in_bytes", "out_bytes", "saved%", "wall_ms", "MB/s"))
+for combo, reports in runs.items():
+    reports.sort(key=lambda r: r["summary"]["wall_ms"])
+    median = reports[len(reports) // 2]["summary"]
+    saved = 100.0 * (median["bytes_before"] - median["bytes_after"]) / max(median["bytes_before"], 1)
+    mbps = median["bytes_before"] / 1e6 / max(median["wall_ms"] / 1e3, 1e-9)
+    print("%-20s %6d %12d %12d %8.1f %10.1f %8.1f" % (combo, median["files"], median["bytes_before"], median["bytes_after"], saved, median["wall_ms"], mbps))
+
+print()
+print("%-20s %-16s %6s %10s %10s %12s" % ("combination", "step", "runs", "mean_ms", "p50_ms", "bytes_saved"))
+for combo, reports in runs.items():
+    per_step = {}
+    for report in reports:
+        for f in report["files"]:
+            for p in f["passes"]:
+                for s in p["steps"]:
+                    per_step.setdefault(s["name"], []).append(s)
+    for step, records in per_step.items():
+        times = [s["wall_ms"] for s in records]
+        saved = sum(max(s["bytes_before"] - s["bytes_after"], 0) for s in records if s["exit_code"] == 0) // len(reports)
+        print("%-20s %-16s %6d %10.2f %10.2f %12d" % (combo, step, len(records) // len(reports), statistics.mean(times), statistics.median(times), saved))
+EOF
+echo "Raw reports: $work/results" >&2
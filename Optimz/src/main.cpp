@@ -1,21 +1,187 @@
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <netdb.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
 #include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+extern char **environ;
+
+// Serializes diagnostic lines so parallel workers do not interleave output.
+static std::mutex gLogMutex;
+
+struct LogLine {
+	std::ostringstream ss;
+	~LogLine() {
+		std::lock_guard<std::mutex> lock(gLogMutex);
+		std::cerr << ss.str() << "\n";
+	}
+	template <typename T>
+	LogLine &operator<<(const T &v) {
+		ss << v;
+		return *this;
+	}
+};
+
+// Fixed-size pool with one deque per worker. Jobs are pushed round-robin;
+// an idle worker drains its own queue from the front and steals from the
+// back of the others before going to sleep.
+class WorkPool {
+public:
+	explicit WorkPool(unsigned workers) {
+		if (workers == 0) workers = 1;
+		for (unsigned i = 0; i < workers; ++i) queues_.push_back(std::make_unique<Queue>());
+		for (unsigned i = 0; i < workers; ++i) threads_.emplace_back([this, i] { workerLoop(i); });
+	}
+
+	~WorkPool() {
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(m_);
+			stop_ = true;
+		}
+		cv_.notify_all();
+		for (auto &t : threads_) t.join();
+	}
+
+	WorkPool(const WorkPool &) = delete;
+	WorkPool &operator=(const WorkPool &) = delete;
+
+	unsigned size() const { return static_cast<unsigned>(threads_.size()); }
+
+	void submit(std::function<void()> job) {
+		unsigned slot = next_.fetch_add(1) % static_cast<unsigned>(queues_.size());
+		{
+			std::lock_guard<std::mutex> lock(queues_[slot]->m);
+			queues_[slot]->jobs.push_back(std::move(job));
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_);
+			++pending_;
+			++queued_;
+		}
+		cv_.notify_one();
+	}
+
+	// Blocks until every submitted job has finished.
+	void wait() {
+		std::unique_lock<std::mutex> lock(m_);
+		idleCv_.wait(lock, [this] { return pending_ == 0; });
+	}
+
+private:
+	struct Queue {
+		std::mutex m;
+		std::deque<std::function<void()>> jobs;
+	};
+
+	bool take(unsigned self, std::function<void()> &job) {
+		{
+			Queue &q = *queues_[self];
+			std::lock_guard<std::mutex> lock(q.m);
+			if (!q.jobs.empty()) {
+				job = std::move(q.jobs.front());
+				q.jobs.pop_front();
+				return true;
+			}
+		}
+		for (std::size_t k = 1; k < queues_.size(); ++k) {
+			Queue &q = *queues_[(self + k) % queues_.size()];
+			std::lock_guard<std::mutex> lock(q.m);
+			if (!q.jobs.empty()) {
+				job = std::move(q.jobs.back());
+				q.jobs.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void workerLoop(unsigned self) {
+		for (;;) {
+			std::function<void()> job;
+			if (take(self, job)) {
+				{
+					std::lock_guard<std::mutex> lock(m_);
+					--queued_;
+				}
+				job();
+				std::lock_guard<std::mutex> lock(m_);
+				if (--pending_ == 0) idleCv_.notify_all();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_);
+			// queued_ is bumped only after the job is visible in a deque
+			cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+			if (stop_) return;
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> threads_;
+	std::mutex m_;
+	std::condition_variable cv_;
+	std::condition_variable idleCv_;
+	std::size_t pending_ = 0; // submitted but not finished
+	std::size_t queued_ = 0;  // submitted but not yet taken
+	bool stop_ = false;
+	std::atomic<unsigned> next_{0};
+};
+
 static bool isExecutableFile(const fs::path &path) {
 	struct stat st{};
 	if (stat(path.c_str(), &st) != 0) return false;
@@ -32,195 +198,6298 @@ static bool readFilePrefix(const fs::path &path, std::string &out, std::size_t b
 	return f.gcount() == static_cast<std::streamsize>(bytes);
 }
 
-static bool isElfBinary(const fs::path &path) {
-	std::string prefix;
-	if (!readFilePrefix(path, prefix, 4)) return false;
-	return prefix.size() >= 4 && static_cast<unsigned char>(prefix[0]) == 0x7f && prefix[1] == 'E' && prefix[2] == 'L' && prefix[3] == 'F';
+// Read-only mapping of a whole file; empty files map to a null view.
+class MappedFile {
+public:
+	explicit MappedFile(const fs::path &path) {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return;
+		struct stat st{};
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void *p = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				data_ = static_cast<const unsigned char *>(p);
+				size_ = static_cast<std::size_t>(st.st_size);
+			}
+		}
+		close(fd);
+	}
+	~MappedFile() {
+		if (data_) munmap(const_cast<unsigned char *>(data_), size_);
+	}
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool ok() const { return data_ != nullptr; }
+	const unsigned char *data() const { return data_; }
+	std::size_t size() const { return size_; }
+
+private:
+	const unsigned char *data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+struct ElfSection {
+	std::string name;
+	std::uint32_t type = 0;
+	std::uint64_t flags = 0;
+	std::uint64_t addr = 0;
+	std::uint64_t offset = 0;
+	std::uint64_t size = 0;
+	std::uint32_t link = 0;
+	std::uint32_t info = 0;
+	std::uint64_t addralign = 0;
+	std::uint64_t entsize = 0;
+};
+
+struct ElfSegment {
+	std::uint32_t type = 0;
+	std::uint32_t flags = 0;
+	std::uint64_t offset = 0;
+	std::uint64_t vaddr = 0;
+	std::uint64_t paddr = 0;
+	std::uint64_t filesz = 0;
+	std::uint64_t memsz = 0;
+	std::uint64_t align = 0;
+};
+
+struct ElfInfo {
+	bool is64 = false;
+	bool littleEndian = true;
+	std::uint16_t type = 0;
+	std::uint16_t machine = 0;
+	std::uint64_t entry = 0;
+	std::uint64_t fileSize = 0;
+	std::uint64_t phoff = 0;
+	std::uint64_t shoff = 0;
+	std::uint16_t shstrndx = 0;
+	std::vector<ElfSection> sections;
+	std::vector<ElfSegment> segments;
+	bool hasDynamic = false;
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> dynamic; // (d_tag, d_val) up to DT_NULL
+	std::vector<std::string> needed;
+	std::optional<std::string> rpath;
+	std::optional<std::string> runpath;
+	bool upxPacked = false;
+	std::string buildId; // hex NT_GNU_BUILD_ID descriptor, empty if absent
+};
+
+static bool hasElfMagic(const unsigned char *p, std::size_t n) {
+	return n >= 4 && p[0] == 0x7f && p[1] == 'E' && p[2] == 'L' && p[3] == 'F';
 }
 
-static std::optional<std::string> which(const std::string &exe) {
-	const char *pathEnv = ::getenv("PATH");
-	if (!pathEnv) return std::nullopt;
-	std::stringstream ss(pathEnv);
-	std::string dir;
-	while (std::getline(ss, dir, ':')) {
-		fs::path candidate = fs::path(dir) / exe;
-		if (fs::exists(candidate) && fs::is_regular_file(candidate) && access(candidate.c_str(), X_OK) == 0) {
-			return candidate.string();
+// Bounds-checked integer loads in the byte order of the file being read.
+struct ElfReader {
+	const unsigned char *data;
+	std::size_t size;
+	bool little;
+	bool ok = true;
+
+	std::uint64_t load(std::uint64_t off, unsigned width) {
+		if (off > size || width > size - off) {
+			ok = false;
+			return 0;
+		}
+		std::uint64_t v = 0;
+		for (unsigned i = 0; i < width; ++i) {
+			unsigned shift = little ? 8 * i : 8 * (width - 1 - i);
+			v |= static_cast<std::uint64_t>(data[off + i]) << shift;
 		}
+		return v;
+	}
+	std::uint16_t u16(std::uint64_t off) { return static_cast<std::uint16_t>(load(off, 2)); }
+	std::uint32_t u32(std::uint64_t off) { return static_cast<std::uint32_t>(load(off, 4)); }
+	std::uint64_t u64(std::uint64_t off) { return load(off, 8); }
+
+	std::string cstr(std::uint64_t off) {
+		if (off >= size) return {};
+		const char *s = reinterpret_cast<const char *>(data + off);
+		return std::string(s, strnlen(s, size - off));
+	}
+};
+
+// Maps a virtual address to a file offset through the PT_LOAD segments.
+static std::optional<std::uint64_t> vaddrToOffset(const ElfInfo &elf, std::uint64_t vaddr) {
+	for (const auto &seg : elf.segments) {
+		if (seg.type == PT_LOAD && vaddr >= seg.vaddr && vaddr < seg.vaddr + seg.filesz) return seg.offset + (vaddr - seg.vaddr);
 	}
 	return std::nullopt;
 }
 
-static int runCommand(const std::vector<std::string> &args, bool quiet = false) {
-	std::string cmd;
-	for (std::size_t i = 0; i < args.size(); ++i) {
-		if (i) cmd += ' ';
-		// naive escaping for spaces
-		if (args[i].find(' ') != std::string::npos) {
-			cmd += '"' + args[i] + '"';
+// Parses the ELF header, program and section headers and the dynamic
+// section of an in-memory image. Returns nullopt for anything malformed.
+static std::optional<ElfInfo> parseElf(const unsigned char *data, std::size_t size) {
+	if (!hasElfMagic(data, size) || size < EI_NIDENT) return std::nullopt;
+	ElfInfo elf;
+	if (data[EI_CLASS] != ELFCLASS32 && data[EI_CLASS] != ELFCLASS64) return std::nullopt;
+	if (data[EI_DATA] != ELFDATA2LSB && data[EI_DATA] != ELFDATA2MSB) return std::nullopt;
+	elf.is64 = data[EI_CLASS] == ELFCLASS64;
+	elf.littleEndian = data[EI_DATA] == ELFDATA2LSB;
+	elf.fileSize = size;
+	ElfReader r{data, size, elf.littleEndian};
+	const unsigned w = elf.is64 ? 8 : 4;
+
+	elf.type = r.u16(16);
+	elf.machine = r.u16(18);
+	elf.entry = r.load(24, w);
+	elf.phoff = r.load(elf.is64 ? 32 : 28, w);
+	elf.shoff = r.load(elf.is64 ? 40 : 32, w);
+	const std::uint16_t phentsize = r.u16(elf.is64 ? 54 : 42);
+	std::uint64_t phnum = r.u16(elf.is64 ? 56 : 44);
+	const std::uint16_t shentsize = r.u16(elf.is64 ? 58 : 46);
+	std::uint64_t shnum = r.u16(elf.is64 ? 60 : 48);
+	std::uint64_t shstrndx = r.u16(elf.is64 ? 62 : 50);
+	if (!r.ok) return std::nullopt;
+
+	// Large section counts and indices spill into section header 0
+	if (elf.shoff && shentsize && (shnum == 0 || shstrndx == SHN_XINDEX)) {
+		if (shnum == 0) shnum = r.load(elf.shoff + (elf.is64 ? 32 : 20), w);
+		if (shstrndx == SHN_XINDEX) shstrndx = r.u32(elf.shoff + (elf.is64 ? 44 : 28));
+	}
+	if (phnum == PN_XNUM && elf.shoff) phnum = r.u32(elf.shoff + (elf.is64 ? 44 : 28));
+	if (!r.ok) return std::nullopt;
+	elf.shstrndx = static_cast<std::uint16_t>(std::min<std::uint64_t>(shstrndx, 0xffff));
+
+	// Divided rather than multiplied: counts from section header 0 are
+	// 64-bit and the product could wrap
+	if (phnum && (phentsize < (elf.is64 ? 56 : 32) || elf.phoff > size || phnum > (size - elf.phoff) / phentsize)) return std::nullopt;
+	for (std::uint64_t i = 0; i < phnum; ++i) {
+		std::uint64_t o = elf.phoff + i * phentsize;
+		ElfSegment seg;
+		seg.type = r.u32(o);
+		if (elf.is64) {
+			seg.flags = r.u32(o + 4);
+			seg.offset = r.u64(o + 8);
+			seg.vaddr = r.u64(o + 16);
+			seg.paddr = r.u64(o + 24);
+			seg.filesz = r.u64(o + 32);
+			seg.memsz = r.u64(o + 40);
+			seg.align = r.u64(o + 48);
 		} else {
-			cmd += args[i];
+			seg.offset = r.u32(o + 4);
+			seg.vaddr = r.u32(o + 8);
+			seg.paddr = r.u32(o + 12);
+			seg.filesz = r.u32(o + 16);
+			seg.memsz = r.u32(o + 20);
+			seg.flags = r.u32(o + 24);
+			seg.align = r.u32(o + 28);
+		}
+		elf.segments.push_back(seg);
+	}
+
+	if (elf.shoff && shnum) {
+		if (shentsize < (elf.is64 ? 64 : 40) || elf.shoff > size || shnum > (size - elf.shoff) / shentsize) return std::nullopt;
+		std::vector<std::uint32_t> nameOffsets;
+		for (std::uint64_t i = 0; i < shnum; ++i) {
+			std::uint64_t o = elf.shoff + i * shentsize;
+			ElfSection sec;
+			nameOffsets.push_back(r.u32(o));
+			sec.type = r.u32(o + 4);
+			sec.flags = r.load(o + 8, w);
+			sec.addr = r.load(o + (elf.is64 ? 16 : 12), w);
+			sec.offset = r.load(o + (elf.is64 ? 24 : 16), w);
+			sec.size = r.load(o + (elf.is64 ? 32 : 20), w);
+			sec.link = r.u32(o + (elf.is64 ? 40 : 24));
+			sec.info = r.u32(o + (elf.is64 ? 44 : 28));
+			sec.addralign = r.load(o + (elf.is64 ? 48 : 32), w);
+			sec.entsize = r.load(o + (elf.is64 ? 56 : 36), w);
+			elf.sections.push_back(sec);
+		}
+		if (shstrndx < elf.sections.size()) {
+			const ElfSection &strtab = elf.sections[shstrndx];
+			for (std::size_t i = 0; i < elf.sections.size(); ++i) {
+				if (nameOffsets[i] < strtab.size) elf.sections[i].name = r.cstr(strtab.offset + nameOffsets[i]);
+			}
+		}
+	}
+	if (!r.ok) return std::nullopt;
+
+	// Dynamic entries: prefer the section (it names its string table), fall
+	// back to PT_DYNAMIC for binaries whose section headers were removed
+	std::optional<std::uint64_t> dynOff, dynSize, strOff;
+	for (const auto &sec : elf.sections) {
+		if (sec.type == SHT_DYNAMIC) {
+			dynOff = sec.offset;
+			dynSize = sec.size;
+			if (sec.link < elf.sections.size()) strOff = elf.sections[sec.link].offset;
+			break;
+		}
+	}
+	if (!dynOff) {
+		for (const auto &seg : elf.segments) {
+			if (seg.type == PT_DYNAMIC) {
+				dynOff = seg.offset;
+				dynSize = seg.filesz;
+				break;
+			}
+		}
+	}
+	if (dynOff) {
+		elf.hasDynamic = true;
+		const std::uint64_t entSize = 2 * w;
+		std::vector<std::pair<std::uint64_t, std::uint64_t>> &entries = elf.dynamic;
+		for (std::uint64_t o = *dynOff; o + entSize <= *dynOff + *dynSize; o += entSize) {
+			std::uint64_t tag = r.load(o, w);
+			std::uint64_t val = r.load(o + w, w);
+			if (!r.ok || tag == DT_NULL) break;
+			entries.emplace_back(tag, val);
+			if (tag == DT_STRTAB && !strOff) strOff = vaddrToOffset(elf, val);
+		}
+		r.ok = true;
+		if (strOff) {
+			for (const auto &[tag, val] : entries) {
+				if (tag == DT_NEEDED) elf.needed.push_back(r.cstr(*strOff + val));
+				else if (tag == DT_RPATH) elf.rpath = r.cstr(*strOff + val);
+				else if (tag == DT_RUNPATH) elf.runpath = r.cstr(*strOff + val);
+			}
+		}
+	}
+
+	// GNU build ID, from the note sections or, without sections, PT_NOTE
+	auto scanNotes = [&](std::uint64_t off, std::uint64_t len) {
+		const std::uint64_t end = std::min<std::uint64_t>(off + len, size);
+		while (elf.buildId.empty() && off + 12 <= end) {
+			std::uint32_t namesz = r.u32(off), descsz = r.u32(off + 4), type = r.u32(off + 8);
+			std::uint64_t name = off + 12;
+			std::uint64_t desc = name + ((namesz + 3) & ~3ULL);
+			if (desc + descsz > end) break;
+			if (type == NT_GNU_BUILD_ID && namesz == 4 && std::memcmp(data + name, "GNU", 4) == 0) {
+				for (std::uint32_t i = 0; i < descsz; ++i) {
+					char hex[3];
+					std::snprintf(hex, sizeof(hex), "%02x", data[desc + i]);
+					elf.buildId += hex;
+				}
+			}
+			off = desc + ((descsz + 3) & ~3ULL);
+		}
+	};
+	for (const auto &sec : elf.sections) {
+		if (sec.type == SHT_NOTE) scanNotes(sec.offset, sec.size);
+	}
+	if (elf.sections.empty()) {
+		for (const auto &seg : elf.segments) {
+			if (seg.type == PT_NOTE) scanNotes(seg.offset, seg.filesz);
 		}
 	}
-	if (!quiet) std::cerr << "[exec] " << cmd << "\n";
-	int rc = std::system(cmd.c_str());
-	if (rc == -1) return errno ? errno : 1;
-	return WEXITSTATUS(rc);
+	r.ok = true;
+
+	// UPX leaves its "UPX!" marker right behind the program headers
+	const std::size_t probe = std::min<std::size_t>(size, 4096);
+	static const char upxMagic[] = {'U', 'P', 'X', '!'};
+	elf.upxPacked = std::search(data, data + probe, upxMagic, upxMagic + 4) != data + probe;
+	return elf;
 }
 
-static std::uintmax_t fileSize(const fs::path &p) {
-	std::error_code ec;
-	auto sz = fs::file_size(p, ec);
-	return ec ? 0 : sz;
+static std::optional<ElfInfo> readElf(const fs::path &path) {
+	MappedFile file(path);
+	if (!file.ok()) return std::nullopt;
+	return parseElf(file.data(), file.size());
 }
 
-struct Tools {
-	std::optional<std::string> strip;
-	std::optional<std::string> objcopy;
-	std::optional<std::string> upx;
-	std::optional<std::string> patchelf;
-	std::optional<std::string> sstrip;
+static bool isDebugSection(const ElfSection &sec) {
+	return sec.name.rfind(".debug", 0) == 0 || sec.name.rfind(".zdebug", 0) == 0;
+}
+
+// What debuggers need to find split-out debug info for a stripped binary
+static bool isDebugLinkSection(const ElfSection &sec) {
+	return sec.name == ".gnu_debuglink" || sec.name == ".note.gnu.build-id";
+}
+
+static bool isMetadataSection(const ElfSection &sec) {
+	return sec.name == ".comment" || sec.name == ".note" || sec.name.rfind(".note.", 0) == 0 || sec.name == ".gnu_debuglink";
+}
+
+// What strip removes for linked binaries: the static symbol table, debug
+// info and static relocations.
+static bool hasStrippableSymbols(const ElfInfo &elf) {
+	for (const auto &sec : elf.sections) {
+		if (sec.type == SHT_SYMTAB || isDebugSection(sec)) return true;
+		if ((sec.type == SHT_REL || sec.type == SHT_RELA) && !(sec.flags & SHF_ALLOC)) return true;
+	}
+	return false;
+}
+
+static bool hasDebugSections(const ElfInfo &elf) {
+	return std::any_of(elf.sections.begin(), elf.sections.end(), isDebugSection);
+}
+
+static bool hasUncompressedDebug(const ElfInfo &elf) {
+	return std::any_of(elf.sections.begin(), elf.sections.end(), [](const ElfSection &sec) {
+		return sec.name.rfind(".debug", 0) == 0 && sec.type != SHT_NOBITS && sec.size > 0 && !(sec.flags & SHF_COMPRESSED);
+	});
+}
+
+static bool hasMetadataSections(const ElfInfo &elf) {
+	return std::any_of(elf.sections.begin(), elf.sections.end(), isMetadataSection);
+}
+
+static bool hasUnlinkedMetadata(const ElfInfo &elf) {
+	return std::any_of(elf.sections.begin(), elf.sections.end(), [](const ElfSection &sec) { return isMetadataSection(sec) && !isDebugLinkSection(sec); });
+}
+
+static bool hasRpath(const ElfInfo &elf) {
+	return elf.rpath || elf.runpath;
+}
+
+// sstrip drops the section header table and anything not covered by a segment
+static bool hasSuperStrippableData(const ElfInfo &elf) {
+	if (!elf.sections.empty()) return true;
+	std::uint64_t end = elf.phoff + elf.segments.size() * (elf.is64 ? 56 : 32);
+	for (const auto &seg : elf.segments) end = std::max(end, seg.offset + seg.filesz);
+	return end < elf.fileSize;
+}
+
+// What a PIE looks like next to a shared library: DF_1_PIE where the linker
+// records it, otherwise an interpreter without a soname (libc has both).
+static bool isExecutableElf(const ElfInfo &elf) {
+	if (elf.type == ET_EXEC) return true;
+	if (elf.type != ET_DYN) return false;
+	bool soname = false;
+	for (const auto &[tag, val] : elf.dynamic) {
+		if (tag == DT_FLAGS_1 && (val & DF_1_PIE)) return true;
+		if (tag == DT_SONAME) soname = true;
+	}
+	return !soname && std::any_of(elf.segments.begin(), elf.segments.end(), [](const ElfSegment &s) { return s.type == PT_INTERP; });
+}
+
+// Selects the pipeline: executables get every step, shared libraries only
+// lose their static symbols and debug info, relocatable objects keep
+// symbols and relocations, and archives are handled per member.
+enum class FileKind { Executable, SharedLibrary, Object, Archive };
+
+static std::optional<FileKind> elfKind(const ElfInfo &elf) {
+	if (elf.type == ET_REL) return FileKind::Object;
+	if (elf.type != ET_EXEC && elf.type != ET_DYN) return std::nullopt;
+	return isExecutableElf(elf) ? FileKind::Executable : FileKind::SharedLibrary;
+}
+
+// One member of a System V / GNU ar archive. `header` is the offset of its
+// 60-byte header, `data` and `size` locate the contents.
+struct ArMember {
+	std::string name;
+	std::uint64_t header = 0;
+	std::uint64_t data = 0;
+	std::uint64_t size = 0;
 };
 
-static Tools detectTools() {
-	Tools t;
-	// Prefer LLVM tools on Termux; fallback to GNU
-	t.strip = which("llvm-strip");
-	if (!t.strip) t.strip = which("strip");
-	// objcopy
-	t.objcopy = which("llvm-objcopy");
-	if (!t.objcopy) t.objcopy = which("objcopy");
-	// upx is optional
-	t.upx = which("upx");
-	// patchelf and sstrip are optional
-	t.patchelf = which("patchelf");
-	t.sstrip = which("sstrip");
-	return t;
+struct ArArchive {
+	std::vector<ArMember> members; // in file order, including the index and name table
+	std::optional<std::size_t> index; // "/" or "/SYM64/" symbol index
+};
+
+static constexpr char kArMagic[] = "!<arch>\n";
+
+// Splits an archive into members; thin archives and malformed headers are
+// rejected. BSD "#1/N" names are resolved so the data offset is right.
+static std::optional<ArArchive> parseArchive(const unsigned char *data, std::size_t size) {
+	if (size < 8 || std::memcmp(data, kArMagic, 8) != 0) return std::nullopt;
+	ArArchive ar;
+	std::string longNames;
+	for (std::uint64_t off = 8; off < size;) {
+		if (size - off < 60 || data[off + 58] != '`' || data[off + 59] != '\n') return std::nullopt;
+		const char *h = reinterpret_cast<const char *>(data + off);
+		std::string sizeField(h + 48, 10);
+		char *end = nullptr;
+		const unsigned long long len = std::strtoull(sizeField.c_str(), &end, 10);
+		if (end == sizeField.c_str() || len > size - off - 60) return std::nullopt;
+		ArMember m;
+		m.header = off;
+		m.data = off + 60;
+		m.size = len;
+		m.name.assign(h, 16);
+		while (!m.name.empty() && m.name.back() == ' ') m.name.pop_back();
+		if (m.name.rfind("#1/", 0) == 0) {
+			const std::uint64_t n = std::strtoull(m.name.c_str() + 3, nullptr, 10);
+			if (n > m.size) return std::nullopt;
+			m.name.assign(reinterpret_cast<const char *>(data + m.data), n);
+			m.data += n;
+			m.size -= n;
+		} else if (m.name == "//") {
+			longNames.assign(reinterpret_cast<const char *>(data + m.data), m.size);
+		} else if (m.name == "/" || m.name == "/SYM64/") {
+			ar.index = ar.members.size();
+		} else if (m.name.size() > 1 && m.name[0] == '/' && std::isdigit(static_cast<unsigned char>(m.name[1]))) {
+			const std::size_t at = std::strtoull(m.name.c_str() + 1, nullptr, 10);
+			if (at < longNames.size()) m.name = longNames.substr(at, longNames.find_first_of("/\n", at) - at);
+		} else if (m.name.size() > 1 && m.name.back() == '/') {
+			m.name.pop_back();
+		}
+		ar.members.push_back(std::move(m));
+		off += 60 + len + (len & 1);
+	}
+	return ar;
 }
 
-static bool backupOnce(const fs::path &target) {
-	fs::path backupPath = target;
-	backupPath += ".bak";
-	if (fs::exists(backupPath)) return true;
-	std::error_code ec;
-	fs::copy_file(target, backupPath, fs::copy_options::overwrite_existing, ec);
-	if (ec) {
-		std::cerr << "Failed to create backup: " << ec.message() << "\n";
+static bool hasArchiveMagic(const unsigned char *p, std::size_t n) {
+	return n >= 8 && std::memcmp(p, kArMagic, 8) == 0;
+}
+
+// Archives count only when they hold ELF objects; .deb packages share the magic.
+static std::optional<FileKind> classifyFile(const fs::path &path) {
+	MappedFile file(path);
+	if (!file.ok()) return std::nullopt;
+	if (hasArchiveMagic(file.data(), file.size())) {
+		auto ar = parseArchive(file.data(), file.size());
+		if (!ar) return std::nullopt;
+		for (const auto &m : ar->members) {
+			if (hasElfMagic(file.data() + m.data, m.size)) return FileKind::Archive;
+		}
+		return std::nullopt;
+	}
+	auto elf = parseElf(file.data(), file.size());
+	if (!elf) return std::nullopt;
+	return elfKind(*elf);
+}
+
+// Executables still need the execute bit; libraries, objects and archives
+// are picked up without it.
+static bool isOptimizable(const fs::path &path) {
+	auto kind = classifyFile(path);
+	return kind && (*kind != FileKind::Executable || isExecutableFile(path));
+}
+
+// Stores `v` into `buf` at `off` using the file's byte order.
+static void storeInt(std::string &buf, std::size_t off, std::uint64_t v, unsigned width, bool little) {
+	for (unsigned i = 0; i < width; ++i) {
+		unsigned shift = little ? 8 * i : 8 * (width - 1 - i);
+		buf[off + i] = static_cast<char>((v >> shift) & 0xff);
+	}
+}
+
+// Writes `chunks` sequentially into a temporary sibling of `target` and
+// renames it over the original, keeping the original's mode.
+static bool replaceFile(const fs::path &target, const std::vector<std::pair<const void *, std::size_t>> &chunks, std::string &err) {
+	struct stat st{};
+	if (stat(target.c_str(), &st) != 0) {
+		err = std::strerror(errno);
 		return false;
 	}
-	return true;
+	std::string tmpl = target.string() + ".optimz-XXXXXX";
+	int fd = mkstemp(tmpl.data());
+	if (fd < 0) {
+		err = std::string("cannot create temporary file: ") + std::strerror(errno);
+		return false;
+	}
+	bool ok = fchmod(fd, st.st_mode & 07777) == 0;
+	if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+		// Not being able to keep the owner is expected when not running as root
+	}
+	std::vector<struct iovec> iov;
+	for (const auto &[p, n] : chunks) {
+		if (n) iov.push_back({const_cast<void *>(p), n});
+	}
+	std::size_t next = 0;
+	while (ok && next < iov.size()) {
+		int count = static_cast<int>(std::min<std::size_t>(iov.size() - next, IOV_MAX));
+		ssize_t n = writev(fd, iov.data() + next, count);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			ok = false;
+			break;
+		}
+		// Skip over fully written vectors and trim a partially written one
+		auto left = static_cast<std::size_t>(n);
+		while (next < iov.size() && left >= iov[next].iov_len) left -= iov[next++].iov_len;
+		if (left) {
+			iov[next].iov_base = static_cast<char *>(iov[next].iov_base) + left;
+			iov[next].iov_len -= left;
+		}
+	}
+	if (!ok) err = std::string("write failed: ") + std::strerror(errno);
+	if (close(fd) != 0 && ok) {
+		err = std::string("write failed: ") + std::strerror(errno);
+		ok = false;
+	}
+	if (ok && rename(tmpl.c_str(), target.c_str()) != 0) {
+		err = std::string("rename failed: ") + std::strerror(errno);
+		ok = false;
+	}
+	if (!ok) unlink(tmpl.c_str());
+	return ok;
 }
 
-static bool optimizeOnce(const fs::path &target, const Tools &tools) {
-	bool anyShrank = false;
-	std::uintmax_t sizeNow = fileSize(target);
-	std::uintmax_t beforeStep = 0;
+enum class RewriteResult { Changed, Unchanged, Declined };
 
-	auto tryStep = [&](const std::vector<std::string> &cmd) {
-		beforeStep = sizeNow;
-		int rc = runCommand(cmd, true);
-		sizeNow = fileSize(target);
-		if (rc == 0 && sizeNow < beforeStep) {
-			anyShrank = true;
+// Which section groups the built-in engine removes in one rewrite.
+struct NativeStrip {
+	bool symbols = false;  // like strip --strip-all: .symtab/.strtab and static relocations
+	bool debug = false;    // like --strip-debug: .debug_* and .zdebug_*
+	bool metadata = false; // non-allocated .comment, .note*, .gnu_debuglink
+	bool keepDebugLinks = false; // except .gnu_debuglink and the build ID
+};
+
+static bool nativeDrops(const ElfSection &sec, const NativeStrip &what) {
+	// Allocated sections are part of the loaded image and are never touched
+	if (sec.flags & SHF_ALLOC) return false;
+	if (what.symbols && (sec.type == SHT_SYMTAB || sec.type == SHT_REL || sec.type == SHT_RELA)) return true;
+	if ((what.symbols || what.debug) && isDebugSection(sec)) return true;
+	return what.metadata && isMetadataSection(sec) && !(what.keepDebugLinks && isDebugLinkSection(sec));
+}
+
+static bool nativeHasWork(const ElfInfo &elf, const NativeStrip &what) {
+	return std::any_of(elf.sections.begin(), elf.sections.end(), [&](const ElfSection &sec) { return nativeDrops(sec, what); });
+}
+
+// Removes non-allocated sections from a linked executable or shared object.
+// Everything covered by a segment is copied verbatim; surviving
+// non-allocated sections, a rebuilt .shstrtab and the section header table
+// are laid out after it and the result is emitted in one sequential write.
+static RewriteResult nativeStripFile(const fs::path &target, const NativeStrip &what, std::string &err) {
+	MappedFile file(target);
+	if (!file.ok()) {
+		err = "cannot map file";
+		return RewriteResult::Declined;
+	}
+	auto parsed = parseElf(file.data(), file.size());
+	if (!parsed) {
+		err = "unsupported ELF layout";
+		return RewriteResult::Declined;
+	}
+	const ElfInfo &elf = *parsed;
+	if (elf.type != ET_EXEC && elf.type != ET_DYN) {
+		err = "only linked executables and shared objects are rewritten natively";
+		return RewriteResult::Declined;
+	}
+	const std::size_t shnum = elf.sections.size();
+	if (shnum == 0 || shnum >= SHN_LORESERVE || elf.shstrndx == SHN_UNDEF || elf.shstrndx >= shnum) {
+		err = "no usable section header table";
+		return RewriteResult::Declined;
+	}
+
+	std::vector<bool> drop(shnum, false);
+	for (std::size_t i = 1; i < shnum; ++i) drop[i] = i != elf.shstrndx && nativeDrops(elf.sections[i], what);
+	// A symbol table's string table goes with it unless something else uses it
+	for (std::size_t i = 1; i < shnum; ++i) {
+		const ElfSection &sec = elf.sections[i];
+		if (!drop[i] || sec.type != SHT_SYMTAB || sec.link == elf.shstrndx || sec.link >= shnum) continue;
+		bool used = false;
+		for (std::size_t j = 1; j < shnum; ++j) used = used || (!drop[j] && j != sec.link && elf.sections[j].link == sec.link);
+		if (!used && !(elf.sections[sec.link].flags & SHF_ALLOC)) drop[sec.link] = true;
+	}
+	// Sections referring to removed ones must go too; allocated ones cannot
+	for (bool again = true; again;) {
+		again = false;
+		for (std::size_t i = 1; i < shnum; ++i) {
+			const ElfSection &sec = elf.sections[i];
+			if (drop[i]) continue;
+			bool refsDropped = (sec.link && sec.link < shnum && drop[sec.link]) ||
+			                   (((sec.flags & SHF_INFO_LINK) || sec.type == SHT_REL || sec.type == SHT_RELA) && sec.info && sec.info < shnum && drop[sec.info]);
+			if (!refsDropped) continue;
+			if (sec.flags & SHF_ALLOC) {
+				err = "allocated section " + sec.name + " refers to a removed section";
+				return RewriteResult::Declined;
+			}
+			drop[i] = true;
+			again = true;
 		}
-	};
+	}
+	if (std::find(drop.begin(), drop.end(), true) == drop.end()) return RewriteResult::Unchanged;
 
-	// 1) Strip symbols (unneeded first, then all)
-	if (tools.strip) {
-		tryStep({*tools.strip, "--strip-unneeded", target.string()});
-		tryStep({*tools.strip, "--strip-all", target.string()});
+	// .dynsym stores section indices, so only sections after the last
+	// allocated one may disappear without renumbering anything it uses
+	std::size_t lastAlloc = 0;
+	for (std::size_t i = 1; i < shnum; ++i) {
+		if (elf.sections[i].flags & SHF_ALLOC) lastAlloc = i;
+	}
+	for (std::size_t i = 1; i < lastAlloc; ++i) {
+		if (drop[i]) {
+			err = "section " + elf.sections[i].name + " precedes allocated sections";
+			return RewriteResult::Declined;
+		}
 	}
 
-	// 2) Remove debug info and common note/comment sections
-	if (tools.objcopy) {
-		tryStep({*tools.objcopy, "--strip-debug", target.string()});
-		// Remove non-essential metadata sections
-		tryStep({*tools.objcopy, "--remove-section=.comment", "--remove-section=.note", "--remove-section=.note.*", "--remove-section=.gnu_debuglink", target.string()});
-		// Compress whatever debug sections may remain
-		tryStep({*tools.objcopy, "--compress-debug-sections", target.string()});
+	const unsigned w = elf.is64 ? 8 : 4;
+	const std::size_t ehsize = elf.is64 ? 64 : 52;
+	const std::size_t shentsize = elf.is64 ? 64 : 40;
+	const std::size_t phentsize = elf.is64 ? 56 : 32;
+
+	// Everything up to the end of the loaded image stays where it is
+	std::uint64_t fixedEnd = std::max<std::uint64_t>(ehsize, elf.phoff + elf.segments.size() * phentsize);
+	for (const auto &seg : elf.segments) fixedEnd = std::max(fixedEnd, seg.offset + seg.filesz);
+	for (const auto &sec : elf.sections) {
+		if ((sec.flags & SHF_ALLOC) && sec.type != SHT_NOBITS) fixedEnd = std::max(fixedEnd, sec.offset + sec.size);
+	}
+	for (std::size_t i = 1; i < shnum; ++i) {
+		const ElfSection &sec = elf.sections[i];
+		if (!drop[i] && i != elf.shstrndx && sec.type != SHT_NOBITS && sec.offset < fixedEnd) fixedEnd = std::max(fixedEnd, sec.offset + sec.size);
+	}
+	if (fixedEnd > file.size()) {
+		err = "segments extend past end of file";
+		return RewriteResult::Declined;
 	}
 
-	// 3) Shrink RPATH if present
-	if (tools.patchelf) {
-		tryStep({*tools.patchelf, "--shrink-rpath", target.string()});
+	std::vector<std::size_t> newIndex(shnum, 0);
+	std::size_t kept = 0;
+	for (std::size_t i = 0; i < shnum; ++i) {
+		if (!drop[i]) newIndex[i] = kept++;
 	}
 
-	// 4) Super-strip (more aggressive)
-	if (tools.sstrip) {
-		tryStep({*tools.sstrip, target.string()});
+	std::string shstrtab(1, '\0');
+	std::vector<std::uint32_t> nameOff(shnum, 0);
+	for (std::size_t i = 1; i < shnum; ++i) {
+		if (drop[i]) continue;
+		const std::string &name = elf.sections[i].name;
+		std::size_t pos = shstrtab.find(name + '\0');
+		if (name.empty()) pos = 0;
+		if (pos == std::string::npos) {
+			pos = shstrtab.size();
+			shstrtab += name;
+			shstrtab += '\0';
+		}
+		nameOff[i] = static_cast<std::uint32_t>(pos);
 	}
 
-	// 5) Pack with UPX as final step
-	if (tools.upx) {
-		tryStep({*tools.upx, "--best", "--lzma", target.string()});
+	// Lay out relocated sections in their original file order
+	std::vector<std::size_t> order;
+	for (std::size_t i = 1; i < shnum; ++i) {
+		const ElfSection &sec = elf.sections[i];
+		if (!drop[i] && i != elf.shstrndx && sec.type != SHT_NOBITS && sec.offset >= fixedEnd) order.push_back(i);
 	}
+	std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return elf.sections[a].offset < elf.sections[b].offset; });
 
-	std::cerr << "Size: " << (fileSize(target) + 0) << " bytes\n";
-	return anyShrank;
-}
+	static const char zeros[64] = {};
+	std::vector<std::pair<const void *, std::size_t>> chunks;
+	std::vector<std::uint64_t> newOffset(shnum, 0);
+	for (std::size_t i = 0; i < shnum; ++i) newOffset[i] = elf.sections[i].offset;
+	std::string header(reinterpret_cast<const char *>(file.data()), ehsize);
+	chunks.emplace_back(header.data(), header.size());
+	chunks.emplace_back(file.data() + ehsize, fixedEnd - ehsize);
+	std::uint64_t pos = fixedEnd;
+	auto padTo = [&](std::uint64_t align) {
+		if (align <= 1) return;
+		std::uint64_t pad = (align - pos % align) % align;
+		pos += pad;
+		while (pad) {
+			std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(pad, sizeof(zeros)));
+			chunks.emplace_back(zeros, n);
+			pad -= n;
+		}
+	};
+	for (std::size_t i : order) {
+		const ElfSection &sec = elf.sections[i];
+		if (sec.offset + sec.size > file.size()) {
+			err = "section " + sec.name + " extends past end of file";
+			return RewriteResult::Declined;
+		}
+		padTo(sec.addralign);
+		newOffset[i] = pos;
+		chunks.emplace_back(file.data() + sec.offset, sec.size);
+		pos += sec.size;
+	}
+	newOffset[elf.shstrndx] = pos;
+	chunks.emplace_back(shstrtab.data(), shstrtab.size());
+	pos += shstrtab.size();
+	padTo(w);
+	const std::uint64_t shoff = pos;
 
-static void usage(const char *argv0) {
-	std::cerr << "Usage: " << argv0 << " <program_path> -<times>\n";
-	std::cerr << "\tPerforms multiple optimization passes over an ELF binary.\n";
-	std::cerr << "\t<times> defaults to 1 if omitted. Example: " << argv0 << " ./a.out -2\n";
+	std::string table;
+	table.reserve(kept * shentsize);
+	for (std::size_t i = 0; i < shnum; ++i) {
+		if (drop[i]) continue;
+		const ElfSection &sec = elf.sections[i];
+		std::size_t at = table.size();
+		table.append(reinterpret_cast<const char *>(file.data() + elf.shoff + i * shentsize), shentsize);
+		storeInt(table, at, nameOff[i], 4, elf.littleEndian);
+		storeInt(table, at + (elf.is64 ? 24 : 16), newOffset[i], w, elf.littleEndian);
+		if (i == elf.shstrndx) storeInt(table, at + (elf.is64 ? 32 : 20), shstrtab.size(), w, elf.littleEndian);
+		std::uint32_t link = sec.link < shnum ? static_cast<std::uint32_t>(newIndex[sec.link]) : sec.link;
+		storeInt(table, at + (elf.is64 ? 40 : 24), link, 4, elf.littleEndian);
+		if (((sec.flags & SHF_INFO_LINK) || sec.type == SHT_REL || sec.type == SHT_RELA) && sec.info < shnum) {
+			storeInt(table, at + (elf.is64 ? 44 : 28), newIndex[sec.info], 4, elf.littleEndian);
+		}
+	}
+	chunks.emplace_back(table.data(), table.size());
+
+	storeInt(header, elf.is64 ? 40 : 32, shoff, w, elf.littleEndian);
+	storeInt(header, elf.is64 ? 58 : 46, shentsize, 2, elf.littleEndian);
+	storeInt(header, elf.is64 ? 60 : 48, kept, 2, elf.littleEndian);
+	storeInt(header, elf.is64 ? 62 : 50, newIndex[elf.shstrndx], 2, elf.littleEndian);
+
+	if (!replaceFile(target, chunks, err)) return RewriteResult::Declined;
+	return RewriteResult::Changed;
 }
 
-int main(int argc, char **argv) {
-	if (argc < 2) {
-		usage(argv[0]);
-		return 1;
+// libzstd, loaded on first use: Opt neither links against it nor needs its
+// headers, and without it zstd debug compression falls back to objcopy.
+// Only the stable advanced API (ZSTD_compress2 and two parameters) is used.
+class Zstd {
+public:
+	static const Zstd *get() {
+		static const std::unique_ptr<Zstd> lib = load();
+		return lib.get();
 	}
 
-	fs::path target = argv[1];
-	int passes = 1;
-	if (argc >= 3) {
-		std::string a2 = argv[2];
-		if (!a2.empty() && a2[0] == '-') {
-			try {
-				passes = std::stoi(a2.substr(1));
-			} catch (...) {
-				std::cerr << "Invalid optimization count: " << a2 << "\n";
-				return 1;
-			}
-		} else {
-			std::cerr << "Second argument must be -<times> (e.g., -2)\n";
-			return 1;
+	// One zstd frame of `size` bytes at `level`; `threads` > 1 asks libzstd
+	// for that many workers, which builds without threading ignore
+	bool compress(const unsigned char *data, std::size_t size, int level, unsigned threads, std::string &out) const {
+		void *cctx = createCCtx_();
+		if (!cctx) return false;
+		setParameter_(cctx, kCompressionLevel, level);
+		if (threads > 1) setParameter_(cctx, kNbWorkers, static_cast<int>(threads));
+		out.resize(compressBound_(size));
+		const std::size_t n = compress2_(cctx, out.data(), out.size(), data, size);
+		freeCCtx_(cctx);
+		if (isError_(n)) return false;
+		out.resize(n);
+		return true;
+	}
+
+private:
+	// ZSTD_cParameter values of the stable API
+	static constexpr int kCompressionLevel = 100;
+	static constexpr int kNbWorkers = 400;
+
+	static std::unique_ptr<Zstd> load() {
+		void *handle = nullptr;
+		for (const char *name : {"libzstd.so.1", "libzstd.so"}) {
+			if ((handle = dlopen(name, RTLD_NOW | RTLD_LOCAL))) break;
 		}
+		if (!handle) return nullptr;
+		auto lib = std::make_unique<Zstd>();
+		bool ok = true;
+		auto bind = [&](auto &fn, const char *symbol) {
+			fn = reinterpret_cast<std::remove_reference_t<decltype(fn)>>(dlsym(handle, symbol));
+			ok = ok && fn;
+		};
+		bind(lib->createCCtx_, "ZSTD_createCCtx");
+		bind(lib->freeCCtx_, "ZSTD_freeCCtx");
+		bind(lib->setParameter_, "ZSTD_CCtx_setParameter");
+		bind(lib->compress2_, "ZSTD_compress2");
+		bind(lib->compressBound_, "ZSTD_compressBound");
+		bind(lib->isError_, "ZSTD_isError");
+		if (ok) return lib;
+		dlclose(handle);
+		return nullptr;
 	}
-	if (passes < 1) passes = 1;
 
-	if (!fs::exists(target)) {
-		std::cerr << "Target not found: " << target << "\n";
-		return 1;
+	void *(*createCCtx_)() = nullptr;
+	std::size_t (*freeCCtx_)(void *) = nullptr;
+	std::size_t (*setParameter_)(void *, int, int) = nullptr;
+	std::size_t (*compress2_)(void *, void *, std::size_t, const void *, std::size_t) = nullptr;
+	std::size_t (*compressBound_)(std::size_t) = nullptr;
+	unsigned (*isError_)(std::size_t) = nullptr;
+};
+
+// ch_type for zstd (gABI 2022); older <elf.h> lack ELFCOMPRESS_ZSTD
+constexpr std::uint32_t kElfCompressZstd = 2;
+
+// Compresses every uncompressed .debug_* section after the loaded image as
+// ELFCOMPRESS_ZSTD: an Elf_Chdr followed by one zstd frame, with
+// SHF_COMPRESSED set. Sections that would not shrink stay as they are.
+// Sections of 8 MiB or more compress one at a time on `threads` libzstd
+// workers, then the rest concurrently on `threads` threads. The layout follows nativeStripFile: the image
+// is copied verbatim and the sections after it are laid out again.
+static RewriteResult compressDebugFile(const fs::path &target, int level, unsigned threads, std::string &err) {
+	const Zstd *zstd = Zstd::get();
+	if (!zstd) {
+		err = "libzstd is not available";
+		return RewriteResult::Declined;
 	}
-	if (!isExecutableFile(target)) {
-		std::cerr << "Target is not an executable file (or lacks execute permission): " << target << "\n";
-		return 1;
+	MappedFile file(target);
+	if (!file.ok()) {
+		err = "cannot map file";
+		return RewriteResult::Declined;
 	}
-	if (!isElfBinary(target)) {
-		std::cerr << "Target is not an ELF binary. Skipping.\n";
-		return 1;
+	auto parsed = parseElf(file.data(), file.size());
+	if (!parsed) {
+		err = "unsupported ELF layout";
+		return RewriteResult::Declined;
 	}
+	const ElfInfo &elf = *parsed;
+	const std::size_t shnum = elf.sections.size();
+	if ((elf.type != ET_EXEC && elf.type != ET_DYN) || shnum == 0 || shnum >= SHN_LORESERVE || !elf.shoff) {
+		err = "only linked executables and shared objects with section headers are rewritten natively";
+		return RewriteResult::Declined;
+	}
+	const unsigned w = elf.is64 ? 8 : 4;
+	const std::size_t ehsize = elf.is64 ? 64 : 52;
+	const std::size_t shentsize = elf.is64 ? 64 : 40;
+	const std::size_t phentsize = elf.is64 ? 56 : 32;
 
-	Tools tools = detectTools();
-	if (!tools.strip && !tools.objcopy && !tools.upx) {
-		std::cerr << "No optimization tools found in PATH (llvm-strip/strip, llvm-objcopy/objcopy, upx).\n";
-		return 1;
+	std::uint64_t fixedEnd = std::max<std::uint64_t>(ehsize, elf.phoff + elf.segments.size() * phentsize);
+	for (const auto &seg : elf.segments) fixedEnd = std::max(fixedEnd, seg.offset + seg.filesz);
+	for (const auto &sec : elf.sections) {
+		if ((sec.flags & SHF_ALLOC) && sec.type != SHT_NOBITS) fixedEnd = std::max(fixedEnd, sec.offset + sec.size);
+	}
+	if (fixedEnd > file.size()) {
+		err = "segments extend past end of file";
+		return RewriteResult::Declined;
+	}
+	std::vector<std::size_t> order;
+	for (std::size_t i = 1; i < shnum; ++i) {
+		const ElfSection &sec = elf.sections[i];
+		if (sec.type == SHT_NOBITS || sec.offset < fixedEnd) continue;
+		if (sec.offset + sec.size > file.size()) {
+			err = "section " + sec.name + " extends past end of file";
+			return RewriteResult::Declined;
+		}
+		order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return elf.sections[a].offset < elf.sections[b].offset; });
+
+	// Biggest first, so the long ones do not start last
+	std::vector<std::size_t> work;
+	for (std::size_t i : order) {
+		const ElfSection &sec = elf.sections[i];
+		if (sec.name.rfind(".debug", 0) == 0 && sec.type == SHT_PROGBITS && sec.size > 0 && !(sec.flags & (SHF_COMPRESSED | SHF_ALLOC))) work.push_back(i);
 	}
+	if (work.empty()) return RewriteResult::Unchanged;
+	std::sort(work.begin(), work.end(), [&](std::size_t a, std::size_t b) { return elf.sections[a].size > elf.sections[b].size; });
+	std::vector<std::string> packed(shnum);
+	std::vector<char> failed(shnum, 0);
+	auto compress = [&](std::size_t i, unsigned inner) {
+		const ElfSection &sec = elf.sections[i];
+		failed[i] = !zstd->compress(file.data() + sec.offset, static_cast<std::size_t>(sec.size), level, inner, packed[i]);
+	};
+	// `work` is sorted by size, so the large sections lead
+	std::size_t small = 0;
+	while (small < work.size() && elf.sections[work[small]].size >= (std::uint64_t(8) << 20)) compress(work[small++], threads);
+	std::atomic<std::size_t> next{small};
+	auto worker = [&] {
+		for (std::size_t k; (k = next.fetch_add(1)) < work.size();) compress(work[k], 1);
+	};
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < std::min<std::size_t>(threads, work.size() - small); ++t) pool.emplace_back(worker);
+	worker();
+	for (auto &t : pool) t.join();
 
-	if (!backupOnce(target)) return 1;
+	// Elf64_Chdr: type, reserved, size, addralign; Elf32_Chdr: type, size, addralign
+	const std::size_t chdrSize = elf.is64 ? 24 : 12;
+	std::vector<std::string> chdr(shnum);
+	bool changed = false;
+	for (std::size_t i : work) {
+		const ElfSection &sec = elf.sections[i];
+		if (failed[i] || chdrSize + packed[i].size() >= sec.size) {
+			packed[i].clear();
+			continue;
+		}
+		std::string &h = chdr[i];
+		h.assign(chdrSize, '\0');
+		storeInt(h, 0, kElfCompressZstd, 4, elf.littleEndian);
+		storeInt(h, elf.is64 ? 8 : 4, sec.size, w, elf.littleEndian);
+		storeInt(h, elf.is64 ? 16 : 8, std::max<std::uint64_t>(sec.addralign, 1), w, elf.littleEndian);
+		changed = true;
+	}
+	if (!changed) return RewriteResult::Unchanged;
 
-	for (int i = 1; i <= passes; ++i) {
-		std::cerr << "Pass " << i << "/" << passes << "\n";
-		bool shrank = optimizeOnce(target, tools);
-		if (!shrank) {
-			std::cerr << "No further changes; stopping early.\n";
-			break;
+	static const char zeros[64] = {};
+	std::vector<std::pair<const void *, std::size_t>> chunks;
+	std::string header(reinterpret_cast<const char *>(file.data()), ehsize);
+	chunks.emplace_back(header.data(), header.size());
+	chunks.emplace_back(file.data() + ehsize, fixedEnd - ehsize);
+	std::uint64_t pos = fixedEnd;
+	auto padTo = [&](std::uint64_t align) {
+		if (align <= 1) return;
+		std::uint64_t pad = (align - pos % align) % align;
+		pos += pad;
+		while (pad) {
+			std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(pad, sizeof(zeros)));
+			chunks.emplace_back(zeros, n);
+			pad -= n;
+		}
+	};
+	std::vector<std::uint64_t> newOffset(shnum), newSize(shnum);
+	for (std::size_t i = 0; i < shnum; ++i) {
+		newOffset[i] = elf.sections[i].offset;
+		newSize[i] = elf.sections[i].size;
+	}
+	for (std::size_t i : order) {
+		const ElfSection &sec = elf.sections[i];
+		if (chdr[i].empty()) {
+			padTo(sec.addralign);
+			newOffset[i] = pos;
+			chunks.emplace_back(file.data() + sec.offset, sec.size);
+			pos += sec.size;
+			continue;
 		}
+		padTo(w);
+		newOffset[i] = pos;
+		newSize[i] = chdr[i].size() + packed[i].size();
+		chunks.emplace_back(chdr[i].data(), chdr[i].size());
+		chunks.emplace_back(packed[i].data(), packed[i].size());
+		pos += newSize[i];
+	}
+	padTo(w);
+	const std::uint64_t shoff = pos;
+	std::string table(reinterpret_cast<const char *>(file.data() + elf.shoff), shnum * shentsize);
+	for (std::size_t i = 1; i < shnum; ++i) {
+		const std::size_t at = i * shentsize;
+		storeInt(table, at + (elf.is64 ? 24 : 16), newOffset[i], w, elf.littleEndian);
+		if (chdr[i].empty()) continue;
+		storeInt(table, at + 8, elf.sections[i].flags | SHF_COMPRESSED, w, elf.littleEndian);
+		storeInt(table, at + (elf.is64 ? 32 : 20), newSize[i], w, elf.littleEndian);
+		storeInt(table, at + (elf.is64 ? 48 : 32), w, w, elf.littleEndian);
 	}
+	chunks.emplace_back(table.data(), table.size());
+	storeInt(header, elf.is64 ? 40 : 32, shoff, w, elf.littleEndian);
+	storeInt(header, elf.is64 ? 58 : 46, shentsize, 2, elf.littleEndian);
+
+	if (!replaceFile(target, chunks, err)) return RewriteResult::Declined;
+	return RewriteResult::Changed;
+}
 
-	std::cerr << "Done.\n";
-	return 0;
+// Pages a PT_LOAD maps at `page` granularity, and the file pages it reads.
+static std::uint64_t pageSpan(std::uint64_t start, std::uint64_t size, std::uint64_t page) {
+	if (!size) return 0;
+	return (start + size + page - 1) / page - start / page;
 }
 
+// Distinct file pages the loadable segments read, i.e. the page cache
+// footprint of one mapping of the file.
+static std::uint64_t filePages(std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges, std::uint64_t page) {
+	std::sort(ranges.begin(), ranges.end());
+	std::uint64_t pages = 0, covered = 0; // `covered`: first page not yet counted
+	for (const auto &[off, size] : ranges) {
+		if (!size) continue;
+		const std::uint64_t first = std::max(off / page, covered), end = (off + size + page - 1) / page;
+		if (end > first) pages += end - first;
+		covered = std::max(covered, end);
+	}
+	return pages;
+}
+
+// Moves loadable segments down over the padding between them in the file.
+// Virtual addresses stay put, so code and data need no relocation, and the
+// pages each PT_LOAD maps (and faults) are the same afterwards: this only
+// saves file bytes. Every segment keeps p_offset congruent to p_vaddr
+// modulo the page size, which is the largest p_align unless `pageSize`
+// asks for smaller (and lowers p_align to match, so the file then only
+// loads with pages that size or smaller). Pages smaller than this
+// system's are refused. Non-allocated sections and the section header
+// table after the image move down with it. `report` describes the
+// mapping at those pages before and after.
+static RewriteResult compactLayoutFile(const fs::path &target, std::optional<std::uint64_t> pageSize, std::string &report, std::string &err) {
+	MappedFile file(target);
+	if (!file.ok()) {
+		err = "cannot map file";
+		return RewriteResult::Declined;
+	}
+	auto parsed = parseElf(file.data(), file.size());
+	if (!parsed) {
+		err = "unsupported ELF layout";
+		return RewriteResult::Declined;
+	}
+	const ElfInfo &elf = *parsed;
+	if ((elf.type != ET_EXEC && elf.type != ET_DYN) || elf.upxPacked) {
+		err = "only unpacked executables and shared objects have a layout to compact";
+		return RewriteResult::Declined;
+	}
+	std::vector<std::size_t> loads;
+	std::uint64_t maxAlign = 1, minAlign = UINT64_MAX;
+	for (std::size_t i = 0; i < elf.segments.size(); ++i) {
+		const ElfSegment &seg = elf.segments[i];
+		if (seg.type != PT_LOAD) continue;
+		loads.push_back(i);
+		maxAlign = std::max<std::uint64_t>(maxAlign, seg.align);
+		minAlign = std::min<std::uint64_t>(minAlign, std::max<std::uint64_t>(seg.align, 1));
+		if (seg.offset + seg.filesz > file.size() || seg.offset + seg.filesz < seg.offset) {
+			err = "segments extend past end of file";
+			return RewriteResult::Declined;
+		}
+	}
+	if (loads.empty()) {
+		err = "no loadable segments";
+		return RewriteResult::Declined;
+	}
+	const std::uint64_t page = pageSize.value_or(maxAlign);
+	if (page < 4096 || (page & (page - 1))) {
+		err = "segments are aligned to " + std::to_string(maxAlign) + " bytes, not a page size";
+		return RewriteResult::Declined;
+	}
+	const long hostPage = sysconf(_SC_PAGESIZE);
+	if (hostPage > 0 && page < static_cast<std::uint64_t>(hostPage)) {
+		err = "pages here are " + std::to_string(hostPage) + " bytes; the result would not load with " + std::to_string(page) + "-byte alignment";
+		return RewriteResult::Declined;
+	}
+	if (page > minAlign) {
+		err = "segments are aligned for pages of " + std::to_string(minAlign) + " bytes and would not load with " + std::to_string(page) + "-byte pages";
+		return RewriteResult::Declined;
+	}
+	std::sort(loads.begin(), loads.end(), [&](std::size_t a, std::size_t b) { return elf.segments[a].offset < elf.segments[b].offset; });
+	for (std::size_t i : loads) {
+		if ((elf.segments[i].offset - elf.segments[i].vaddr) % page) {
+			err = "segment offsets are not congruent to their addresses";
+			return RewriteResult::Declined;
+		}
+	}
+
+	// Overlapping (page-sharing) segments form one run of file bytes that
+	// moves as a whole; every shift is a multiple of the page size
+	struct Run {
+		std::uint64_t start, end; // old file range
+		std::uint64_t shift;      // bytes it moves down
+	};
+	std::vector<Run> runs;
+	std::vector<std::size_t> runOf(elf.segments.size(), SIZE_MAX);
+	for (std::size_t i : loads) {
+		const ElfSegment &seg = elf.segments[i];
+		if (!runs.empty() && seg.offset <= runs.back().end) {
+			runs.back().end = std::max(runs.back().end, seg.offset + seg.filesz);
+		} else if (runs.empty()) {
+			// The first segment holds the ELF and program headers: fixed
+			runs.push_back({seg.offset, seg.offset + seg.filesz, 0});
+		} else {
+			const std::uint64_t newEnd = runs.back().end - runs.back().shift;
+			const std::uint64_t at = newEnd + (seg.offset - newEnd) % page;
+			runs.push_back({seg.offset, seg.offset + seg.filesz, seg.offset - at});
+		}
+		runOf[i] = runs.size() - 1;
+	}
+	const std::uint64_t imageEnd = runs.back().end;
+	const std::uint64_t ehsize = elf.is64 ? 64 : 52;
+	ElfReader r{file.data(), file.size(), elf.littleEndian};
+	const std::uint64_t phentsize = r.u16(elf.is64 ? 54 : 42);
+	const std::uint64_t shentsize = r.u16(elf.is64 ? 58 : 46);
+	const std::uint64_t headEnd = std::max(ehsize, elf.phoff + elf.segments.size() * phentsize);
+	if (runs.front().start != 0 || headEnd > runs.front().end) {
+		err = "the program headers are not in the first segment";
+		return RewriteResult::Declined;
+	}
+
+	// Where an old file offset goes; npos for bytes between runs. Shifts
+	// only grow along the file, and the tail moves with the last run, so
+	// it keeps any alignment up to a page
+	const std::uint64_t npos = UINT64_MAX;
+	const std::uint64_t tailShift = runs.back().shift;
+	auto moved = [&](std::uint64_t off, bool empty) -> std::uint64_t {
+		if (off >= imageEnd) return off - tailShift;
+		for (const Run &run : runs) {
+			if (off >= run.start && (off < run.end || (empty && off == run.end))) return off - run.shift;
+		}
+		return npos;
+	};
+	std::vector<std::uint64_t> secOffset(elf.sections.size(), 0);
+	for (std::size_t i = 1; i < elf.sections.size(); ++i) {
+		const ElfSection &sec = elf.sections[i];
+		const bool empty = sec.type == SHT_NOBITS || sec.size == 0;
+		secOffset[i] = moved(sec.offset, empty);
+		if (secOffset[i] != npos) continue;
+		if (!empty) {
+			err = "section " + sec.name + " lies between segments";
+			return RewriteResult::Declined;
+		}
+		// Offsets of empty sections in a gap mean nothing; keep them in order
+		secOffset[i] = sec.offset - std::prev(std::upper_bound(runs.begin(), runs.end(), sec.offset, [](std::uint64_t o, const Run &run) { return o < run.start; }))->shift;
+	}
+	if (elf.shoff && elf.shoff < imageEnd) {
+		err = "the section header table is not after the segments";
+		return RewriteResult::Declined;
+	}
+	const std::uint64_t shoff = elf.shoff ? elf.shoff - tailShift : 0;
+
+	std::ostringstream desc;
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> before, after;
+	desc << page / 1024 << " KiB pages, PT_LOAD pages mapped";
+	for (std::size_t i : loads) {
+		const ElfSegment &seg = elf.segments[i];
+		desc << (i == loads.front() ? " " : "+") << pageSpan(seg.vaddr, seg.memsz, page);
+		before.emplace_back(seg.offset, seg.filesz);
+		after.emplace_back(seg.offset - runs[runOf[i]].shift, seg.filesz);
+	}
+	desc << ", file pages read " << filePages(before, page) << " -> " << filePages(after, page);
+	report = desc.str();
+	const bool realign = std::any_of(loads.begin(), loads.end(), [&](std::size_t i) { return elf.segments[i].align > page; });
+	if (!tailShift && !realign) return RewriteResult::Unchanged;
+
+	// Headers are patched in a copy; segment contents come from the mapping
+	std::string head(reinterpret_cast<const char *>(file.data()), headEnd);
+	const unsigned w = elf.is64 ? 8 : 4;
+	for (std::size_t i = 0; i < elf.segments.size(); ++i) {
+		const ElfSegment &seg = elf.segments[i];
+		const std::uint64_t o = elf.phoff + i * phentsize;
+		std::uint64_t off = moved(seg.offset, seg.filesz == 0);
+		if (off == npos) off = seg.offset; // an empty marker such as PT_GNU_STACK
+		storeInt(head, o + (elf.is64 ? 8 : 4), off, w, elf.littleEndian);
+		if (seg.type == PT_LOAD && seg.align > page) storeInt(head, o + (elf.is64 ? 48 : 28), page, w, elf.littleEndian);
+	}
+	if (elf.shoff) storeInt(head, elf.is64 ? 40 : 32, shoff, w, elf.littleEndian);
+
+	static const char zeros[4096] = {};
+	std::vector<std::pair<const void *, std::size_t>> chunks;
+	std::uint64_t pos = 0;
+	auto emit = [&](const void *p, std::uint64_t n) {
+		chunks.emplace_back(p, static_cast<std::size_t>(n));
+		pos += n;
+	};
+	auto padTo = [&](std::uint64_t at) {
+		while (pos < at) emit(zeros, std::min<std::uint64_t>(at - pos, sizeof(zeros)));
+	};
+	emit(head.data(), head.size());
+	emit(file.data() + headEnd, runs.front().end - headEnd);
+	for (std::size_t k = 1; k < runs.size(); ++k) {
+		padTo(runs[k].start - runs[k].shift);
+		emit(file.data() + runs[k].start, runs[k].end - runs[k].start);
+	}
+	padTo(imageEnd - tailShift);
+	std::string table;
+	if (elf.shoff) {
+		table.assign(reinterpret_cast<const char *>(file.data() + elf.shoff), elf.sections.size() * shentsize);
+		for (std::size_t i = 1; i < elf.sections.size(); ++i) storeInt(table, i * shentsize + (elf.is64 ? 24 : 16), secOffset[i], w, elf.littleEndian);
+	}
+	if (elf.shoff) {
+		emit(file.data() + imageEnd, elf.shoff - imageEnd);
+		emit(table.data(), table.size());
+		emit(file.data() + elf.shoff + table.size(), file.size() - elf.shoff - table.size());
+	} else {
+		emit(file.data() + imageEnd, file.size() - imageEnd);
+	}
+	if (!replaceFile(target, chunks, err)) return RewriteResult::Declined;
+	return RewriteResult::Changed;
+}
+
+// Quotes `arg` for display so logged commands can be pasted into a shell.
+static std::string shellQuote(const std::string &arg) {
+	if (!arg.empty() && arg.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789@%+=:,./_-") == std::string::npos) return arg;
+	std::string out = "'";
+	for (char c : arg) {
+		if (c == '\'') out += "'\\''";
+		else out += c;
+	}
+	return out + "'";
+}
+
+struct CommandResult {
+	int exitCode = 127;     // child exit status, 128+signal if killed, 127 if it could not be started
+	std::string stdoutText; // only filled when stdout capture was requested
+	std::string stderrText; // only filled when stderr capture was requested
+	double cpuSeconds = 0;  // user+system time of the child, from wait4
+};
+
+// Runs args[0] directly with posix_spawn; the argument vector reaches the
+// child unchanged, so no shell startup or quoting is involved.
+static CommandResult runCommand(const std::vector<std::string> &args, bool quiet = false, bool captureStderr = false, bool captureStdout = false) {
+	CommandResult res;
+	if (args.empty()) return res;
+	if (!quiet) {
+		std::string cmd;
+		for (std::size_t i = 0; i < args.size(); ++i) {
+			if (i) cmd += ' ';
+			cmd += shellQuote(args[i]);
+		}
+		LogLine() << "[exec] " << cmd;
+	}
+
+	std::vector<char *> argv;
+	argv.reserve(args.size() + 1);
+	for (const auto &a : args) argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	// pipes[0] carries stdout, pipes[1] stderr
+	int pipes[2][2] = {{-1, -1}, {-1, -1}};
+	const bool capture[2] = {captureStdout, captureStderr};
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	for (int k = 0; k < 2; ++k) {
+		if (!capture[k]) continue;
+		if (pipe2(pipes[k], O_CLOEXEC) != 0) {
+			for (auto &p : pipes) {
+				for (int fd : p) {
+					if (fd >= 0) close(fd);
+				}
+			}
+			posix_spawn_file_actions_destroy(&actions);
+			return res;
+		}
+		posix_spawn_file_actions_adddup2(&actions, pipes[k][1], k == 0 ? STDOUT_FILENO : STDERR_FILENO);
+	}
+	// Tool chatter is diagnostics; keep our stdout free for reports and data
+	if (!captureStdout) posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+
+	pid_t pid = -1;
+	int rc = args[0].find('/') != std::string::npos ? posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ)
+	                                                 : posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	for (auto &p : pipes) {
+		if (p[1] >= 0) close(p[1]);
+	}
+	if (rc != 0) {
+		for (auto &p : pipes) {
+			if (p[0] >= 0) close(p[0]);
+		}
+		res.stderrText = std::string("failed to start ") + args[0] + ": " + std::strerror(rc);
+		return res;
+	}
+
+	// Drain both pipes together so a chatty child cannot block on either
+	std::string *sinks[2] = {&res.stdoutText, &res.stderrText};
+	for (;;) {
+		struct pollfd pfds[2];
+		nfds_t n = 0;
+		int which[2];
+		for (int k = 0; k < 2; ++k) {
+			if (pipes[k][0] < 0) continue;
+			pfds[n] = {pipes[k][0], POLLIN, 0};
+			which[n++] = k;
+		}
+		if (n == 0) break;
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		for (nfds_t i = 0; i < n; ++i) {
+			if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			int &fd = pipes[which[i]][0];
+			char buf[4096];
+			ssize_t got = read(fd, buf, sizeof(buf));
+			if (got > 0) {
+				sinks[which[i]]->append(buf, static_cast<std::size_t>(got));
+			} else if (got == 0 || errno != EINTR) {
+				close(fd);
+				fd = -1;
+			}
+		}
+	}
+	for (auto &p : pipes) {
+		if (p[0] >= 0) close(p[0]);
+	}
+
+	int status = 0;
+	struct rusage ru{};
+	while (wait4(pid, &status, 0, &ru) < 0) {
+		if (errno != EINTR) return res;
+	}
+	res.cpuSeconds = static_cast<double>(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) + static_cast<double>(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	if (WIFEXITED(status)) res.exitCode = WEXITSTATUS(status);
+	else if (WIFSIGNALED(status)) res.exitCode = 128 + WTERMSIG(status);
+	return res;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct TimedRun {
+	int exitCode = 127;
+	double wallSeconds = 0;
+	bool timedOut = false;
+};
+
+// Runs a program with stdin, stdout and stderr on /dev/null and measures
+// spawn-to-exit time. The child is killed once `timeoutSeconds` elapse.
+static TimedRun runTimed(const std::vector<std::string> &args, double timeoutSeconds) {
+	TimedRun res;
+	if (args.empty()) return res;
+	std::vector<char *> argv;
+	for (const auto &a : args) argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	pid_t pid = -1;
+	auto start = std::chrono::steady_clock::now();
+	int rc = args[0].find('/') != std::string::npos ? posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ)
+	                                                 : posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc != 0) return res;
+
+	// A pidfd lets us wait with a timeout without polling; without one
+	// (kernels before 5.3) we simply block
+	int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+	if (pidfd >= 0) {
+		struct pollfd pfd = {pidfd, POLLIN, 0};
+		int ms = static_cast<int>(timeoutSeconds * 1e3);
+		int ready;
+		while ((ready = poll(&pfd, 1, ms)) < 0 && errno == EINTR) {
+		}
+		close(pidfd);
+		if (ready == 0) {
+			kill(pid, SIGKILL);
+			res.timedOut = true;
+		}
+	}
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) return res;
+	}
+	res.wallSeconds = secondsSince(start);
+	if (WIFEXITED(status)) res.exitCode = WEXITSTATUS(status);
+	else if (WIFSIGNALED(status)) res.exitCode = 128 + WTERMSIG(status);
+	return res;
+}
+
+// Resource limits for running a binary under test, besides the timeout.
+struct SandboxLimits {
+	double timeoutSeconds = 10;
+	rlim_t addressSpace = rlim_t(4) << 30;
+	rlim_t fileSize = rlim_t(64) << 20;
+	rlim_t openFiles = 256;
+};
+
+// Runs a program like runTimed, but in its own process group, from an
+// empty scratch directory and under `limits` (CPU time is capped at the
+// timeout). The whole group is killed once the program exits or times
+// out, so nothing it starts outlives the check.
+static TimedRun runSandboxed(const std::vector<std::string> &args, const SandboxLimits &limits) {
+	TimedRun res;
+	if (args.empty()) return res;
+	std::error_code ec;
+	std::string dir = (fs::temp_directory_path(ec) / "optimz-verify-XXXXXX").string();
+	if (ec || !mkdtemp(dir.data())) return res;
+	std::vector<char *> argv;
+	for (const auto &a : args) argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+	const rlim_t cpu = static_cast<rlim_t>(std::ceil(limits.timeoutSeconds)) + 1;
+	const std::pair<int, rlim_t> rlimits[] = {{RLIMIT_AS, limits.addressSpace}, {RLIMIT_CPU, cpu}, {RLIMIT_FSIZE, limits.fileSize}, {RLIMIT_NOFILE, limits.openFiles}, {RLIMIT_CORE, 0}};
+	const bool search = args[0].find('/') == std::string::npos;
+
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		// Only async-signal-safe calls between fork and exec
+		setpgid(0, 0);
+		prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+		prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+		for (const auto &[resource, limit] : rlimits) {
+			struct rlimit rl = {limit, limit};
+			setrlimit(resource, &rl);
+		}
+		int null = open("/dev/null", O_RDWR);
+		if (chdir(dir.c_str()) != 0 || null < 0) _exit(127);
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if (search) execvp(argv[0], argv.data());
+		else execv(argv[0], argv.data());
+		_exit(127);
+	}
+	if (pid > 0) {
+		// Also set here, so the group exists whichever side runs first
+		setpgid(pid, pid);
+		int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+		if (pidfd >= 0) {
+			struct pollfd pfd = {pidfd, POLLIN, 0};
+			int ready;
+			while ((ready = poll(&pfd, 1, static_cast<int>(limits.timeoutSeconds * 1e3))) < 0 && errno == EINTR) {
+			}
+			close(pidfd);
+			if (ready == 0) {
+				kill(-pid, SIGKILL);
+				res.timedOut = true;
+			}
+		}
+		int status = 0;
+		pid_t got;
+		while ((got = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {
+		}
+		kill(-pid, SIGKILL);
+		res.wallSeconds = secondsSince(start);
+		if (got == pid && WIFEXITED(status)) res.exitCode = WEXITSTATUS(status);
+		else if (got == pid && WIFSIGNALED(status)) res.exitCode = 128 + WTERMSIG(status);
+	}
+	fs::remove_all(dir, ec);
+	return res;
+}
+
+static std::uintmax_t fileSize(const fs::path &p) {
+	std::error_code ec;
+	auto sz = fs::file_size(p, ec);
+	return ec ? 0 : sz;
+}
+
+// XXH64, used to content-address inputs for the result cache.
+class Xxh64 {
+public:
+	explicit Xxh64(std::uint64_t seed = 0) {
+		v_[0] = seed + P1 + P2;
+		v_[1] = seed + P2;
+		v_[2] = seed;
+		v_[3] = seed - P1;
+		seed_ = seed;
+	}
+
+	void update(const void *data, std::size_t len) {
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		total_ += len;
+		if (bufLen_ + len < 32) {
+			std::memcpy(buf_ + bufLen_, p, len);
+			bufLen_ += len;
+			return;
+		}
+		if (bufLen_) {
+			std::size_t fill = 32 - bufLen_;
+			std::memcpy(buf_ + bufLen_, p, fill);
+			consume(buf_);
+			p += fill;
+			len -= fill;
+			bufLen_ = 0;
+		}
+		for (; len >= 32; p += 32, len -= 32) consume(p);
+		std::memcpy(buf_, p, len);
+		bufLen_ = len;
+	}
+
+	void update(const std::string &s) { update(s.data(), s.size()); }
+
+	std::uint64_t digest() const {
+		std::uint64_t h;
+		if (total_ >= 32) {
+			h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+			for (std::uint64_t v : v_) h = (h ^ round(0, v)) * P1 + P4;
+		} else {
+			h = seed_ + P5;
+		}
+		h += total_;
+		const unsigned char *p = buf_;
+		std::size_t len = bufLen_;
+		for (; len >= 8; p += 8, len -= 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if (len >= 4) {
+			h = rotl(h ^ (static_cast<std::uint64_t>(read32(p)) * P1), 23) * P2 + P3;
+			p += 4;
+			len -= 4;
+		}
+		for (; len; ++p, --len) h = rotl(h ^ (*p * P5), 11) * P1;
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static constexpr std::uint64_t P1 = 11400714785074694791ULL;
+	static constexpr std::uint64_t P2 = 14029467366897019727ULL;
+	static constexpr std::uint64_t P3 = 1609587929392839161ULL;
+	static constexpr std::uint64_t P4 = 9650029242287828579ULL;
+	static constexpr std::uint64_t P5 = 2870177450012600261ULL;
+
+	static std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static std::uint64_t round(std::uint64_t acc, std::uint64_t in) { return rotl(acc + in * P2, 31) * P1; }
+	static std::uint64_t read64(const unsigned char *p) {
+		std::uint64_t v = 0;
+		for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+		return v;
+	}
+	static std::uint32_t read32(const unsigned char *p) {
+		return static_cast<std::uint32_t>(p[0]) | (static_cast<std::uint32_t>(p[1]) << 8) | (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+	}
+	void consume(const unsigned char *p) {
+		for (int i = 0; i < 4; ++i) v_[i] = round(v_[i], read64(p + 8 * i));
+	}
+
+	std::uint64_t v_[4];
+	std::uint64_t seed_ = 0;
+	std::uint64_t total_ = 0;
+	unsigned char buf_[32];
+	std::size_t bufLen_ = 0;
+};
+
+static std::string toHex(std::uint64_t v) {
+	char buf[17];
+	std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(v));
+	return buf;
+}
+
+static std::optional<std::uint64_t> hashFile(const fs::path &path) {
+	std::error_code ec;
+	if (fs::file_size(path, ec) == 0 && !ec) return Xxh64().digest();
+	MappedFile file(path);
+	if (!file.ok()) return std::nullopt;
+	Xxh64 h;
+	h.update(file.data(), file.size());
+	return h.digest();
+}
+
+// Replaces the contents of `dst` with those of `src` while keeping dst's
+// inode, owner and mode. Tries a reflink first, then an in-kernel copy.
+static bool copyContents(const fs::path &src, const fs::path &dst) {
+	int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) return false;
+	int out = open(dst.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (out < 0) {
+		close(in);
+		return false;
+	}
+	bool ok = ioctl(out, FICLONE, in) == 0;
+	if (!ok) {
+		ok = true;
+		for (;;) {
+			ssize_t n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+			if (n > 0) continue;
+			if (n == 0) break;
+			if (errno == EINTR) continue;
+			// Cross-device or unsupported: fall back to a plain copy
+			if (lseek(in, 0, SEEK_SET) < 0 || ftruncate(out, 0) != 0 || lseek(out, 0, SEEK_SET) < 0) {
+				ok = false;
+				break;
+			}
+			char buf[1 << 16];
+			ssize_t got;
+			while ((got = read(in, buf, sizeof(buf))) > 0) {
+				if (write(out, buf, static_cast<std::size_t>(got)) != got) {
+					ok = false;
+					break;
+				}
+			}
+			if (got < 0) ok = false;
+			break;
+		}
+	}
+	if (close(out) != 0) ok = false;
+	close(in);
+	return ok;
+}
+
+static std::optional<fs::path> defaultCacheDir() {
+	if (const char *xdg = ::getenv("XDG_CACHE_HOME"); xdg && *xdg) return fs::path(xdg) / "optimz";
+	if (const char *home = ::getenv("HOME"); home && *home) return fs::path(home) / ".cache" / "optimz";
+	return std::nullopt;
+}
+
+// Optimized outputs keyed by input content plus everything that affects
+// the result (tool versions, pass count). Entries are written to a
+// temporary name and renamed into place, so concurrent writers are safe.
+class ResultCache {
+public:
+	ResultCache(fs::path dir, std::string salt) : dir_(std::move(dir)), salt_(std::move(salt)) {}
+
+	std::optional<std::string> keyFor(const fs::path &input) const {
+		auto h = hashFile(input);
+		if (!h) return std::nullopt;
+		Xxh64 s;
+		s.update(salt_);
+		return toHex(*h) + toHex(s.digest()) + "-" + std::to_string(fileSize(input));
+	}
+
+	// Backs the directory with a remote store shared between hosts: a local
+	// miss is fetched with GET <url>/<key>, and new results are uploaded
+	// with PUT to the same URL. Transfers go through curl, which also reads
+	// credentials from ~/.netrc and headers from ~/.curlrc.
+	void setRemote(std::string url, std::string curl) {
+		while (!url.empty() && url.back() == '/') url.pop_back();
+		remote_ = std::move(url);
+		curl_ = std::move(curl);
+	}
+
+	std::optional<fs::path> lookup(const std::string &key) const {
+		fs::path p = entryPath(key);
+		std::error_code ec;
+		if (fs::is_regular_file(p, ec)) return p;
+		if (remote_.empty()) return std::nullopt;
+		fs::create_directories(p.parent_path(), ec);
+		if (ec) return std::nullopt;
+		// Fetched into a scratch name, so a partial download is never a hit
+		fs::path tmp = scratchFor(p);
+		CommandResult res = runCommand({curl_, "-sS", "--netrc-optional", "--max-time", "300", "-o", tmp.string(), "-w", "%{http_code}", remote_ + "/" + key}, true, true, true);
+		if (res.exitCode == 0 && res.stdoutText == "200") fs::rename(tmp, p, ec);
+		else ec = std::make_error_code(std::errc::no_such_file_or_directory);
+		if (!ec) return p;
+		fs::remove(tmp, ec);
+		if (res.exitCode != 0 || res.stdoutText != "404") remoteFailed("GET", res);
+		return std::nullopt;
+	}
+
+	bool store(const std::string &key, const fs::path &output) const {
+		fs::path p = entryPath(key);
+		std::error_code ec;
+		fs::create_directories(p.parent_path(), ec);
+		if (ec) return false;
+		fs::path tmp = scratchFor(p);
+		fs::copy_file(output, tmp, fs::copy_options::overwrite_existing, ec);
+		if (!ec) fs::rename(tmp, p, ec);
+		if (ec) {
+			fs::remove(tmp, ec);
+			return false;
+		}
+		if (!remote_.empty()) {
+			CommandResult res = runCommand({curl_, "-sS", "--netrc-optional", "--max-time", "300", "-o", "/dev/null", "-w", "%{http_code}", "-T", p.string(), remote_ + "/" + key}, true, true, true);
+			if (res.exitCode != 0 || res.stdoutText.empty() || res.stdoutText[0] != '2') remoteFailed("PUT", res);
+		}
+		return true;
+	}
+
+	void evict(const std::string &key) const {
+		std::error_code ec;
+		fs::remove(entryPath(key), ec);
+		if (remote_.empty()) return;
+		CommandResult res = runCommand({curl_, "-sS", "--netrc-optional", "--max-time", "300", "-o", "/dev/null", "-w", "%{http_code}", "-X", "DELETE", remote_ + "/" + key}, true, true, true);
+		if (res.exitCode != 0 || res.stdoutText.empty() || (res.stdoutText[0] != '2' && res.stdoutText != "404")) remoteFailed("DELETE", res);
+	}
+
+private:
+	fs::path entryPath(const std::string &key) const { return dir_ / key.substr(0, 2) / key; }
+
+	static fs::path scratchFor(const fs::path &p) {
+		static std::atomic<unsigned> seq{0};
+		fs::path tmp = p;
+		tmp += ".tmp." + std::to_string(getpid()) + "." + std::to_string(seq.fetch_add(1));
+		return tmp;
+	}
+
+	// An unreachable store would otherwise log once per file; the local
+	// cache keeps working either way
+	void remoteFailed(const char *method, const CommandResult &res) const {
+		static std::atomic<bool> logged{false};
+		if (logged.exchange(true)) return;
+		std::string why = res.exitCode == 0 ? "HTTP " + res.stdoutText : res.stderrText;
+		while (!why.empty() && std::isspace(static_cast<unsigned char>(why.back()))) why.pop_back();
+		LogLine() << "Remote cache " << method << " failed (" << why << "); further errors are not reported";
+	}
+
+	fs::path dir_;
+	std::string salt_;
+	std::string remote_;
+	std::string curl_;
+};
+
+struct Tools {
+	std::optional<std::string> strip;
+	std::optional<std::string> objcopy;
+	std::optional<std::string> upx;
+	std::optional<std::string> patchelf;
+	std::optional<std::string> sstrip;
+	std::optional<std::string> bolt;
+	std::optional<std::string> perf2bolt;
+	// Helpers that no step runs: backup store and tar codecs, library
+	// lookup, --verify and --remote-cache
+	std::optional<std::string> zstd;
+	std::optional<std::string> gzip;
+	std::optional<std::string> ldconfig;
+	std::optional<std::string> ldd;
+	std::optional<std::string> curl;
+	// objcopy accepts strip, removal and compression flags in one invocation
+	bool objcopyFuses = false;
+	// objcopy knows --compress-debug-sections=zstd
+	bool objcopyZstd = false;
+	// First line each tool prints for --version, by path
+	std::map<std::string, std::string> versions;
+};
+
+// Resolves every name in one walk over $PATH: each directory is opened
+// once and only the names still missing are looked up in it. Fills
+// `stamp` with what the result depends on (PATH, directory and tool
+// mtimes), so probe results can be cached across runs.
+static std::map<std::string, std::string> scanPath(const std::vector<std::string> &names, std::string &stamp) {
+	std::map<std::string, std::string> found;
+	const char *pathEnv = ::getenv("PATH");
+	stamp = std::string("PATH=") + (pathEnv ? pathEnv : "") + "\n";
+	if (!pathEnv) return found;
+	auto stampOf = [](const struct stat &st) {
+		return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+	};
+	std::stringstream ss(pathEnv);
+	for (std::string dir; std::getline(ss, dir, ':') && found.size() < names.size();) {
+		if (dir.empty()) dir = ".";
+		int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat st{};
+		if (dfd < 0 || fstat(dfd, &st) != 0) {
+			if (dfd >= 0) close(dfd);
+			continue;
+		}
+		// A tool installed later changes the directory's mtime
+		stamp += dir + "\t" + stampOf(st) + "\n";
+		for (const auto &name : names) {
+			if (found.count(name)) continue;
+			if (fstatat(dfd, name.c_str(), &st, 0) == 0 && S_ISREG(st.st_mode) && faccessat(dfd, name.c_str(), X_OK, 0) == 0) {
+				found[name] = (fs::path(dir) / name).string();
+				stamp += name + "\t" + found[name] + "\t" + stampOf(st) + "\n";
+			}
+		}
+		close(dfd);
+	}
+	return found;
+}
+
+// Runs --version and --help once per toolchain; results are stored in
+// `cacheDir`/tools keyed by the PATH scan, so later runs (and the batch
+// and watch modes, which detect once) spawn nothing when PATH, the
+// directories on it and the tools are unchanged.
+static Tools detectTools(const std::optional<fs::path> &cacheDir) {
+	static const std::vector<std::string> names = {"llvm-strip", "strip", "llvm-objcopy", "objcopy", "upx", "patchelf", "sstrip", "llvm-bolt", "perf2bolt", "zstd", "gzip", "ldconfig", "ldd", "curl"};
+	std::string stamp;
+	auto found = scanPath(names, stamp);
+	auto pick = [&](std::initializer_list<const char *> prefs) -> std::optional<std::string> {
+		for (const char *name : prefs) {
+			auto it = found.find(name);
+			if (it != found.end()) return it->second;
+		}
+		return std::nullopt;
+	};
+	Tools t;
+	// Prefer LLVM tools on Termux; fallback to GNU
+	t.strip = pick({"llvm-strip", "strip"});
+	t.objcopy = pick({"llvm-objcopy", "objcopy"});
+	// upx, patchelf and sstrip are optional
+	t.upx = pick({"upx"});
+	t.patchelf = pick({"patchelf"});
+	t.sstrip = pick({"sstrip"});
+	// BOLT runs only when a profile is supplied
+	t.bolt = pick({"llvm-bolt"});
+	t.perf2bolt = pick({"perf2bolt"});
+	t.zstd = pick({"zstd"});
+	t.gzip = pick({"gzip"});
+	t.ldd = pick({"ldd"});
+	t.curl = pick({"curl"});
+	// ldconfig usually lives in an sbin directory outside a user's PATH
+	t.ldconfig = pick({"ldconfig"});
+	for (const char *p : {"/sbin/ldconfig", "/usr/sbin/ldconfig"}) {
+		if (!t.ldconfig && access(p, X_OK) == 0) t.ldconfig = p;
+	}
+
+	Xxh64 h;
+	h.update(stamp);
+	const std::string key = toHex(h.digest());
+	const std::optional<fs::path> cacheFile = cacheDir ? std::optional<fs::path>(*cacheDir / "tools") : std::nullopt;
+	if (cacheFile) {
+		std::ifstream in(*cacheFile);
+		std::string line;
+		if (std::getline(in, line) && line == "key " + key) {
+			while (std::getline(in, line)) {
+				if (line == "objcopy-fuses") t.objcopyFuses = true;
+				else if (line == "objcopy-zstd") t.objcopyZstd = true;
+				else if (line.rfind("version ", 0) == 0 && line.find('\t') != std::string::npos) t.versions[line.substr(8, line.find('\t') - 8)] = line.substr(line.find('\t') + 1);
+			}
+			return t;
+		}
+	}
+
+	for (const auto *tool : {&t.strip, &t.objcopy, &t.upx, &t.patchelf, &t.sstrip, &t.bolt, &t.perf2bolt}) {
+		if (!*tool) continue;
+		CommandResult res = runCommand({**tool, "--version"}, true, true, true);
+		std::string out = res.stdoutText.empty() ? res.stderrText : res.stdoutText;
+		t.versions[**tool] = out.substr(0, out.find('\n'));
+	}
+	if (t.objcopy) {
+		CommandResult help = runCommand({*t.objcopy, "--help"}, true, true, true);
+		const std::string text = help.stdoutText + help.stderrText;
+		t.objcopyFuses = help.exitCode == 0 && text.find("--strip-all") != std::string::npos && text.find("--strip-debug") != std::string::npos &&
+		                 text.find("--remove-section") != std::string::npos && text.find("--compress-debug-sections") != std::string::npos;
+		// The accepted formats are listed on the option's own help line
+		std::size_t opt = text.find("--compress-debug-sections");
+		std::size_t eol = opt == std::string::npos ? opt : text.find('\n', opt);
+		t.objcopyZstd = help.exitCode == 0 && opt != std::string::npos && text.substr(opt, eol - opt).find("zstd") != std::string::npos;
+	}
+
+	if (cacheFile) {
+		std::ostringstream out;
+		out << "key " << key << "\n";
+		if (t.objcopyFuses) out << "objcopy-fuses\n";
+		if (t.objcopyZstd) out << "objcopy-zstd\n";
+		for (const auto &[path, version] : t.versions) out << "version " << path << "\t" << version << "\n";
+		const std::string text = out.str();
+		std::error_code ec;
+		fs::create_directories(*cacheDir, ec);
+		fs::path tmp = *cacheFile;
+		tmp += ".tmp." + std::to_string(getpid());
+		std::ofstream(tmp) << text;
+		fs::rename(tmp, *cacheFile, ec);
+		if (ec) fs::remove(tmp, ec);
+	}
+	return t;
+}
+
+// Identifies the detected toolchain for cache keys: each tool's path and
+// the first line it prints for --version.
+static std::string toolFingerprint(const Tools &tools) {
+	std::string fp;
+	for (const auto *tool : {&tools.strip, &tools.objcopy, &tools.upx, &tools.patchelf, &tools.sstrip, &tools.bolt, &tools.perf2bolt}) {
+		if (!*tool) {
+			fp += "-\n";
+			continue;
+		}
+		auto it = tools.versions.find(**tool);
+		fp += **tool + "\t" + (it == tools.versions.end() ? std::string() : it->second) + "\n";
+	}
+	return fp;
+}
+
+static bool backupOnce(const fs::path &target) {
+	fs::path backupPath = target;
+	backupPath += ".bak";
+	if (fs::exists(backupPath)) return true;
+	std::error_code ec;
+	fs::copy_file(target, backupPath, fs::copy_options::overwrite_existing, ec);
+	if (ec) {
+		LogLine() << "Failed to create backup: " << ec.message();
+		return false;
+	}
+	return true;
+}
+
+// Restores `target` from the .bak copy made by backupOnce. With `expect`,
+// only a backup whose contents hash to it is put back.
+static bool restoreBak(const fs::path &target, std::string &err, std::optional<std::uint64_t> expect = std::nullopt) {
+	fs::path backupPath = target;
+	backupPath += ".bak";
+	std::error_code ec;
+	if (!fs::is_regular_file(backupPath, ec)) {
+		err = "no backup at " + backupPath.string();
+		return false;
+	}
+	std::string tmpl = target.string() + ".optimz-restore-XXXXXX";
+	int fd = mkstemp(tmpl.data());
+	if (fd < 0) {
+		err = std::string("cannot create temporary file: ") + std::strerror(errno);
+		return false;
+	}
+	close(fd);
+	fs::copy_file(backupPath, tmpl, fs::copy_options::overwrite_existing, ec);
+	if (!ec && expect && hashFile(tmpl) != expect) {
+		err = backupPath.string() + " is not a copy of the file that was optimized";
+		fs::remove(tmpl, ec);
+		return false;
+	}
+	if (!ec) fs::rename(tmpl, target, ec);
+	if (ec) {
+		err = ec.message();
+		fs::remove(tmpl, ec);
+		return false;
+	}
+	return true;
+}
+
+static std::optional<fs::path> defaultBackupDir() {
+	if (const char *xdg = ::getenv("XDG_DATA_HOME"); xdg && *xdg) return fs::path(xdg) / "optimz" / "backups";
+	if (const char *home = ::getenv("HOME"); home && *home) return fs::path(home) / ".local" / "share" / "optimz" / "backups";
+	return std::nullopt;
+}
+
+// Backups as one object per unique input in a shared store instead of a
+// .bak beside every binary. Objects are reflinked where the filesystem
+// shares extents (no space used until the target is rewritten), otherwise
+// zstd-compressed, or copied when zstd is not installed. An append-only
+// manifest of "object<TAB>mode<TAB>path" lines maps paths to objects;
+// the last line for a path wins.
+class BackupStore {
+public:
+	BackupStore(fs::path dir, std::optional<std::string> zstd) : dir_(std::move(dir)), zstd_(std::move(zstd)) {}
+
+	bool backupOnce(const fs::path &target) const {
+		const std::string key = canonicalKey(target);
+		if (key.find('\n') != std::string::npos) {
+			LogLine() << "Failed to create backup: path contains a newline";
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			if (loadLocked().count(key)) return true;
+		}
+		struct stat st{};
+		auto h = hashFile(target);
+		if (!h || stat(target.c_str(), &st) != 0) {
+			LogLine() << "Failed to create backup: cannot read " << target;
+			return false;
+		}
+		const std::string id = toHex(*h) + "-" + std::to_string(st.st_size);
+		std::string err;
+		if (!storeObject(target, id, err)) {
+			LogLine() << "Failed to create backup: " << err;
+			return false;
+		}
+		char mode[16];
+		std::snprintf(mode, sizeof(mode), "%o", static_cast<unsigned>(st.st_mode & 07777));
+		const std::string line = id + "\t" + mode + "\t" + key + "\n";
+		std::lock_guard<std::mutex> lock(mu_);
+		// O_APPEND keeps lines from concurrent Opt processes whole
+		int fd = open((dir_ / "manifest").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		bool ok = fd >= 0 && write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size());
+		if (fd >= 0 && close(fd) != 0) ok = false;
+		if (!ok) {
+			LogLine() << "Failed to create backup: cannot append to " << (dir_ / "manifest") << ": " << std::strerror(errno);
+			return false;
+		}
+		loadLocked()[key] = {id, st.st_mode & 07777};
+		return true;
+	}
+
+	// Every path with a backup, optionally only those below `under`
+	std::vector<fs::path> paths(const std::optional<fs::path> &under = std::nullopt) const {
+		std::lock_guard<std::mutex> lock(mu_);
+		std::vector<fs::path> out;
+		const std::string prefix = under ? canonicalKey(*under) + "/" : std::string();
+		for (const auto &[path, entry] : loadLocked()) {
+			if (path.compare(0, prefix.size(), prefix) == 0) out.emplace_back(path);
+		}
+		std::sort(out.begin(), out.end());
+		return out;
+	}
+
+	// Whether the backup recorded for `target` holds contents hashing to `h`
+	bool holds(const fs::path &target, std::uint64_t h) const {
+		std::lock_guard<std::mutex> lock(mu_);
+		auto &entries = loadLocked();
+		auto it = entries.find(canonicalKey(target));
+		return it != entries.end() && it->second.id.rfind(toHex(h) + "-", 0) == 0;
+	}
+
+	// With `expect`, only an object holding contents with that hash (the
+	// object name starts with it) is put back
+	bool restore(const fs::path &target, std::string &err, std::optional<std::uint64_t> expect = std::nullopt) const {
+		Entry entry;
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			auto &entries = loadLocked();
+			auto it = entries.find(canonicalKey(target));
+			if (it == entries.end()) {
+				err = "no backup recorded in " + dir_.string();
+				return false;
+			}
+			entry = it->second;
+		}
+		if (expect && entry.id.rfind(toHex(*expect) + "-", 0) != 0) {
+			err = "the backup recorded in " + dir_.string() + " is not of the file that was optimized";
+			return false;
+		}
+		std::string tmpl = target.string() + ".optimz-restore-XXXXXX";
+		int fd = mkstemp(tmpl.data());
+		if (fd < 0) {
+			err = std::string("cannot create temporary file: ") + std::strerror(errno);
+			return false;
+		}
+		close(fd);
+		const fs::path raw = objectPath(entry.id);
+		fs::path packed = raw;
+		packed += ".zst";
+		std::error_code ec;
+		bool ok;
+		if (fs::exists(raw, ec)) {
+			ok = copyContents(raw, tmpl);
+			if (!ok) err = "cannot copy " + raw.string();
+		} else if (!zstd_) {
+			ok = false;
+			err = "zstd not found in PATH; needed to unpack " + packed.string();
+		} else {
+			CommandResult res = runCommand({*zstd_, "-d", "-q", "-f", packed.string(), "-o", tmpl}, true, true);
+			ok = res.exitCode == 0;
+			if (!ok) err = "zstd failed: " + res.stderrText;
+		}
+		if (ok) {
+			// The object name is its checksum; never restore a damaged copy
+			auto h = hashFile(tmpl);
+			ok = h && toHex(*h) + "-" + std::to_string(fileSize(tmpl)) == entry.id;
+			if (!ok) err = "backup object " + entry.id + " is damaged";
+		}
+		if (ok && (chmod(tmpl.c_str(), entry.mode) != 0 || rename(tmpl.c_str(), target.c_str()) != 0)) {
+			err = std::strerror(errno);
+			ok = false;
+		}
+		if (!ok) unlink(tmpl.c_str());
+		return ok;
+	}
+
+private:
+	struct Entry {
+		std::string id;
+		mode_t mode = 0;
+	};
+
+	static std::string canonicalKey(const fs::path &p) {
+		std::error_code ec;
+		fs::path c = fs::weakly_canonical(fs::absolute(p, ec), ec);
+		return c.string();
+	}
+
+	fs::path objectPath(const std::string &id) const { return dir_ / "objects" / id.substr(0, 2) / id; }
+
+	std::unordered_map<std::string, Entry> &loadLocked() const {
+		if (entries_) return *entries_;
+		entries_.emplace();
+		std::ifstream in(dir_ / "manifest");
+		for (std::string line; std::getline(in, line);) {
+			auto t1 = line.find('\t');
+			auto t2 = t1 == std::string::npos ? t1 : line.find('\t', t1 + 1);
+			if (t2 == std::string::npos) continue;
+			Entry e{line.substr(0, t1), static_cast<mode_t>(std::strtoul(line.substr(t1 + 1, t2 - t1 - 1).c_str(), nullptr, 8))};
+			(*entries_)[line.substr(t2 + 1)] = e;
+		}
+		return *entries_;
+	}
+
+	bool storeObject(const fs::path &target, const std::string &id, std::string &err) const {
+		const fs::path raw = objectPath(id);
+		fs::path packed = raw;
+		packed += ".zst";
+		std::error_code ec;
+		if (fs::exists(raw, ec) || fs::exists(packed, ec)) return true;
+		fs::create_directories(raw.parent_path(), ec);
+		if (ec) {
+			err = "cannot create " + raw.parent_path().string() + ": " + ec.message();
+			return false;
+		}
+		static std::atomic<unsigned> seq{0};
+		fs::path tmp = raw;
+		tmp += ".tmp." + std::to_string(getpid()) + "." + std::to_string(seq.fetch_add(1));
+		int in = open(target.c_str(), O_RDONLY | O_CLOEXEC);
+		int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+		const bool cloned = in >= 0 && out >= 0 && ioctl(out, FICLONE, in) == 0;
+		if (in >= 0) close(in);
+		if (out >= 0 && close(out) != 0 && cloned) ec = std::error_code(errno, std::generic_category());
+		fs::path dest = raw;
+		if (!cloned) {
+			fs::remove(tmp, ec);
+			ec.clear();
+			if (zstd_) {
+				CommandResult res = runCommand({*zstd_, "-q", "-f", "-T0", target.string(), "-o", tmp.string()}, true, true);
+				if (res.exitCode != 0) {
+					err = "zstd failed: " + res.stderrText;
+					fs::remove(tmp, ec);
+					return false;
+				}
+				dest = packed;
+			} else {
+				fs::copy_file(target, tmp, ec);
+			}
+		}
+		if (!ec) fs::rename(tmp, dest, ec);
+		if (ec) {
+			err = "cannot store " + dest.string() + ": " + ec.message();
+			fs::remove(tmp, ec);
+			return false;
+		}
+		return true;
+	}
+
+	fs::path dir_;
+	std::optional<std::string> zstd_;
+	mutable std::mutex mu_;
+	mutable std::optional<std::unordered_map<std::string, Entry>> entries_;
+};
+
+// Append-only record of a batch run, one line per event:
+//   start <input xxh64> - <path>
+//   done <input xxh64> <output xxh64> <path>
+//   failed <input xxh64> - <path>
+// Lines are written with one O_APPEND write each and fdatasync'd every
+// 64 completions or once a second, so a crash loses at most that much.
+// The last line for a path is its state.
+class Journal {
+public:
+	enum class Status { Started, Done, Failed };
+	struct Entry {
+		Status status = Status::Started;
+		std::string input;
+		std::string output;
+	};
+
+	explicit Journal(fs::path path) : path_(std::move(path)) {}
+	~Journal() {
+		if (fd_ >= 0) {
+			fdatasync(fd_);
+			close(fd_);
+		}
+	}
+	Journal(const Journal &) = delete;
+	Journal &operator=(const Journal &) = delete;
+
+	bool open(std::string &err) {
+		std::error_code ec;
+		fs::create_directories(path_.parent_path().empty() ? fs::path(".") : path_.parent_path(), ec);
+		fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd_ < 0) err = path_.string() + ": " + std::strerror(errno);
+		return fd_ >= 0;
+	}
+
+	// Latest state per path from earlier runs
+	std::map<std::string, Entry> load() const {
+		std::map<std::string, Entry> entries;
+		std::ifstream in(path_);
+		for (std::string line; std::getline(in, line);) {
+			std::istringstream fields(line);
+			std::string status, input, output;
+			if (!(fields >> status >> input >> output)) continue;
+			std::string path;
+			std::getline(fields >> std::ws, path);
+			if (path.empty()) continue;
+			Entry &e = entries[path];
+			e.status = status == "done" ? Status::Done : status == "failed" ? Status::Failed : Status::Started;
+			e.input = input;
+			e.output = output == "-" ? std::string() : output;
+		}
+		return entries;
+	}
+
+	void started(const std::string &path, const std::string &input) { append("start " + input + " - " + path + "\n", false); }
+
+	void finished(const std::string &path, const std::string &input, const std::optional<std::string> &output) {
+		append((output ? "done " + input + " " + *output : "failed " + input + " -") + " " + path + "\n", true);
+	}
+
+	// Journal key for `p`: absolute, so runs from other directories agree
+	static std::string key(const fs::path &p) {
+		std::error_code ec;
+		return fs::weakly_canonical(fs::absolute(p, ec), ec).string();
+	}
+
+private:
+	void append(const std::string &line, bool completion) {
+		std::lock_guard<std::mutex> lock(mu_);
+		if (fd_ < 0) return;
+		if (write(fd_, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+			LogLine() << "Journal: write to " << path_.string() << " failed: " << std::strerror(errno);
+			return;
+		}
+		if (!completion) return;
+		auto now = std::chrono::steady_clock::now();
+		if (++unsynced_ >= 64 || now - lastSync_ >= std::chrono::seconds(1)) {
+			fdatasync(fd_);
+			unsynced_ = 0;
+			lastSync_ = now;
+		}
+	}
+
+	fs::path path_;
+	int fd_ = -1;
+	std::mutex mu_;
+	unsigned unsynced_ = 0;
+	std::chrono::steady_clock::time_point lastSync_ = std::chrono::steady_clock::now();
+};
+
+enum class Engine { Native, Tool };
+
+// Steps a profile can name. A profile runs them in phase order: layout
+// work that needs the symbol table, then the strip group (served by the
+// native engine and one fused objcopy where possible), then RPATH, and the
+// terminal sstrip and UPX last. Bolt, remove-needed and split-debug only
+// act when their options are given. No preset has compact-layout:
+// --page-size adds it.
+enum class Step { Bolt, RemoveNeeded, SplitDebug, StripUnneeded, StripAll, StripDebug, RemoveMetadata, CompressDebug, ShrinkRpath, CompactLayout, Sstrip, Upx };
+
+struct StepInfo {
+	Step step;
+	const char *name;
+	unsigned phase;
+};
+
+// Indexed by Step
+constexpr StepInfo kSteps[] = {
+	{Step::Bolt, "bolt", 0},
+	{Step::RemoveNeeded, "remove-needed", 0},
+	{Step::SplitDebug, "split-debug", 0},
+	{Step::StripUnneeded, "strip-unneeded", 1},
+	{Step::StripAll, "strip-all", 1},
+	{Step::StripDebug, "strip-debug", 1},
+	{Step::RemoveMetadata, "remove-metadata", 1},
+	{Step::CompressDebug, "compress-debug", 1},
+	{Step::ShrinkRpath, "shrink-rpath", 2},
+	{Step::CompactLayout, "compact-layout", 2},
+	{Step::Sstrip, "sstrip", 3},
+	{Step::Upx, "upx", 4},
+};
+
+constexpr const StepInfo &stepInfo(Step s) {
+	return kSteps[static_cast<std::size_t>(s)];
+}
+
+constexpr bool isStripGroup(Step s) {
+	return stepInfo(s).phase == 1;
+}
+
+// A step list is valid when no step repeats and phases never go backwards.
+// Presets are checked at compile time, profile files when they are loaded.
+constexpr bool stepsValid(const Step *steps, std::size_t n) {
+	for (std::size_t i = 0; i < n; ++i) {
+		if (i && stepInfo(steps[i]).phase < stepInfo(steps[i - 1]).phase) return false;
+		for (std::size_t j = 0; j < i; ++j) {
+			if (steps[j] == steps[i]) return false;
+		}
+	}
+	return true;
+}
+
+template <Step... S>
+struct StepList {
+	static constexpr Step steps[] = {S...};
+	static constexpr std::size_t size = sizeof...(S);
+	static_assert(stepsValid(steps, size), "steps repeat or are out of phase order");
+};
+
+// size: as small as possible. startup: no UPX, whose decompression runs on
+// every exec. rss: neither UPX nor sstrip, so text pages stay shared
+// through the page cache. debuggable: symbols and DWARF stay, compressed.
+using SizeSteps = StepList<Step::Bolt, Step::RemoveNeeded, Step::SplitDebug, Step::StripUnneeded, Step::StripAll, Step::StripDebug, Step::RemoveMetadata, Step::CompressDebug, Step::ShrinkRpath, Step::Sstrip, Step::Upx>;
+using StartupSteps = StepList<Step::Bolt, Step::RemoveNeeded, Step::SplitDebug, Step::StripUnneeded, Step::StripAll, Step::StripDebug, Step::RemoveMetadata, Step::CompressDebug, Step::ShrinkRpath, Step::Sstrip>;
+using RssSteps = StepList<Step::Bolt, Step::RemoveNeeded, Step::SplitDebug, Step::StripUnneeded, Step::StripAll, Step::StripDebug, Step::RemoveMetadata, Step::CompressDebug, Step::ShrinkRpath>;
+using DebuggableSteps = StepList<Step::Bolt, Step::RemoveNeeded, Step::CompressDebug, Step::ShrinkRpath>;
+
+struct ProfilePreset {
+	const char *name;
+	const Step *steps;
+	std::size_t size;
+};
+
+constexpr ProfilePreset kPresets[] = {
+	{"size", SizeSteps::steps, SizeSteps::size},
+	{"startup", StartupSteps::steps, StartupSteps::size},
+	{"rss", RssSteps::steps, RssSteps::size},
+	{"debuggable", DebuggableSteps::steps, DebuggableSteps::size},
+};
+
+// One step of the selected profile with its command prefix, filled in once
+// the tools are known (empty for steps served natively or by helpers).
+struct ResolvedStep {
+	Step step;
+	std::string tool;
+	std::vector<std::string> flags;
+};
+
+struct Pipeline {
+	std::string name;
+	std::vector<ResolvedStep> steps;
+	std::string fusedObjcopy; // objcopy taking the whole strip group in one rewrite, if it can
+
+	Pipeline() : Pipeline("size", SizeSteps::steps, SizeSteps::size) {}
+	Pipeline(std::string n, const Step *begin, std::size_t size) : name(std::move(n)) {
+		for (const Step *s = begin; s != begin + size; ++s) steps.push_back({*s, {}, {}});
+	}
+
+	const ResolvedStep *find(Step s) const {
+		auto it = std::find_if(steps.begin(), steps.end(), [&](const ResolvedStep &r) { return r.step == s; });
+		return it == steps.end() ? nullptr : &*it;
+	}
+	bool has(Step s) const { return find(s) != nullptr; }
+	// Adds an opt-in step at its place in phase order
+	void add(Step s) {
+		if (has(s)) return;
+		auto at = std::find_if(steps.begin(), steps.end(), [&](const ResolvedStep &r) { return stepInfo(r.step).phase > stepInfo(s).phase; });
+		steps.insert(at, {s, {}, {}});
+	}
+	// Step names in order, e.g. for the cache salt
+	std::string describe() const {
+		std::string out = name + ":";
+		for (const auto &r : steps) out += std::string(" ") + stepInfo(r.step).name;
+		return out;
+	}
+};
+
+static std::optional<Pipeline> presetPipeline(const std::string &name) {
+	for (const auto &p : kPresets) {
+		if (name == p.name) return Pipeline(p.name, p.steps, p.size);
+	}
+	return std::nullopt;
+}
+
+// A profile file lists step names separated by whitespace or newlines; `#`
+// starts a comment. The profile is named after the file.
+static std::optional<Pipeline> loadProfileFile(const fs::path &path, std::string &err) {
+	std::ifstream in(path);
+	if (!in) {
+		err = "cannot read " + path.string();
+		return std::nullopt;
+	}
+	std::vector<Step> steps;
+	for (std::string line; std::getline(in, line);) {
+		if (auto hash = line.find('#'); hash != std::string::npos) line.resize(hash);
+		std::istringstream words(line);
+		for (std::string w; words >> w;) {
+			auto it = std::find_if(std::begin(kSteps), std::end(kSteps), [&](const StepInfo &s) { return w == s.name; });
+			if (it == std::end(kSteps)) {
+				err = "unknown step '" + w + "' (expected one of:";
+				for (const auto &s : kSteps) err += std::string(" ") + s.name;
+				err += ")";
+				return std::nullopt;
+			}
+			steps.push_back(it->step);
+		}
+	}
+	if (steps.empty()) {
+		err = "no steps listed";
+		return std::nullopt;
+	}
+	if (!stepsValid(steps.data(), steps.size())) {
+		err = "steps repeat or are out of order (layout, strip, shrink-rpath and compact-layout, sstrip, upx)";
+		return std::nullopt;
+	}
+	return Pipeline(path.stem().string(), steps.data(), steps.size());
+}
+
+struct StepRecord {
+	std::string name;
+	double wallSeconds = 0;
+	double cpuSeconds = 0;
+	std::uintmax_t sizeBefore = 0;
+	std::uintmax_t sizeAfter = 0;
+	int exitCode = 0;
+};
+
+struct PassRecord {
+	std::vector<StepRecord> steps;
+};
+
+static double threadCpuSeconds() {
+	struct timespec ts{};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+}
+
+// Command used to exercise a binary: `smokeCmd` with "{}" replaced by the
+// binary's absolute path, or the binary alone without arguments.
+static std::vector<std::string> smokeCommand(const fs::path &binary, const std::vector<std::string> &smokeCmd) {
+	// Absolute, so a bare file name is not looked up in PATH
+	std::error_code ec;
+	const std::string path = fs::absolute(binary, ec).string();
+	std::vector<std::string> cmd;
+	bool substituted = false;
+	for (const auto &arg : smokeCmd) {
+		std::string a = arg;
+		for (std::size_t pos; (pos = a.find("{}")) != std::string::npos;) {
+			a.replace(pos, 2, path);
+			substituted = true;
+		}
+		cmd.push_back(a);
+	}
+	if (!substituted) cmd.insert(cmd.begin(), path);
+	return cmd;
+}
+
+// Opt-in exec latency budget for the UPX step.
+struct StartupGuard {
+	double maxRegressionPct = 0;
+	int runs = 5;
+	double timeoutSeconds = 10;
+};
+
+struct StartupSample {
+	double medianSeconds = 0;
+	int exitCode = 0;
+};
+
+// Median spawn-to-exit latency over guard.runs runs, after one warm-up run.
+static std::optional<StartupSample> measureStartup(const std::vector<std::string> &cmd, const StartupGuard &guard) {
+	StartupSample sample;
+	std::vector<double> times;
+	for (int i = 0; i <= guard.runs; ++i) {
+		TimedRun run = runTimed(cmd, guard.timeoutSeconds);
+		if (run.timedOut) return std::nullopt;
+		if (i == 0) {
+			sample.exitCode = run.exitCode;
+			continue;
+		}
+		if (run.exitCode != sample.exitCode) return std::nullopt;
+		times.push_back(run.wallSeconds);
+	}
+	std::sort(times.begin(), times.end());
+	sample.medianSeconds = times[times.size() / 2];
+	return sample;
+}
+
+struct MemorySample {
+	std::uint64_t peakRssKb = 0;   // ru_maxrss of the child
+	std::uint64_t rssKb = 0;       // resident at exit, 0 if smaps_rollup was unavailable
+	std::uint64_t pssKb = 0;       // proportional share at exit, likewise
+	std::uint64_t majorFaults = 0;
+	bool atExit = false;           // rssKb/pssKb were read at the exit stop
+	int exitCode = 0;
+};
+
+static void readSmapsRollup(pid_t pid, MemorySample &m) {
+	std::ifstream f("/proc/" + std::to_string(pid) + "/smaps_rollup");
+	// The first line is the "[rollup]" address range; the rest are "Key: N kB"
+	for (std::string line; std::getline(f, line);) {
+		std::istringstream fields(line);
+		std::string key;
+		std::uint64_t value = 0;
+		if (!(fields >> key >> value)) continue;
+		if (key == "Rss:") m.rssKb = value;
+		else if (key == "Pss:") m.pssKb = value;
+		else continue;
+		m.atExit = true;
+	}
+}
+
+// Runs a program to completion and samples its memory. Under ptrace the
+// child is stopped at PTRACE_EVENT_EXIT, while its address space still
+// exists, to read /proc/<pid>/smaps_rollup; where ptrace is not permitted
+// only the rusage figures are reported.
+static std::optional<MemorySample> measureMemory(const std::vector<std::string> &cmd, double timeoutSeconds) {
+	if (cmd.empty()) return std::nullopt;
+	std::vector<char *> argv;
+	for (const auto &a : cmd) argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	pid_t pid = fork();
+	if (pid < 0) return std::nullopt;
+	if (pid == 0) {
+		ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+		int null = open("/dev/null", O_RDWR);
+		if (null >= 0) {
+			dup2(null, STDIN_FILENO);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+		}
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+
+	MemorySample m;
+	auto start = std::chrono::steady_clock::now();
+	bool traced = false;
+	for (;;) {
+		int status = 0;
+		struct rusage ru{};
+		pid_t got = wait4(pid, &status, WNOHANG, &ru);
+		if (got < 0 && errno != EINTR) return std::nullopt;
+		if (got <= 0) {
+			if (secondsSince(start) > timeoutSeconds) {
+				kill(pid, SIGKILL);
+				waitpid(pid, nullptr, 0);
+				return std::nullopt;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			// Gone before the exec stop, or 127 from a shell: the numbers
+			// would be those of the forked copy of Opt
+			if (!traced || (WIFEXITED(status) && WEXITSTATUS(status) == 127)) {
+				LogLine() << "Memory: cannot run " << cmd[0] << " (command not found?); sample discarded";
+				return std::nullopt;
+			}
+			m.peakRssKb = static_cast<std::uint64_t>(ru.ru_maxrss);
+			m.majorFaults = static_cast<std::uint64_t>(ru.ru_majflt);
+			m.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			return m;
+		}
+		if (!WIFSTOPPED(status)) continue;
+		int sig = 0;
+		if (!traced) {
+			// First stop is the SIGTRAP after execve
+			traced = true;
+			ptrace(PTRACE_SETOPTIONS, pid, nullptr, reinterpret_cast<void *>(static_cast<long>(PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL)));
+		} else if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXIT << 8))) {
+			readSmapsRollup(pid, m);
+		} else {
+			sig = WSTOPSIG(status);
+		}
+		ptrace(PTRACE_CONT, pid, nullptr, reinterpret_cast<void *>(static_cast<long>(sig)));
+	}
+}
+
+// What the packer candidate search minimizes.
+enum class PackObjective { Size, SizeStartup };
+
+// Opt-in search over UPX settings instead of the fixed --best --lzma.
+struct PackSearch {
+	double budgetSeconds = 0; // wall-time budget for all candidates, 0 = unlimited
+	unsigned jobs = 0;        // concurrent packer processes, 0 = one per core
+	PackObjective objective = PackObjective::Size;
+	int startupRuns = 5;      // timed runs per candidate without a startup guard
+};
+
+// Identity of a file's current contents: tools either rewrite in place
+// (new mtime) or rename a new file over it (new inode).
+struct FileStamp {
+	dev_t dev = 0;
+	ino_t ino = 0;
+	off_t size = 0;
+	struct timespec mtime{};
+
+	static std::optional<FileStamp> of(const fs::path &p) {
+		struct stat st{};
+		if (stat(p.c_str(), &st) != 0) return std::nullopt;
+		return FileStamp{st.st_dev, st.st_ino, st.st_size, st.st_mtim};
+	}
+	bool operator==(const FileStamp &o) const {
+		return dev == o.dev && ino == o.ino && size == o.size && mtime.tv_sec == o.mtime.tv_sec && mtime.tv_nsec == o.mtime.tv_nsec;
+	}
+};
+
+// State carried across the passes over one file.
+struct FileState {
+	FileKind kind = FileKind::Executable;
+	bool packRejected = false; // UPX was rolled back or cannot be guarded; do not retry
+	bool layoutDone = false;   // BOLT ran (or was ruled out) in an earlier pass
+	bool neededDone = false;   // DT_NEEDED analysis already ran
+	bool debugSplit = false;   // debug info was extracted (or there was none)
+	// Fixed-point scheduling: the version bumps whenever a step changes the
+	// file, and a step is due again only once the file changed after its
+	// last run
+	unsigned version = 0;
+	std::optional<FileStamp> stamp;        // identity at the current version
+	std::map<std::string, unsigned> ranAt; // step -> version after it last ran
+	bool sealed = false;                   // a terminal step (sstrip, upx) rewrote the file
+};
+
+class Metrics;
+
+// Opt-in checks that an optimized file still loads (--verify).
+struct VerifySettings {
+	bool smoke = false;             // also run the smoke command in a sandbox
+	SandboxLimits limits;
+	std::optional<std::string> ldd; // unresolved libraries are checked when found
+};
+
+struct Options {
+	int passes = 1;
+	std::optional<ResultCache> cache;
+	std::optional<BackupStore> backupStore; // shared backup store instead of <target>.bak
+	// Steps the built-in rewriter can perform; the external tool remains the fallback
+	Engine stripEngine = Engine::Native;
+	Engine debugEngine = Engine::Native;
+	Engine metadataEngine = Engine::Native;
+	std::optional<StartupGuard> startupGuard;
+	std::optional<PackSearch> packSearch;
+	std::vector<std::string> smokeCmd; // shared by the startup guard and memory measurement
+	Pipeline pipeline; // the selected profile; resolvePipeline() fills in the tools
+	bool measureMemory = false;
+	std::optional<fs::path> boltProfile; // perf.data or .fdata; enables the BOLT step
+	std::vector<std::string> boltArgs;   // replaces the default optimization flags
+	bool analyzeNeeded = false;          // report DT_NEEDED entries nothing binds to
+	bool pruneNeeded = false;            // and remove them with patchelf
+	bool loaderStats = false;            // LD_DEBUG=statistics before and after
+	std::optional<fs::path> splitDebugDir; // root of a .build-id tree for extracted debug info
+	std::vector<fs::path> stagingRoots;  // scratch directories for staged copies; empty = in place
+	std::optional<fs::path> output;      // write the result here ("-": stdout) instead of in place
+	bool backup = true;                  // off for scratch inputs such as tar members
+	Metrics *metrics = nullptr;          // live counters for --metrics-*, owned by main
+	std::optional<VerifySettings> verify;
+	std::optional<std::uint64_t> pageSize; // compact-layout aligns for these pages instead of p_align
+	std::optional<int> zstdDebugLevel;     // compress-debug writes zstd at this level instead of zlib
+	unsigned fileThreads = 1;              // threads one file's work (zstd, archive members) may use
+};
+
+// Drops the steps nothing in PATH (nor the native engine) can perform and
+// records each remaining step's command, once per run. Layout steps stay:
+// they report a missing tool themselves when their option asks for them.
+static void resolvePipeline(Pipeline &pipeline, const Tools &tools, const Options &opts) {
+	auto tool = [](const std::optional<std::string> &t) { return t.value_or(std::string()); };
+	std::vector<ResolvedStep> resolved;
+	for (ResolvedStep r : pipeline.steps) {
+		bool native = false;
+		switch (r.step) {
+		case Step::Bolt:
+		case Step::RemoveNeeded:
+		case Step::SplitDebug:
+			break;
+		case Step::StripUnneeded:
+		case Step::StripAll:
+			r.tool = tool(tools.strip);
+			r.flags = {r.step == Step::StripAll ? "--strip-all" : "--strip-unneeded"};
+			// --strip-all also takes every non-allocated section with it
+			if (r.step == Step::StripAll && opts.splitDebugDir) r.flags.push_back("--keep-section=.gnu_debuglink");
+			native = opts.stripEngine == Engine::Native;
+			break;
+		case Step::StripDebug:
+			r.tool = tool(tools.objcopy);
+			r.flags = {"--strip-debug"};
+			native = opts.debugEngine == Engine::Native;
+			break;
+		case Step::RemoveMetadata:
+			r.tool = tool(tools.objcopy);
+			native = opts.metadataEngine == Engine::Native;
+			break;
+		case Step::CompressDebug:
+			r.tool = tool(tools.objcopy);
+			r.flags = {"--compress-debug-sections"};
+			if (opts.zstdDebugLevel) {
+				// libzstd serves it natively; objcopy only if it knows zstd
+				native = Zstd::get() != nullptr;
+				r.flags = {"--compress-debug-sections=zstd"};
+				if (!tools.objcopyZstd) r.tool.clear();
+			}
+			break;
+		case Step::ShrinkRpath:
+			r.tool = tool(tools.patchelf);
+			r.flags = {"--shrink-rpath"};
+			break;
+		case Step::CompactLayout:
+			native = true;
+			break;
+		case Step::Sstrip:
+			r.tool = tool(tools.sstrip);
+			break;
+		case Step::Upx:
+			r.tool = tool(tools.upx);
+			r.flags = {"--best", "--lzma"};
+			break;
+		}
+		const bool fusable = isStripGroup(r.step) && tools.objcopy && tools.objcopyFuses;
+		if (stepInfo(r.step).phase == 0 || !r.tool.empty() || native || fusable) resolved.push_back(std::move(r));
+	}
+	pipeline.steps = std::move(resolved);
+	pipeline.fusedObjcopy = tools.objcopyFuses ? tool(tools.objcopy) : std::string();
+}
+
+struct DynamicSymbols {
+	std::vector<std::string> undefined;         // global/weak references to other objects
+	std::unordered_set<std::string> defined;   // exported definitions
+};
+
+// Reads .dynsym through the section headers; objects without them are
+// treated as exporting nothing, which only makes pruning more conservative.
+static std::optional<DynamicSymbols> readDynamicSymbols(const fs::path &path) {
+	MappedFile file(path);
+	if (!file.ok()) return std::nullopt;
+	auto elf = parseElf(file.data(), file.size());
+	if (!elf) return std::nullopt;
+	ElfReader r{file.data(), file.size(), elf->littleEndian};
+	DynamicSymbols syms;
+	for (const auto &sec : elf->sections) {
+		if (sec.type != SHT_DYNSYM || sec.link >= elf->sections.size()) continue;
+		if (sec.offset > file.size() || sec.size > file.size() - sec.offset) continue;
+		const ElfSection &strtab = elf->sections[sec.link];
+		const std::uint64_t entsize = elf->is64 ? 24 : 16;
+		for (std::uint64_t o = sec.offset + entsize; o + entsize <= sec.offset + sec.size; o += entsize) {
+			std::uint32_t name = r.u32(o);
+			unsigned info = static_cast<unsigned>(r.load(elf->is64 ? o + 4 : o + 12, 1));
+			std::uint16_t shndx = r.u16(elf->is64 ? o + 6 : o + 14);
+			if (!r.ok || name >= strtab.size) break;
+			unsigned bind = info >> 4;
+			if (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE) continue;
+			std::string n = r.cstr(strtab.offset + name);
+			if (shndx == SHN_UNDEF) syms.undefined.push_back(std::move(n));
+			else syms.defined.insert(std::move(n));
+		}
+	}
+	return syms;
+}
+
+// Library name -> paths listed by `ldconfig -p`, read once per process.
+static const std::unordered_multimap<std::string, std::string> &ldCache(const std::optional<std::string> &ldconfig) {
+	static std::unordered_multimap<std::string, std::string> cache;
+	static std::once_flag once;
+	std::call_once(once, [&] {
+		if (!ldconfig) return;
+		CommandResult res = runCommand({*ldconfig, "-p"}, true, true, true);
+		std::istringstream lines(res.stdoutText);
+		for (std::string line; std::getline(lines, line);) {
+			auto arrow = line.find(" => ");
+			auto space = line.find_first_not_of(" \t");
+			if (arrow == std::string::npos || space == std::string::npos) continue;
+			std::string name = line.substr(space, line.find(' ', space) - space);
+			cache.emplace(name, line.substr(arrow + 4));
+		}
+	});
+	return cache;
+}
+
+static std::vector<std::string> splitPathList(const std::string &list, const fs::path &origin) {
+	std::vector<std::string> dirs;
+	std::stringstream ss(list);
+	for (std::string dir; std::getline(ss, dir, ':');) {
+		for (const char *token : {"$ORIGIN", "${ORIGIN}"}) {
+			for (std::size_t pos; (pos = dir.find(token)) != std::string::npos;) dir.replace(pos, std::strlen(token), origin.string());
+		}
+		if (!dir.empty()) dirs.push_back(dir);
+	}
+	return dirs;
+}
+
+// Finds the object the dynamic loader would map for DT_NEEDED `name`,
+// following the ld.so search order and skipping other ELF classes/machines.
+static std::optional<fs::path> resolveLibrary(const std::string &name, const ElfInfo &requester, const fs::path &requesterPath, const Tools &tools) {
+	auto compatible = [&](const fs::path &candidate) {
+		auto lib = readElf(candidate);
+		return lib && lib->is64 == requester.is64 && lib->machine == requester.machine;
+	};
+	if (name.find('/') != std::string::npos) {
+		if (compatible(name)) return fs::path(name);
+		return std::nullopt;
+	}
+	std::error_code ec;
+	const fs::path origin = fs::absolute(requesterPath, ec).parent_path();
+	std::vector<std::string> dirs;
+	if (requester.rpath && !requester.runpath) dirs = splitPathList(*requester.rpath, origin);
+	if (const char *env = ::getenv("LD_LIBRARY_PATH")) {
+		auto more = splitPathList(env, origin);
+		dirs.insert(dirs.end(), more.begin(), more.end());
+	}
+	if (requester.runpath) {
+		auto more = splitPathList(*requester.runpath, origin);
+		dirs.insert(dirs.end(), more.begin(), more.end());
+	}
+	for (const auto &dir : dirs) {
+		fs::path candidate = fs::path(dir) / name;
+		if (compatible(candidate)) return candidate;
+	}
+	auto range = ldCache(tools.ldconfig).equal_range(name);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (compatible(it->second)) return fs::path(it->second);
+	}
+	std::vector<std::string> defaults = {"/lib64", "/usr/lib64", "/lib", "/usr/lib", "/system/lib64", "/system/lib"};
+	if (const char *prefix = ::getenv("PREFIX")) defaults.insert(defaults.begin(), std::string(prefix) + "/lib");
+	for (const auto &dir : defaults) {
+		fs::path candidate = fs::path(dir) / name;
+		if (compatible(candidate)) return candidate;
+	}
+	return std::nullopt;
+}
+
+struct NeededReport {
+	std::vector<std::string> unused;  // DT_NEEDED entries nothing in the target binds to
+	std::vector<std::string> missing; // entries that could not be resolved
+	std::size_t undefinedSymbols = 0;
+	std::size_t relocations = 0;
+};
+
+static std::size_t countRelocations(const ElfInfo &elf) {
+	std::uint64_t relaSz = 0, relaEnt = 0, relSz = 0, relEnt = 0, pltSz = 0, pltRel = 0;
+	for (const auto &[tag, val] : elf.dynamic) {
+		switch (tag) {
+		case DT_RELASZ: relaSz = val; break;
+		case DT_RELAENT: relaEnt = val; break;
+		case DT_RELSZ: relSz = val; break;
+		case DT_RELENT: relEnt = val; break;
+		case DT_PLTRELSZ: pltSz = val; break;
+		case DT_PLTREL: pltRel = val; break;
+		default: break;
+		}
+	}
+	const std::uint64_t relaDefault = elf.is64 ? 24 : 12, relDefault = elf.is64 ? 16 : 8;
+	std::uint64_t pltEnt = pltRel == DT_REL ? (relEnt ? relEnt : relDefault) : (relaEnt ? relaEnt : relaDefault);
+	return static_cast<std::size_t>((relaEnt ? relaSz / relaEnt : relaSz / relaDefault) + (relEnt ? relSz / relEnt : relSz / relDefault) + pltSz / pltEnt);
+}
+
+// Resolves every DT_NEEDED library and reports those that satisfy none of
+// the target's undefined dynamic symbols. A library also counts as used
+// when something only it brings into the load scope (its own
+// dependencies) provides one of those symbols.
+static std::optional<NeededReport> analyzeNeeded(const fs::path &target, const Tools &tools) {
+	auto elf = readElf(target);
+	auto syms = readDynamicSymbols(target);
+	if (!elf || !syms) return std::nullopt;
+	NeededReport report;
+	report.undefinedSymbols = syms->undefined.size();
+	report.relocations = countRelocations(*elf);
+
+	// Load scope contributed by each direct dependency (breadth-first)
+	std::map<std::string, std::set<std::string>> closure;
+	std::map<std::string, std::string> direct; // DT_NEEDED name -> resolved object
+	std::map<std::string, std::unordered_set<std::string>> exports;
+	for (const auto &name : elf->needed) {
+		auto path = resolveLibrary(name, *elf, target, tools);
+		if (!path) {
+			report.missing.push_back(name);
+			continue;
+		}
+		std::error_code ec;
+		direct[name] = fs::weakly_canonical(*path, ec).string();
+		std::deque<fs::path> queue{*path};
+		std::set<std::string> &seen = closure[name];
+		while (!queue.empty()) {
+			fs::path lib = queue.front();
+			queue.pop_front();
+			std::error_code ec;
+			std::string key = fs::weakly_canonical(lib, ec).string();
+			if (!seen.insert(key).second) continue;
+			if (!exports.count(key)) {
+				if (auto libSyms = readDynamicSymbols(lib)) exports[key] = std::move(libSyms->defined);
+			}
+			if (auto libElf = readElf(lib)) {
+				for (const auto &dep : libElf->needed) {
+					if (auto depPath = resolveLibrary(dep, *libElf, lib, tools)) queue.push_back(*depPath);
+				}
+			}
+		}
+	}
+	if (!report.missing.empty()) return report;
+
+	for (const auto &name : elf->needed) {
+		std::set<std::string> others;
+		for (const auto &[other, libs] : closure) {
+			if (other != name) others.insert(libs.begin(), libs.end());
+		}
+		bool used = false;
+		for (const auto &lib : closure[name]) {
+			// Indirect dependencies the other libraries load anyway stay in scope
+			if (lib != direct[name] && others.count(lib)) continue;
+			const auto &defined = exports[lib];
+			used = std::any_of(syms->undefined.begin(), syms->undefined.end(), [&](const std::string &s) { return defined.count(s) != 0; });
+			if (used) break;
+		}
+		if (!used) report.unused.push_back(name);
+	}
+	return report;
+}
+
+// Where a file's bytes are, by what would remove them, plus what each step
+// is expected to save. Computed from the headers and a sample of the
+// loadable bytes only; nothing is run.
+struct SizeEstimate {
+	std::uintmax_t fileSize = 0;
+	std::uintmax_t headers = 0;        // ELF and program headers
+	std::uintmax_t loadable = 0;       // allocated sections (PT_LOAD ranges without sections)
+	std::uintmax_t symbols = 0;        // .symtab and its string table
+	std::uintmax_t debug = 0;          // .debug*/.zdebug* and static relocations
+	std::uintmax_t notes = 0;          // .comment, .note*, .gnu_debuglink
+	std::uintmax_t rpath = 0;          // DT_RPATH/DT_RUNPATH strings, inside .dynstr
+	std::uintmax_t sectionHeaders = 0; // section header table and .shstrtab
+	std::uintmax_t other = 0;          // remaining non-allocated sections
+	std::uintmax_t padding = 0;        // bytes no header or section covers
+	std::uintmax_t image = 0;          // file prefix up to the end of the last PT_LOAD range
+	double entropyBits = 0;            // sampled order-0 entropy of PT_LOAD bytes
+	std::vector<std::pair<std::string, std::uintmax_t>> steps; // predicted savings in pipeline order
+	std::uintmax_t predictedSize = 0;
+};
+
+// Shannon entropy in bits per byte over up to 64 evenly spaced 4 KiB blocks
+// of the loadable segments, weighted by block length.
+static double sampleEntropy(const unsigned char *data, std::size_t size, const ElfInfo &elf) {
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges;
+	std::uint64_t total = 0;
+	for (const auto &seg : elf.segments) {
+		if (seg.type != PT_LOAD || seg.offset >= size) continue;
+		std::uint64_t len = std::min<std::uint64_t>(seg.filesz, size - seg.offset);
+		if (!len) continue;
+		ranges.emplace_back(seg.offset, len);
+		total += len;
+	}
+	if (!total) return 0;
+	constexpr std::uint64_t block = 4096, maxBlocks = 64;
+	const std::uint64_t blocks = std::max<std::uint64_t>(1, std::min(maxBlocks, total / block));
+	const std::uint64_t stride = total / blocks;
+	double bits = 0, weight = 0;
+	for (std::uint64_t b = 0; b < blocks; ++b) {
+		// Map the position in the concatenated ranges back to a file offset
+		std::uint64_t pos = b * stride;
+		std::size_t r = 0;
+		while (r < ranges.size() && pos >= ranges[r].second) pos -= ranges[r++].second;
+		if (r == ranges.size()) break;
+		const std::uint64_t len = std::min(block, ranges[r].second - pos);
+		const unsigned char *p = data + ranges[r].first + pos;
+		std::array<std::uint32_t, 256> counts{};
+		for (std::uint64_t i = 0; i < len; ++i) ++counts[p[i]];
+		double h = 0;
+		for (std::uint32_t c : counts) {
+			if (!c) continue;
+			double q = static_cast<double>(c) / static_cast<double>(len);
+			h -= q * std::log2(q);
+		}
+		bits += h * static_cast<double>(len);
+		weight += static_cast<double>(len);
+	}
+	return weight ? bits / weight : 0;
+}
+
+static std::optional<SizeEstimate> estimateSavings(const fs::path &target, const Options &opts) {
+	MappedFile file(target);
+	if (!file.ok()) return std::nullopt;
+	auto elf = parseElf(file.data(), file.size());
+	if (!elf) return std::nullopt;
+	SizeEstimate e;
+	e.fileSize = file.size();
+	const std::uint64_t phentsize = elf->is64 ? 56 : 32, shentsize = elf->is64 ? 64 : 40;
+
+	// Attribute every covered range; the union of them tells the padding
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> covered;
+	auto cover = [&](std::uint64_t off, std::uint64_t len) {
+		if (off >= e.fileSize) return std::uint64_t{0};
+		len = std::min<std::uint64_t>(len, e.fileSize - off);
+		if (len) covered.emplace_back(off, off + len);
+		return len;
+	};
+	e.headers = cover(0, elf->is64 ? 64 : 52) + cover(elf->phoff, elf->segments.size() * phentsize);
+	if (!elf->sections.empty()) e.sectionHeaders = cover(elf->shoff, elf->sections.size() * shentsize);
+	std::set<std::uint32_t> symbolStrings;
+	for (const auto &sec : elf->sections) {
+		if (sec.type == SHT_SYMTAB) symbolStrings.insert(sec.link);
+	}
+	// Removing a section also drops its header and its name in .shstrtab.
+	// Objects only lose debug info and the relocations against it.
+	const bool object = elf->type == ET_REL, executable = isExecutableElf(*elf);
+	auto debugRelocs = [&](const ElfSection &sec) {
+		return !object || (sec.info < elf->sections.size() && isDebugSection(elf->sections[sec.info]));
+	};
+	std::uintmax_t strippedSymbols = 0, strippedDebug = 0, unmappedNotes = 0;
+	for (std::size_t i = 0; i < elf->sections.size(); ++i) {
+		const ElfSection &sec = elf->sections[i];
+		if (sec.type == SHT_NOBITS || sec.type == SHT_NULL) continue;
+		const std::uint64_t len = cover(sec.offset, sec.size);
+		const std::uint64_t entry = shentsize + sec.name.size() + 1;
+		if (isMetadataSection(sec)) {
+			e.notes += len;
+			if (executable && !(sec.flags & SHF_ALLOC)) unmappedNotes += len + entry;
+		} else if (sec.flags & SHF_ALLOC) {
+			e.loadable += len;
+		} else if (sec.type == SHT_SYMTAB || symbolStrings.count(static_cast<std::uint32_t>(i))) {
+			e.symbols += len;
+			if (!object) strippedSymbols += len + entry;
+		} else if (isDebugSection(sec) || ((sec.type == SHT_REL || sec.type == SHT_RELA) && debugRelocs(sec))) {
+			e.debug += len;
+			strippedDebug += len + entry;
+		} else if (i == elf->shstrndx) {
+			e.sectionHeaders += len;
+		} else {
+			e.other += len;
+		}
+	}
+	if (elf->sections.empty()) {
+		for (const auto &seg : elf->segments) {
+			if (seg.type == PT_LOAD) e.loadable += cover(seg.offset, seg.filesz);
+		}
+	}
+	std::sort(covered.begin(), covered.end());
+	std::uint64_t used = 0, reach = 0;
+	for (const auto &[begin, end] : covered) {
+		if (end <= reach) continue;
+		used += end - std::max(begin, reach);
+		reach = end;
+	}
+	e.padding = e.fileSize - std::min<std::uint64_t>(used, e.fileSize);
+	// Overlapping ranges (headers inside the first segment) count once
+	const std::uintmax_t attributed = e.headers + e.loadable + e.symbols + e.debug + e.notes + e.sectionHeaders + e.other;
+	if (attributed > used) e.loadable -= std::min<std::uintmax_t>(e.loadable, attributed - used);
+	e.image = std::min<std::uint64_t>(elf->phoff + elf->segments.size() * phentsize, e.fileSize);
+	for (const auto &seg : elf->segments) {
+		if (seg.type == PT_LOAD) e.image = std::max<std::uintmax_t>(e.image, std::min<std::uint64_t>(seg.offset + seg.filesz, e.fileSize));
+	}
+	for (const auto *s : {&elf->rpath, &elf->runpath}) {
+		if (*s) e.rpath += (*s)->size() + 1;
+	}
+	e.entropyBits = sampleEntropy(file.data(), file.size(), *elf);
+
+	// Only unmapped bytes can go: strip and metadata removal take their
+	// non-allocated sections, sstrip everything past the last segment, and
+	// UPX compresses the mapped image to roughly its sampled entropy. Notes
+	// and padding inside segments stay where they are.
+	std::uintmax_t size = e.fileSize;
+	auto predict = [&](const char *step, std::uintmax_t bytes) {
+		bytes = std::min(bytes, size);
+		e.steps.emplace_back(step, bytes);
+		size -= bytes;
+	};
+	const Pipeline &pipeline = opts.pipeline;
+	const bool stripSymbols = pipeline.has(Step::StripAll) || pipeline.has(Step::StripUnneeded);
+	const std::uintmax_t stripped = (stripSymbols ? strippedSymbols : 0) + (stripSymbols || pipeline.has(Step::StripDebug) ? strippedDebug : 0);
+	if (stripped) predict("strip", stripped);
+	if (unmappedNotes && pipeline.has(Step::RemoveMetadata)) predict("remove-metadata", unmappedNotes);
+	if (executable) {
+		if (size > e.image && pipeline.has(Step::Sstrip)) predict("sstrip", size - e.image);
+		if (!elf->upxPacked && e.image && pipeline.has(Step::Upx)) {
+			const double ratio = std::min(1.0, e.entropyBits / 8);
+			const auto packed = static_cast<std::uintmax_t>(static_cast<double>(e.image) * ratio);
+			if (size > packed) predict("upx", size - packed);
+		}
+	}
+	e.predictedSize = size;
+	return e;
+}
+
+struct LoaderStats {
+	std::string startupTime;  // as printed by ld.so, e.g. "123456 cycles"
+	std::string relocations;
+	std::string relocationsFromCache;
+};
+
+// Runs the binary once with LD_DEBUG=statistics, writing the loader's
+// report to a private file so the program's own stderr is not parsed.
+static std::optional<LoaderStats> measureLoaderStats(const std::vector<std::string> &cmd) {
+	std::error_code tmpErr;
+	std::string dir = (fs::temp_directory_path(tmpErr) / "optimz-ld-XXXXXX").string();
+	if (tmpErr || !mkdtemp(dir.data())) return std::nullopt;
+	std::vector<std::string> env{"LD_DEBUG=statistics", "LD_DEBUG_OUTPUT=" + dir + "/stats"};
+	for (char **e = environ; *e; ++e) {
+		if (std::strncmp(*e, "LD_DEBUG", 8) != 0) env.push_back(*e);
+	}
+	std::vector<char *> envp, argv;
+	for (auto &e : env) envp.push_back(e.data());
+	envp.push_back(nullptr);
+	for (const auto &a : cmd) argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	pid_t pid = -1;
+	int rc = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), envp.data());
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc == 0) {
+		while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+		}
+	}
+
+	std::optional<LoaderStats> stats;
+	std::error_code ec;
+	for (const auto &entry : fs::directory_iterator(dir, ec)) {
+		std::ifstream f(entry.path());
+		for (std::string line; std::getline(f, line);) {
+			auto value = [&](const char *key) -> std::optional<std::string> {
+				auto pos = line.find(key);
+				if (pos == std::string::npos) return std::nullopt;
+				std::string v = line.substr(pos + std::strlen(key));
+				v.erase(0, v.find_first_not_of(" \t"));
+				return v;
+			};
+			if (!stats) stats.emplace();
+			if (auto v = value("total startup time in dynamic loader:")) stats->startupTime = *v;
+			else if (auto v2 = value("number of relocations from cache:")) stats->relocationsFromCache = *v2;
+			else if (auto v3 = value("number of relocations:")) stats->relocations = *v3;
+		}
+	}
+	fs::remove_all(dir, ec);
+	return stats;
+}
+
+static bool isPerfData(const fs::path &path) {
+	std::string magic;
+	return readFilePrefix(path, magic, 8) && magic == "PERFILE2";
+}
+
+// Rewrites `target` with llvm-bolt using the configured profile: hot/cold
+// function and block reordering, function splitting and identical code
+// folding. A perf.data profile is converted with perf2bolt first.
+static bool runBolt(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label, PassRecord &record) {
+	if (!tools.bolt) {
+		LogLine() << label << "BOLT: llvm-bolt not found in PATH; skipping layout optimization";
+		return false;
+	}
+	auto elf = readElf(target);
+	if (!elf || std::none_of(elf->sections.begin(), elf->sections.end(), [](const ElfSection &s) { return s.type == SHT_SYMTAB; })) {
+		LogLine() << label << "BOLT: binary has no symbol table; skipping layout optimization";
+		return false;
+	}
+	const bool relocs = std::any_of(elf->sections.begin(), elf->sections.end(), [](const ElfSection &s) {
+		return (s.type == SHT_RELA || s.type == SHT_REL) && !(s.flags & SHF_ALLOC);
+	});
+	if (!relocs) LogLine() << label << "BOLT: no static relocations (link with -Wl,--emit-relocs); functions cannot be reordered";
+
+	auto runStep = [&](const std::string &name, const std::vector<std::string> &cmd) {
+		auto start = std::chrono::steady_clock::now();
+		std::uintmax_t before = fileSize(target);
+		CommandResult res = runCommand(cmd, true, true);
+		record.steps.push_back({name, secondsSince(start), res.cpuSeconds, before, before, res.exitCode});
+		if (res.exitCode != 0) {
+			std::string msg = res.stderrText;
+			while (!msg.empty() && msg.back() == '\n') msg.pop_back();
+			LogLine() << label << name << " exited with " << res.exitCode << ": " << msg;
+		}
+		return res.exitCode == 0;
+	};
+
+	const std::string base = target.string() + ".optimz-bolt";
+	std::error_code ec;
+	fs::path data = *opts.boltProfile;
+	if (isPerfData(data)) {
+		if (!tools.perf2bolt) {
+			LogLine() << label << "BOLT: perf.data profile needs perf2bolt, which is not in PATH";
+			return false;
+		}
+		data = base + ".fdata";
+		if (!runStep("perf2bolt", {*tools.perf2bolt, "-p", opts.boltProfile->string(), "-o", data.string(), target.string()})) {
+			fs::remove(data, ec);
+			return false;
+		}
+	}
+
+	const fs::path out = base;
+	std::vector<std::string> cmd{*tools.bolt, target.string(), "-o", out.string(), "-data=" + data.string()};
+	if (opts.boltArgs.empty()) {
+		cmd.insert(cmd.end(), {"-reorder-blocks=ext-tsp", "-reorder-functions=hfsort", "-split-functions", "-split-all-cold", "-split-eh", "-icf=1", "-use-gnu-stack"});
+	} else {
+		cmd.insert(cmd.end(), opts.boltArgs.begin(), opts.boltArgs.end());
+	}
+	bool ok = runStep("bolt", cmd);
+	if (data != *opts.boltProfile) fs::remove(data, ec);
+	if (ok) {
+		fs::permissions(out, fs::status(target, ec).permissions(), ec);
+		fs::rename(out, target, ec);
+		if (ec) {
+			LogLine() << label << "BOLT: cannot replace target: " << ec.message();
+			ok = false;
+		} else {
+			record.steps.back().sizeAfter = fileSize(target);
+		}
+	}
+	if (!ok) fs::remove(out, ec);
+	return ok;
+}
+
+static std::string joinNames(const std::vector<std::string> &names) {
+	std::string out;
+	for (const auto &n : names) out += (out.empty() ? "" : ", ") + n;
+	return out;
+}
+
+// Reports load-time cost and DT_NEEDED entries that satisfy nothing, and
+// removes those entries when --prune-needed was given.
+static void pruneNeeded(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label, PassRecord &record) {
+	auto report = analyzeNeeded(target, tools);
+	if (!report) return;
+	LogLine() << label << "Dependencies: " << report->relocations << " dynamic relocations, " << report->undefinedSymbols << " undefined symbols";
+	if (!report->missing.empty()) {
+		LogLine() << label << "Dependencies: cannot resolve " << joinNames(report->missing) << "; not pruning";
+		return;
+	}
+	if (report->unused.empty()) return;
+	LogLine() << label << "Dependencies: unused " << joinNames(report->unused);
+	if (!opts.pruneNeeded) return;
+	if (!tools.patchelf) {
+		LogLine() << label << "Dependencies: patchelf not found in PATH; not pruning";
+		return;
+	}
+	std::vector<std::string> cmd{*tools.patchelf};
+	for (const auto &lib : report->unused) {
+		cmd.push_back("--remove-needed");
+		cmd.push_back(lib);
+	}
+	cmd.push_back(target.string());
+	auto start = std::chrono::steady_clock::now();
+	std::uintmax_t before = fileSize(target);
+	CommandResult res = runCommand(cmd, true, true);
+	record.steps.push_back({"remove-needed", secondsSince(start), res.cpuSeconds, before, fileSize(target), res.exitCode});
+	if (res.exitCode != 0) LogLine() << label << "patchelf exited with " << res.exitCode << ": " << res.stderrText;
+}
+
+// Where the debug file for `elf` goes: the debuginfod/gdb layout
+// <dir>/.build-id/xx/yyyy.debug, or <dir>/<name>.debug without a build ID.
+static fs::path debugFilePath(const fs::path &dir, const ElfInfo &elf, const fs::path &target) {
+	if (elf.buildId.size() > 2) return dir / ".build-id" / elf.buildId.substr(0, 2) / (elf.buildId.substr(2) + ".debug");
+	return dir / (target.filename().string() + ".debug");
+}
+
+// Extracts symbols and debug sections into a separate file and links it
+// from the target, so the strip steps that follow only drop copies.
+static void splitDebugInfo(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label, PassRecord &record) {
+	auto elf = readElf(target);
+	if (!elf || (!hasDebugSections(*elf) && std::none_of(elf->sections.begin(), elf->sections.end(), [](const ElfSection &s) { return s.type == SHT_SYMTAB; }))) return;
+	if (!tools.objcopy) {
+		LogLine() << label << "Split debug: objcopy not found in PATH; debug info will be discarded";
+		return;
+	}
+	if (elf->buildId.empty()) LogLine() << label << "Split debug: no build ID; debug file is located by name only";
+	const fs::path debugFile = debugFilePath(*opts.splitDebugDir, *elf, target);
+	std::error_code ec;
+	fs::create_directories(debugFile.parent_path(), ec);
+	if (ec) {
+		LogLine() << label << "Split debug: cannot create " << debugFile.parent_path() << ": " << ec.message();
+		return;
+	}
+	auto step = [&](const std::string &name, const std::vector<std::string> &cmd) {
+		auto start = std::chrono::steady_clock::now();
+		std::uintmax_t before = fileSize(target);
+		CommandResult res = runCommand(cmd, true, true);
+		record.steps.push_back({name, secondsSince(start), res.cpuSeconds, before, fileSize(target), res.exitCode});
+		if (res.exitCode != 0) LogLine() << label << name << " failed (" << res.exitCode << "): " << res.stderrText;
+		return res.exitCode == 0;
+	};
+	if (!step("split-debug", {*tools.objcopy, "--only-keep-debug", target.string(), debugFile.string()})) return;
+	fs::permissions(debugFile, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::others_read, ec);
+	// An existing link would point at the original build's debug file
+	if (std::any_of(elf->sections.begin(), elf->sections.end(), [](const ElfSection &s) { return s.name == ".gnu_debuglink"; })) {
+		step("remove-debuglink", {*tools.objcopy, "--remove-section=.gnu_debuglink", target.string()});
+	}
+	if (step("add-debuglink", {*tools.objcopy, "--add-gnu-debuglink=" + debugFile.string(), target.string()})) {
+		LogLine() << label << "Split debug: " << debugFile.string();
+	}
+}
+
+// The debug file `binary`'s .gnu_debuglink names below `dir`, where
+// splitDebugInfo() put it; nullopt when it links none.
+static std::optional<fs::path> linkedDebugFile(const fs::path &dir, const fs::path &binary) {
+	MappedFile file(binary);
+	if (!file.ok()) return std::nullopt;
+	auto elf = parseElf(file.data(), file.size());
+	if (!elf) return std::nullopt;
+	for (const auto &sec : elf->sections) {
+		if (sec.name != ".gnu_debuglink" || sec.type == SHT_NOBITS || sec.offset > file.size() || sec.size > file.size() - sec.offset) continue;
+		if (elf->buildId.size() > 2) return debugFilePath(dir, *elf, binary);
+		const char *name = reinterpret_cast<const char *>(file.data() + sec.offset);
+		std::string base(name, strnlen(name, sec.size));
+		if (base.empty() || base.find('/') != std::string::npos) return std::nullopt;
+		return dir / base;
+	}
+	return std::nullopt;
+}
+
+// Strips debug info from the relocatable members of an ar archive, members
+// in parallel, and rewrites the archive around them. Symbols survive
+// --strip-debug, so the symbol index keeps its names and only its member
+// offsets move. `threads` bounds the concurrent strip processes.
+static bool stripArchive(const fs::path &target, const Tools &tools, unsigned threads, const std::string &label, PassRecord &record) {
+	const std::optional<std::string> &tool = tools.objcopy ? tools.objcopy : tools.strip;
+	if (!tool) {
+		LogLine() << label << "Archive: objcopy or strip is needed for its members; skipping";
+		return false;
+	}
+	MappedFile file(target);
+	auto ar = file.ok() ? parseArchive(file.data(), file.size()) : std::nullopt;
+	if (!ar) {
+		LogLine() << label << "Archive: unsupported layout (thin or malformed); skipping";
+		return false;
+	}
+	// A BSD __.SYMDEF index holds member offsets too, in a format not
+	// rewritten here
+	if (std::any_of(ar->members.begin(), ar->members.end(), [](const ArMember &m) { return m.name.rfind("__.SYMDEF", 0) == 0; })) {
+		LogLine() << label << "Archive: BSD symbol index (__.SYMDEF) cannot be rebuilt; skipping";
+		return false;
+	}
+	std::vector<std::size_t> todo;
+	for (std::size_t i = 0; i < ar->members.size(); ++i) {
+		const ArMember &m = ar->members[i];
+		if (ar->index == i || m.name == "//") continue;
+		auto elf = parseElf(file.data() + m.data, m.size);
+		if (elf && elf->type == ET_REL && hasDebugSections(*elf)) todo.push_back(i);
+	}
+	if (todo.empty()) return false;
+	std::string dir = target.string() + ".optimz-ar-XXXXXX";
+	if (!mkdtemp(dir.data())) {
+		LogLine() << label << "Archive: cannot create a scratch directory: " << std::strerror(errno);
+		return false;
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::optional<std::string>> stripped(ar->members.size());
+	std::vector<double> cpu(todo.size());
+	std::atomic<std::size_t> next{0};
+	std::atomic<unsigned> failures{0};
+	auto worker = [&] {
+		for (std::size_t k; (k = next++) < todo.size();) {
+			const ArMember &m = ar->members[todo[k]];
+			const fs::path obj = fs::path(dir) / (std::to_string(k) + ".o");
+			std::ofstream(obj, std::ios::binary).write(reinterpret_cast<const char *>(file.data() + m.data), static_cast<std::streamsize>(m.size));
+			CommandResult res = runCommand({*tool, "--strip-debug", obj.string()}, true, true);
+			cpu[k] = res.cpuSeconds;
+			std::string out;
+			if (res.exitCode == 0 && readFilePrefix(obj, out, fileSize(obj))) {
+				stripped[todo[k]] = std::move(out);
+			} else {
+				LogLine() << label << m.name << ": " << fs::path(*tool).filename().string() << " exited with " << res.exitCode;
+				++failures;
+			}
+		}
+	};
+	std::vector<std::thread> pool(std::min<std::size_t>(todo.size(), std::max(1u, threads)));
+	for (auto &t : pool) t = std::thread(worker);
+	for (auto &t : pool) t.join();
+	std::error_code ec;
+	fs::remove_all(dir, ec);
+
+	// Lay the members out again, then point the index at their new headers
+	std::vector<std::string> headers(ar->members.size());
+	std::map<std::uint64_t, std::uint64_t> moved;
+	std::uint64_t off = 8;
+	bool ok = true;
+	for (std::size_t i = 0; i < ar->members.size(); ++i) {
+		const ArMember &m = ar->members[i];
+		const std::uint64_t nameLen = m.data - m.header - 60; // BSD names live in the data
+		const std::uint64_t len = nameLen + (stripped[i] ? stripped[i]->size() : m.size);
+		std::string size = std::to_string(len);
+		headers[i].assign(reinterpret_cast<const char *>(file.data() + m.header), 60);
+		if (size.size() > 10) ok = false;
+		size.resize(10, ' ');
+		headers[i].replace(48, 10, size);
+		moved[m.header] = off;
+		off += 60 + len + (len & 1);
+	}
+	std::string index;
+	if (ar->index) {
+		const ArMember &m = ar->members[*ar->index];
+		const unsigned width = m.name == "/" ? 4 : 8;
+		index.assign(reinterpret_cast<const char *>(file.data() + m.data), m.size);
+		ElfReader r{file.data() + m.data, m.size, false};
+		const std::uint64_t count = r.load(0, width);
+		for (std::uint64_t k = 0; ok && count <= (m.size - width) / width && k < count; ++k) {
+			auto it = moved.find(r.load(width * (k + 1), width));
+			if (it == moved.end() || (width == 4 && it->second > UINT32_MAX)) ok = false;
+			else storeInt(index, width * (k + 1), it->second, width, false);
+		}
+		if (!r.ok) ok = false;
+	}
+	if (!ok) {
+		LogLine() << label << "Archive: cannot rebuild the symbol index; left unchanged";
+		return false;
+	}
+	static const char pad = '\n';
+	std::vector<std::pair<const void *, std::size_t>> chunks{{kArMagic, 8}};
+	for (std::size_t i = 0; i < ar->members.size(); ++i) {
+		const ArMember &m = ar->members[i];
+		chunks.emplace_back(headers[i].data(), 60);
+		chunks.emplace_back(file.data() + m.header + 60, m.data - m.header - 60);
+		if (ar->index == i) chunks.emplace_back(index.data(), index.size());
+		else if (stripped[i]) chunks.emplace_back(stripped[i]->data(), stripped[i]->size());
+		else chunks.emplace_back(file.data() + m.data, m.size);
+		if ((m.data - m.header - 60 + chunks.back().second) & 1) chunks.emplace_back(&pad, 1);
+	}
+	const std::uintmax_t before = file.size();
+	std::string err;
+	const bool written = replaceFile(target, chunks, err);
+	const double cpuSeconds = std::accumulate(cpu.begin(), cpu.end(), 0.0);
+	record.steps.push_back({"strip-archive", secondsSince(start), cpuSeconds, before, fileSize(target), written && !failures ? 0 : 1});
+	if (!written) {
+		LogLine() << label << "Archive: " << err;
+		return false;
+	}
+	LogLine() << label << "Archive: stripped debug info from " << (todo.size() - failures) << " of " << todo.size() << " members";
+	return true;
+}
+
+struct PackCandidate {
+	std::string name;
+	std::vector<std::string> flags;
+	fs::path path;           // private copy the packer rewrote; empty for "none"
+	bool ok = false;
+	bool timedOut = false;
+	std::uintmax_t size = 0;
+	double packSeconds = 0;
+	std::optional<StartupSample> startup;
+};
+
+// Packs private copies of `target` with several UPX settings at once and
+// moves the winner over it. "none" competes too, so a file that packs
+// badly stays unpacked. Returns false if the target was left untouched.
+static bool searchPacking(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label, PassRecord &record) {
+	const PackSearch &search = *opts.packSearch;
+	auto start = std::chrono::steady_clock::now();
+	const std::uintmax_t before = fileSize(target);
+	static const std::vector<std::pair<const char *, std::vector<std::string>>> settings = {
+		{"none", {}},
+		{"lzma", {"--lzma"}},
+		{"best", {"--best"}},
+		{"best-lzma", {"--best", "--lzma"}},
+		{"brute", {"--brute"}},
+		{"ultra-brute", {"--ultra-brute"}},
+	};
+	std::vector<PackCandidate> cands(settings.size());
+	for (std::size_t i = 0; i < settings.size(); ++i) {
+		cands[i].name = settings[i].first;
+		cands[i].flags = settings[i].second;
+	}
+	cands[0].ok = true;
+	cands[0].size = before;
+	for (auto &c : cands) {
+		if (c.flags.empty()) continue;
+		std::string tmpl = target.string() + ".optimz-pack-" + c.name + "-XXXXXX";
+		int fd = mkstemp(tmpl.data());
+		if (fd < 0) continue;
+		close(fd);
+		std::error_code ec;
+		fs::copy_file(target, tmpl, fs::copy_options::overwrite_existing, ec);
+		if (ec) fs::remove(tmpl, ec);
+		else c.path = tmpl;
+	}
+
+	// Slower settings come last, so a tight budget cuts those first
+	std::atomic<std::size_t> next{1};
+	auto worker = [&] {
+		for (std::size_t i; (i = next++) < cands.size();) {
+			PackCandidate &c = cands[i];
+			if (c.path.empty()) continue;
+			double left = search.budgetSeconds > 0 ? search.budgetSeconds - secondsSince(start) : 24 * 3600.0;
+			if (left <= 0) {
+				c.timedOut = true;
+				continue;
+			}
+			std::vector<std::string> cmd{*tools.upx, "-q"};
+			cmd.insert(cmd.end(), c.flags.begin(), c.flags.end());
+			cmd.push_back(c.path.string());
+			TimedRun run = runTimed(cmd, left);
+			c.packSeconds = run.wallSeconds;
+			c.timedOut = run.timedOut;
+			c.ok = run.exitCode == 0 && !run.timedOut;
+			if (c.ok) c.size = fileSize(c.path);
+		}
+	};
+	unsigned jobs = search.jobs ? search.jobs : std::max(1u, std::thread::hardware_concurrency());
+	jobs = std::min<unsigned>(jobs, cands.size() - 1);
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < jobs; ++i) threads.emplace_back(worker);
+	worker();
+	for (auto &t : threads) t.join();
+
+	// Startup is timed one candidate at a time so runs do not compete for cores
+	const bool timeStartup = opts.startupGuard || search.objective == PackObjective::SizeStartup;
+	StartupGuard guard = opts.startupGuard.value_or(StartupGuard{});
+	if (!opts.startupGuard) guard.runs = search.startupRuns;
+	if (timeStartup) {
+		for (auto &c : cands) {
+			if (!c.ok) continue;
+			c.startup = measureStartup(smokeCommand(c.path.empty() ? target : c.path, opts.smokeCmd), guard);
+			if (!c.startup && c.path.empty()) {
+				LogLine() << label << "Pack search: unpacked binary did not run consistently; not timing candidates";
+				break;
+			}
+		}
+	}
+	const std::optional<StartupSample> baseline = cands[0].startup;
+
+	auto score = [&](const PackCandidate &c) {
+		double s = static_cast<double>(c.size);
+		if (search.objective == PackObjective::SizeStartup && baseline) s *= c.startup->medianSeconds / std::max(baseline->medianSeconds, 1e-9);
+		return s;
+	};
+	std::size_t best = 0;
+	for (std::size_t i = 1; i < cands.size(); ++i) {
+		PackCandidate &c = cands[i];
+		std::ostringstream msg;
+		msg.precision(2);
+		msg << std::fixed << "Pack search: " << c.name << ": ";
+		if (c.path.empty()) msg << "no private copy";
+		else if (c.timedOut) msg << "over the time budget";
+		else if (!c.ok) msg << "upx failed";
+		else msg << c.size << " bytes in " << c.packSeconds << " s";
+		if (c.ok && baseline) {
+			if (!c.startup || c.startup->exitCode != baseline->exitCode) {
+				msg << ", did not run like the original";
+				c.ok = false;
+			} else {
+				double pct = 100.0 * (c.startup->medianSeconds - baseline->medianSeconds) / std::max(baseline->medianSeconds, 1e-9);
+				msg << ", startup " << c.startup->medianSeconds * 1e3 << " ms (" << (pct >= 0 ? "+" : "") << pct << "%)";
+				if (opts.startupGuard && pct > opts.startupGuard->maxRegressionPct) {
+					msg << ", over the startup budget";
+					c.ok = false;
+				}
+			}
+		} else if (c.ok && timeStartup) {
+			// Without a baseline the candidates cannot be compared or guarded
+			c.ok = false;
+		}
+		LogLine() << label << msg.str();
+		if (c.ok && score(c) < score(cands[best])) best = i;
+	}
+
+	bool changed = false;
+	if (best != 0) {
+		std::error_code ec;
+		fs::rename(cands[best].path, target, ec);
+		if (ec) LogLine() << label << "Pack search: cannot install " << cands[best].name << ": " << ec.message();
+		else {
+			cands[best].path.clear();
+			changed = true;
+		}
+	}
+	LogLine() << label << "Pack search: keeping " << (changed ? cands[best].name : "unpacked");
+	for (const auto &c : cands) {
+		std::error_code ec;
+		if (!c.path.empty()) fs::remove(c.path, ec);
+	}
+	record.steps.push_back({"upx-search", secondsSince(start), 0, before, fileSize(target), 0});
+	return changed;
+}
+
+static bool optimizeOnce(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label, PassRecord &record, FileState &state) {
+	// Nothing but UPX understands a packed file, and sstrip leaves no
+	// sections for the other steps to work on
+	if (state.sealed) return false;
+	const unsigned startVersion = state.version;
+	if (!state.stamp) state.stamp = FileStamp::of(target);
+	const bool executable = state.kind == FileKind::Executable;
+	const bool object = state.kind == FileKind::Object;
+	auto due = [&](const std::string &name) {
+		auto it = state.ranAt.find(name);
+		return it == state.ranAt.end() || it->second != state.version;
+	};
+	auto ran = [&](const std::string &name) {
+		auto now = FileStamp::of(target);
+		if (!(now == state.stamp)) {
+			++state.version;
+			state.stamp = now;
+		}
+		state.ranAt[name] = state.version;
+	};
+
+	if (state.kind == FileKind::Archive) {
+		if (due("strip-archive")) {
+			stripArchive(target, tools, opts.fileThreads, label, record);
+			ran("strip-archive");
+		}
+		LogLine() << label << "Size: " << fileSize(target) << " bytes";
+		return state.version != startVersion;
+	}
+
+	std::uintmax_t sizeNow = fileSize(target);
+	std::uintmax_t beforeStep = 0;
+	// Re-read after every step that ran; steps whose work is already done
+	// are skipped instead of rewriting the file for nothing
+	std::optional<ElfInfo> elf = readElf(target);
+
+	auto wanted = [&](bool (*applies)(const ElfInfo &)) {
+		return !elf || applies(*elf);
+	};
+	// Objects keep their symbols and relocations for the link
+	auto symbolsPending = [&] {
+		return !object && wanted(hasStrippableSymbols);
+	};
+
+	// Skipped (as success) when the step already saw the current contents
+	auto tryStep = [&](const std::string &name, const std::vector<std::string> &cmd) {
+		if (!due(name)) return 0;
+		beforeStep = sizeNow;
+		auto start = std::chrono::steady_clock::now();
+		CommandResult res = runCommand(cmd, true, true);
+		int rc = res.exitCode;
+		StepRecord step{name, secondsSince(start), res.cpuSeconds, beforeStep, 0, rc};
+		if (rc != 0 && !res.stderrText.empty()) {
+			std::string msg = res.stderrText;
+			while (!msg.empty() && msg.back() == '\n') msg.pop_back();
+			LogLine() << label << fs::path(cmd[0]).filename().string() << " exited with " << rc << ": " << msg;
+		}
+		sizeNow = fileSize(target);
+		step.sizeAfter = sizeNow;
+		record.steps.push_back(step);
+		ran(name);
+		elf = readElf(target);
+		return rc;
+	};
+
+	const Pipeline &pipeline = opts.pipeline;
+	// The resolved command of `r` on the target
+	auto command = [&](const ResolvedStep &r) {
+		std::vector<std::string> cmd{r.tool};
+		cmd.insert(cmd.end(), r.flags.begin(), r.flags.end());
+		cmd.push_back(target.string());
+		return cmd;
+	};
+
+	// With split debug info the build ID and debug link must survive, so
+	// matching sections are named one by one instead of by wildcard
+	const bool keepLinks = opts.splitDebugDir.has_value() && !object;
+	// Libraries and objects keep their notes (.note.GNU-stack marks an
+	// object's stack non-executable)
+	auto metadataPending = [&] {
+		return executable && pipeline.has(Step::RemoveMetadata) && wanted(keepLinks ? hasUnlinkedMetadata : hasMetadataSections);
+	};
+	auto metadataFlags = [&] {
+		std::vector<std::string> flags;
+		if (!keepLinks) return std::vector<std::string>{"--remove-section=.comment", "--remove-section=.note", "--remove-section=.note.*", "--remove-section=.gnu_debuglink"};
+		if (!elf) return std::vector<std::string>{"--remove-section=.comment"};
+		for (const auto &sec : elf->sections) {
+			if (isMetadataSection(sec) && !isDebugLinkSection(sec)) flags.push_back("--remove-section=" + sec.name);
+		}
+		return flags;
+	};
+	// Libraries never lose more than their unneeded symbols
+	const ResolvedStep *stripAll = executable ? pipeline.find(Step::StripAll) : nullptr;
+	const ResolvedStep *stripUnneeded = pipeline.find(Step::StripUnneeded);
+	if (!stripUnneeded && !executable) stripUnneeded = pipeline.find(Step::StripAll);
+	const ResolvedStep *stripDebug = pipeline.find(Step::StripDebug);
+	const ResolvedStep *compressDebug = executable ? pipeline.find(Step::CompressDebug) : nullptr;
+	// zstd through libzstd runs after the rest of the group, on its own
+	const bool zstdNative = compressDebug && opts.zstdDebugLevel && Zstd::get();
+	auto compressNative = [&] {
+		if (!zstdNative || !elf || !wanted(hasUncompressedDebug) || !due("native-compress-debug")) return;
+		beforeStep = sizeNow;
+		auto start = std::chrono::steady_clock::now();
+		double cpuStart = threadCpuSeconds();
+		std::string err;
+		RewriteResult rr = compressDebugFile(target, *opts.zstdDebugLevel, opts.fileThreads, err);
+		if (rr == RewriteResult::Changed) {
+			sizeNow = fileSize(target);
+			elf = readElf(target);
+		}
+		// Threads other than this one do not show in its CPU clock
+		record.steps.push_back({"native-compress-debug", secondsSince(start), threadCpuSeconds() - cpuStart, beforeStep, sizeNow, rr == RewriteResult::Declined ? 1 : 0});
+		ran("native-compress-debug");
+		if (rr != RewriteResult::Declined) return;
+		LogLine() << label << "Built-in zstd compression skipped (" << err << ")" << (compressDebug->tool.empty() ? "" : "; using objcopy");
+		if (!compressDebug->tool.empty()) tryStep("compress-debug", command(*compressDebug));
+	};
+
+	// The strip group runs once, where the profile's first strip step is
+	auto runStripGroup = [&] {
+		// 1) Built-in engine: everything the group asks of it in one
+		// rewrite. Objects need section renumbering it does not do.
+		NativeStrip native;
+		native.symbols = opts.stripEngine == Engine::Native && (stripAll || stripUnneeded);
+		native.debug = opts.debugEngine == Engine::Native && stripDebug;
+		native.metadata = opts.metadataEngine == Engine::Native && metadataPending();
+		native.keepDebugLinks = opts.splitDebugDir.has_value();
+		if (!object && elf && nativeHasWork(*elf, native) && due("native-strip")) {
+			beforeStep = sizeNow;
+			auto start = std::chrono::steady_clock::now();
+			double cpuStart = threadCpuSeconds();
+			std::string err;
+			RewriteResult rr = nativeStripFile(target, native, err);
+			if (rr == RewriteResult::Declined) LogLine() << label << "Built-in engine skipped (" << err << "); using external tools";
+			if (rr == RewriteResult::Changed) {
+				sizeNow = fileSize(target);
+				elf = readElf(target);
+			}
+			record.steps.push_back({"native-strip", secondsSince(start), threadCpuSeconds() - cpuStart, beforeStep, sizeNow, rr == RewriteResult::Declined ? 1 : 0});
+			ran("native-strip");
+		}
+
+		// 2-3) Fused: every strip/remove/compress operation still needed, as
+		// a single objcopy rewrite instead of up to five
+		bool fused = false;
+		if (!pipeline.fusedObjcopy.empty()) {
+			std::vector<std::string> cmd{pipeline.fusedObjcopy};
+			if ((stripAll || stripUnneeded) && symbolsPending()) cmd.push_back(stripAll ? "--strip-all" : "--strip-unneeded");
+			if (stripDebug && wanted(hasDebugSections)) cmd.push_back("--strip-debug");
+			if (keepLinks && cmd.size() > 1) cmd.push_back("--keep-section=.gnu_debuglink");
+			if (metadataPending()) {
+				auto flags = metadataFlags();
+				cmd.insert(cmd.end(), flags.begin(), flags.end());
+			}
+			if (compressDebug && !zstdNative && wanted(hasUncompressedDebug)) cmd.push_back(compressDebug->flags.front());
+			if (cmd.size() > 1) {
+				cmd.push_back(target.string());
+				fused = tryStep("objcopy-fused", cmd) == 0;
+				if (!fused) LogLine() << label << "Fused objcopy step failed; running steps one by one";
+			}
+		}
+		if (fused) {
+			compressNative();
+			return;
+		}
+
+		// 2) Strip symbols (unneeded first, then all for executables)
+		if (stripUnneeded && !stripUnneeded->tool.empty() && symbolsPending()) {
+			tryStep("strip-unneeded", {stripUnneeded->tool, "--strip-unneeded", target.string()});
+		}
+		if (stripAll && !stripAll->tool.empty() && symbolsPending()) tryStep("strip-all", command(*stripAll));
+
+		// 3) Remove debug info and common note/comment sections
+		if (stripDebug && !stripDebug->tool.empty() && wanted(hasDebugSections)) tryStep("strip-debug", command(*stripDebug));
+		const ResolvedStep *metadata = pipeline.find(Step::RemoveMetadata);
+		if (metadata && !metadata->tool.empty() && metadataPending()) {
+			std::vector<std::string> cmd{metadata->tool};
+			auto flags = metadataFlags();
+			cmd.insert(cmd.end(), flags.begin(), flags.end());
+			cmd.push_back(target.string());
+			tryStep("remove-metadata", cmd);
+		}
+		// Compress whatever debug sections may remain
+		if (compressDebug && !zstdNative && !compressDebug->tool.empty() && wanted(hasUncompressedDebug)) tryStep("compress-debug", command(*compressDebug));
+		compressNative();
+	};
+
+	// UPX with the optional startup guard: the unpacked binary is timed and
+	// snapshotted, and packing is undone when startup regresses too much
+	auto packGuarded = [&](const ResolvedStep &step) {
+		std::optional<StartupSample> baseline;
+		if (opts.startupGuard) {
+			baseline = measureStartup(smokeCommand(target, opts.smokeCmd), *opts.startupGuard);
+			if (!baseline) LogLine() << label << "Startup guard: unpacked binary did not run consistently; not guarding UPX";
+		}
+		fs::path snapshot;
+		if (baseline) {
+			std::string tmpl = target.string() + ".optimz-prepack-XXXXXX";
+			int fd = mkstemp(tmpl.data());
+			std::error_code ec;
+			if (fd >= 0) {
+				close(fd);
+				fs::copy_file(target, tmpl, fs::copy_options::overwrite_existing, ec);
+				if (ec) fs::remove(tmpl, ec);
+				else snapshot = tmpl;
+			}
+			if (snapshot.empty()) {
+				LogLine() << label << "Startup guard: cannot snapshot before packing; skipping UPX";
+			}
+		}
+		// UPX is terminal too: one attempt per file, whatever the outcome
+		state.packRejected = true;
+		const unsigned versionBeforePack = state.version;
+		const bool canPack = !baseline || !snapshot.empty();
+		const bool packed = canPack && tryStep("upx", command(step)) == 0;
+		if (packed && state.version != versionBeforePack) state.sealed = true;
+		if (packed && baseline) {
+			std::optional<StartupSample> after = measureStartup(smokeCommand(target, opts.smokeCmd), *opts.startupGuard);
+			double pct = after ? 100.0 * (after->medianSeconds - baseline->medianSeconds) / std::max(baseline->medianSeconds, 1e-9) : 0;
+			std::ostringstream msg;
+			msg.precision(2);
+			msg << std::fixed << "Startup guard: " << baseline->medianSeconds * 1e3 << " ms unpacked, ";
+			if (after) msg << after->medianSeconds * 1e3 << " ms packed (" << (pct >= 0 ? "+" : "") << pct << "%)";
+			else msg << "packed binary did not run like the original";
+			if (!after || after->exitCode != baseline->exitCode || pct > opts.startupGuard->maxRegressionPct) {
+				std::error_code ec;
+				fs::rename(snapshot, target, ec);
+				if (ec) {
+					msg << "; rollback failed: " << ec.message();
+				} else {
+					snapshot.clear();
+					msg << "; over budget, UPX rolled back";
+					// Back to the pre-pack contents, which every step already saw
+					state.version = versionBeforePack;
+					state.stamp = FileStamp::of(target);
+					state.sealed = false;
+					sizeNow = fileSize(target);
+					record.steps.push_back({"upx-rollback", 0, 0, record.steps.back().sizeAfter, sizeNow, 0});
+					elf = readElf(target);
+				}
+			}
+			LogLine() << label << msg.str();
+		}
+		if (!snapshot.empty()) {
+			std::error_code ec;
+			fs::remove(snapshot, ec);
+		}
+	};
+
+	bool stripGroupDone = false;
+	for (const ResolvedStep &step : pipeline.steps) {
+		switch (step.step) {
+		case Step::Bolt:
+			// Profile-guided layout with BOLT. It needs the symbol table and
+			// relocations, so it runs once, before anything is stripped
+			if (opts.boltProfile && !state.layoutDone && !object) {
+				state.layoutDone = true;
+				if (runBolt(target, tools, opts, label, record)) elf = readElf(target);
+				ran("bolt");
+				sizeNow = fileSize(target);
+			}
+			break;
+		case Step::RemoveNeeded:
+			// Unused shared library dependencies; analysis needs .dynsym and
+			// the section headers, so it also runs before stripping
+			if ((opts.analyzeNeeded || opts.pruneNeeded) && !state.neededDone && !object) {
+				state.neededDone = true;
+				pruneNeeded(target, tools, opts, label, record);
+				ran("remove-needed");
+				sizeNow = fileSize(target);
+				elf = readElf(target);
+			}
+			break;
+		case Step::SplitDebug:
+			// Move debug info aside before the strip steps discard it
+			if (opts.splitDebugDir && !state.debugSplit && !object) {
+				state.debugSplit = true;
+				splitDebugInfo(target, tools, opts, label, record);
+				ran("split-debug");
+				sizeNow = fileSize(target);
+				elf = readElf(target);
+			}
+			break;
+		case Step::StripUnneeded:
+		case Step::StripAll:
+		case Step::StripDebug:
+		case Step::RemoveMetadata:
+		case Step::CompressDebug:
+			if (!stripGroupDone) runStripGroup();
+			stripGroupDone = true;
+			break;
+		case Step::ShrinkRpath:
+			if (executable && wanted(hasRpath)) tryStep("shrink-rpath", command(step));
+			break;
+		case Step::CompactLayout:
+			// Runs after everything that drops or resizes sections, so the
+			// padding it closes is final
+			if ((executable || state.kind == FileKind::SharedLibrary) && elf && due("compact-layout")) {
+				beforeStep = sizeNow;
+				auto start = std::chrono::steady_clock::now();
+				double cpuStart = threadCpuSeconds();
+				std::string err, report;
+				RewriteResult rr = compactLayoutFile(target, opts.pageSize, report, err);
+				if (!report.empty()) LogLine() << label << "Layout: " << report;
+				if (rr == RewriteResult::Declined) LogLine() << label << "Layout left as is (" << err << ")";
+				if (rr == RewriteResult::Changed) {
+					sizeNow = fileSize(target);
+					elf = readElf(target);
+				}
+				record.steps.push_back({"compact-layout", secondsSince(start), threadCpuSeconds() - cpuStart, beforeStep, sizeNow, rr == RewriteResult::Declined ? 1 : 0});
+				ran("compact-layout");
+			}
+			break;
+		case Step::Sstrip:
+			// Super-strip (more aggressive). Terminal: runs at most once
+			if (executable && wanted(hasSuperStrippableData) && !state.ranAt.count("sstrip")) {
+				const unsigned before = state.version;
+				if (tryStep("sstrip", command(step)) == 0 && state.version != before) state.sealed = true;
+			}
+			break;
+		case Step::Upx:
+			// Pack as final step, optionally within a startup latency budget
+			if (!executable || state.packRejected || (elf && elf->upxPacked)) break;
+			if (opts.packSearch) {
+				// One search per file; a later pass would only repeat it
+				state.packRejected = true;
+				if (searchPacking(target, tools, opts, label, record)) {
+					sizeNow = fileSize(target);
+					elf = readElf(target);
+					state.sealed = true;
+				}
+				ran("upx-search");
+				break;
+			}
+			packGuarded(step);
+			break;
+		}
+	}
+
+	LogLine() << label << "Size: " << (fileSize(target) + 0) << " bytes";
+	return state.version != startVersion;
+}
+
+// What --verify looks at, taken before optimizing and again afterwards, so
+// a result is judged against how the original behaved on this host.
+struct VerifyProbe {
+	bool parsed = false;
+	std::optional<ElfInfo> elf;       // empty for archives
+	std::string interpreter;          // PT_INTERP contents
+	bool entryMapped = true;          // e_entry lies in an executable PT_LOAD
+	std::set<std::string> unresolved; // libraries ldd reports as not found
+	std::optional<TimedRun> smoke;
+};
+
+static VerifyProbe probeFile(const fs::path &path, FileKind kind, const Options &opts) {
+	VerifyProbe p;
+	MappedFile file(path);
+	if (!file.ok()) return p;
+	if (kind == FileKind::Archive) {
+		auto ar = parseArchive(file.data(), file.size());
+		p.parsed = ar && std::all_of(ar->members.begin(), ar->members.end(), [&](const ArMember &m) {
+			           return !hasElfMagic(file.data() + m.data, m.size) || parseElf(file.data() + m.data, m.size);
+		           });
+		return p;
+	}
+	p.elf = parseElf(file.data(), file.size());
+	if (!p.elf) return p;
+	p.parsed = true;
+	for (const auto &seg : p.elf->segments) {
+		if (seg.type != PT_INTERP || seg.offset >= file.size()) continue;
+		const char *c = reinterpret_cast<const char *>(file.data() + seg.offset);
+		p.interpreter.assign(c, strnlen(c, std::min<std::uint64_t>(seg.filesz, file.size() - seg.offset)));
+	}
+	if (kind == FileKind::Executable) {
+		const std::uint64_t entry = p.elf->entry;
+		p.entryMapped = std::any_of(p.elf->segments.begin(), p.elf->segments.end(), [entry](const ElfSegment &seg) {
+			return seg.type == PT_LOAD && (seg.flags & PF_X) && entry >= seg.vaddr && entry - seg.vaddr < seg.memsz;
+		});
+	}
+	const bool loadable = kind == FileKind::Executable || kind == FileKind::SharedLibrary;
+	if (loadable && opts.verify->ldd && p.elf->hasDynamic && !p.elf->upxPacked) {
+		CommandResult res = runCommand({*opts.verify->ldd, path.string()}, true, true, true);
+		std::istringstream lines(res.stdoutText);
+		for (std::string line; std::getline(lines, line);) {
+			auto arrow = line.find("=> not found");
+			if (arrow == std::string::npos) continue;
+			std::string name = line.substr(0, arrow);
+			name.erase(0, name.find_first_not_of(" \t"));
+			name.erase(name.find_last_not_of(" \t") + 1);
+			p.unresolved.insert(name);
+		}
+	}
+	if (kind == FileKind::Executable && opts.verify->smoke) p.smoke = runSandboxed(smokeCommand(path, opts.smokeCmd), opts.verify->limits);
+	return p;
+}
+
+static std::string describeRun(const TimedRun &run) {
+	return run.timedOut ? std::string("timed out") : "exited with " + std::to_string(run.exitCode);
+}
+
+// Empty when `after` still loads the way `before` did, else the reason.
+static std::string compareProbes(const VerifyProbe &before, const VerifyProbe &after, FileKind kind) {
+	if (!after.parsed) return kind == FileKind::Archive ? "the archive or one of its members no longer parses" : "the ELF headers no longer parse";
+	if (!before.elf || !after.elf) return {};
+	const ElfInfo &was = *before.elf, &is = *after.elf;
+	if (was.type != is.type || was.machine != is.machine) return "the ELF type or machine changed";
+	if (kind == FileKind::Object) return {};
+	if (std::none_of(is.segments.begin(), is.segments.end(), [](const ElfSegment &seg) { return seg.type == PT_LOAD; })) return "no loadable segments are left";
+	if (before.entryMapped && !after.entryMapped) return "the entry point is outside the executable segments";
+	// A packed file is a static stub; what it unpacks is covered by the smoke run
+	if (!is.upxPacked) {
+		if (before.interpreter != after.interpreter) return after.interpreter.empty() ? "the program interpreter is gone" : "the program interpreter changed to " + after.interpreter;
+		if (was.hasDynamic && !is.hasDynamic) return "the dynamic section is gone";
+		for (const auto &lib : is.needed) {
+			if (std::find(was.needed.begin(), was.needed.end(), lib) == was.needed.end()) return "it gained a dependency on " + lib;
+		}
+	}
+	for (const auto &lib : after.unresolved) {
+		if (!before.unresolved.count(lib)) return "ldd cannot resolve " + lib;
+	}
+	if (before.smoke && after.smoke && (before.smoke->timedOut != after.smoke->timedOut || before.smoke->exitCode != after.smoke->exitCode)) {
+		return "the smoke run " + describeRun(*after.smoke) + " (the original " + describeRun(*before.smoke) + ")";
+	}
+	return {};
+}
+
+struct FileResult {
+	fs::path path;
+	std::uintmax_t sizeBefore = 0;
+	std::uintmax_t sizeAfter = 0;
+	bool ok = false;
+	bool cacheHit = false;
+	double wallSeconds = 0;
+	std::vector<PassRecord> passes;
+	std::optional<MemorySample> memoryBefore;
+	std::optional<MemorySample> memoryAfter;
+	std::optional<LoaderStats> loaderBefore;
+	std::optional<LoaderStats> loaderAfter;
+	std::optional<VerifyProbe> verifyBefore; // set when --verify applies
+	std::optional<std::uint64_t> inputHash;  // with it: the contents a restore must bring back
+	fs::path rollback;                       // private copy of them when the backup holds others
+	bool verified = false;
+	std::string verifyError;
+};
+
+// Checks a finished result against its original. On failure an in-place
+// target goes back to its backup and its cache entry is dropped, so the
+// next run does not hand out the same output again. Results without a
+// probe (--verify off) pass.
+static bool verifyResult(FileResult &r, const fs::path &output, const Options &opts, const std::string &label) {
+	if (!r.verifyBefore) return true;
+	auto kind = classifyFile(output);
+	std::string why = kind ? compareProbes(*r.verifyBefore, probeFile(output, *kind, opts), *kind) : "it is no longer an ELF file or archive";
+	if (why.empty()) {
+		r.verified = true;
+		return true;
+	}
+	r.ok = false;
+	r.verifyError = why;
+	std::string note = "; output not written";
+	bool original = opts.output.has_value();
+	if (!opts.output) {
+		std::string err;
+		if (!opts.backup) err = "no backup was taken";
+		// A backup from an earlier run of other contents must not replace it
+		if (!r.rollback.empty()) {
+			original = rename(r.rollback.c_str(), r.path.c_str()) == 0;
+			if (original) r.rollback.clear();
+			else err = std::strerror(errno);
+		} else {
+			original = opts.backup && (opts.backupStore ? opts.backupStore->restore(r.path, err, r.inputHash) : restoreBak(r.path, err, r.inputHash));
+		}
+		note = original ? "; original restored" : "; cannot restore the original: " + err;
+		if (original) r.sizeAfter = fileSize(r.path);
+	}
+	if (original && opts.cache) {
+		if (auto key = opts.cache->keyFor(r.path)) {
+			opts.cache->evict(*key);
+			if (opts.splitDebugDir) opts.cache->evict(*key + ".debug");
+		}
+	}
+	LogLine() << label << "Verification failed: " << why << note;
+	return false;
+}
+
+static void logLoaderStats(const FileResult &r, const std::string &label) {
+	if (!r.loaderBefore || !r.loaderAfter) {
+		LogLine() << label << "Loader: no LD_DEBUG statistics (static binary or non-glibc loader?)";
+		return;
+	}
+	LogLine() << label << "Loader: startup " << r.loaderBefore->startupTime << " -> " << r.loaderAfter->startupTime << ", relocations "
+	          << r.loaderBefore->relocations << " -> " << r.loaderAfter->relocations;
+}
+
+static void logMemory(const FileResult &r, const std::string &label) {
+	if (!r.memoryBefore || !r.memoryAfter) {
+		LogLine() << label << "Memory: could not run the binary to completion";
+		return;
+	}
+	const MemorySample &a = *r.memoryBefore, &b = *r.memoryAfter;
+	LogLine line;
+	line << label << "Memory: peak RSS " << a.peakRssKb << " -> " << b.peakRssKb << " kB";
+	if (a.atExit && b.atExit) line << ", PSS at exit " << a.pssKb << " -> " << b.pssKb << " kB";
+	line << ", major faults " << a.majorFaults << " -> " << b.majorFaults;
+}
+
+// Live counters for --metrics-listen and --metrics-file, rendered in the
+// Prometheus text exposition format. Files are counted as they are queued,
+// start and finish; a background thread answers scrapes on a Unix or TCP
+// socket and rewrites the textfile-collector file every interval.
+class Metrics {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	explicit Metrics(unsigned workers) : workers_(workers) {}
+	~Metrics() { stop(); }
+	Metrics(const Metrics &) = delete;
+	Metrics &operator=(const Metrics &) = delete;
+
+	// `listen` is unix:PATH, HOST:PORT or :PORT; either may be empty
+	bool start(const std::string &listen, const std::optional<fs::path> &file, double intervalSeconds, std::string &err) {
+		if (!listen.empty() && !openListener(listen, err)) return false;
+		file_ = file;
+		interval_ = intervalSeconds;
+		wake_ = eventfd(0, EFD_CLOEXEC);
+		if (wake_ < 0) {
+			err = std::string("eventfd: ") + std::strerror(errno);
+			return false;
+		}
+		thread_ = std::thread([this] { run(); });
+		return true;
+	}
+
+	// Flushes the file one last time and closes the socket
+	void stop() {
+		if (!thread_.joinable()) return;
+		std::uint64_t one = 1;
+		if (write(wake_, &one, sizeof(one)) < 0) {
+			// The thread also exits on the next poll timeout; nothing else to do
+		}
+		thread_.join();
+		close(wake_);
+		if (listen_ >= 0) close(listen_);
+		if (!socketPath_.empty()) unlink(socketPath_.c_str());
+	}
+
+	void enqueued() {
+		std::lock_guard<std::mutex> lock(mu_);
+		++queued_;
+	}
+
+	Clock::time_point started() {
+		std::lock_guard<std::mutex> lock(mu_);
+		if (queued_) --queued_;
+		auto now = Clock::now();
+		inFlight_.insert(now);
+		return now;
+	}
+
+	void finished(const FileResult &r, Clock::time_point startedAt) {
+		std::lock_guard<std::mutex> lock(mu_);
+		if (auto it = inFlight_.find(startedAt); it != inFlight_.end()) inFlight_.erase(it);
+		++(r.ok ? filesOk_ : filesFailed_);
+		if (r.cacheHit) ++cacheHits_;
+		if (r.ok) {
+			bytesIn_ += r.sizeBefore;
+			bytesOut_ += r.sizeAfter;
+		}
+		busySeconds_ += std::chrono::duration<double>(Clock::now() - startedAt).count();
+		for (const auto &pass : r.passes) {
+			for (const auto &s : pass.steps) {
+				StepStats &st = steps_[s.name];
+				for (std::size_t b = 0; b < kBuckets.size(); ++b) {
+					if (s.wallSeconds <= kBuckets[b]) ++st.buckets[b];
+				}
+				++st.count;
+				st.sum += s.wallSeconds;
+				if (s.exitCode != 0) ++st.failures;
+			}
+		}
+		lastProgress_ = std::time(nullptr);
+	}
+
+	std::string render() const {
+		std::lock_guard<std::mutex> lock(mu_);
+		std::ostringstream os;
+		auto metric = [&](const char *name, const char *type, const char *help) {
+			os << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+		};
+		metric("optimz_files_processed_total", "counter", "Files finished, by outcome.");
+		os << "optimz_files_processed_total{result=\"ok\"} " << filesOk_ << "\n";
+		os << "optimz_files_processed_total{result=\"failed\"} " << filesFailed_ << "\n";
+		metric("optimz_cache_hits_total", "counter", "Files restored from the result cache.");
+		os << "optimz_cache_hits_total " << cacheHits_ << "\n";
+		metric("optimz_bytes_in_total", "counter", "Size of successfully processed inputs.");
+		os << "optimz_bytes_in_total " << bytesIn_ << "\n";
+		metric("optimz_bytes_out_total", "counter", "Size of their optimized outputs.");
+		os << "optimz_bytes_out_total " << bytesOut_ << "\n";
+		metric("optimz_queue_depth", "gauge", "Files waiting for a worker.");
+		os << "optimz_queue_depth " << queued_ << "\n";
+		metric("optimz_workers", "gauge", "Worker threads.");
+		os << "optimz_workers " << workers_ << "\n";
+		metric("optimz_workers_busy", "gauge", "Workers optimizing a file right now.");
+		os << "optimz_workers_busy " << inFlight_.size() << "\n";
+		metric("optimz_worker_busy_seconds_total", "counter", "Worker time spent on finished files; rate() over optimz_workers is utilization.");
+		os << "optimz_worker_busy_seconds_total " << busySeconds_ << "\n";
+		metric("optimz_oldest_file_seconds", "gauge", "Age of the longest-running file in flight, 0 when idle.");
+		os << "optimz_oldest_file_seconds " << (inFlight_.empty() ? 0.0 : std::chrono::duration<double>(Clock::now() - *inFlight_.begin()).count()) << "\n";
+		metric("optimz_last_progress_timestamp_seconds", "gauge", "Unix time the last file finished.");
+		os << "optimz_last_progress_timestamp_seconds " << lastProgress_ << "\n";
+		metric("optimz_step_duration_seconds", "histogram", "Wall time per pipeline step.");
+		for (const auto &[name, st] : steps_) {
+			for (std::size_t b = 0; b < kBuckets.size(); ++b) os << "optimz_step_duration_seconds_bucket{step=\"" << name << "\",le=\"" << kBuckets[b] << "\"} " << st.buckets[b] << "\n";
+			os << "optimz_step_duration_seconds_bucket{step=\"" << name << "\",le=\"+Inf\"} " << st.count << "\n";
+			os << "optimz_step_duration_seconds_sum{step=\"" << name << "\"} " << st.sum << "\n";
+			os << "optimz_step_duration_seconds_count{step=\"" << name << "\"} " << st.count << "\n";
+		}
+		metric("optimz_step_failures_total", "counter", "Steps whose tool exited non-zero (or the built-in engine declined).");
+		for (const auto &[name, st] : steps_) os << "optimz_step_failures_total{step=\"" << name << "\"} " << st.failures << "\n";
+		return os.str();
+	}
+
+private:
+	static constexpr std::array<double, 13> kBuckets{0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+
+	struct StepStats {
+		std::array<std::uint64_t, 13> buckets{};
+		std::uint64_t count = 0;
+		std::uint64_t failures = 0;
+		double sum = 0;
+	};
+
+	bool openListener(const std::string &spec, std::string &err) {
+		if (spec.rfind("unix:", 0) == 0) {
+			sockaddr_un addr{};
+			addr.sun_family = AF_UNIX;
+			socketPath_ = spec.substr(5);
+			if (socketPath_.empty() || socketPath_.size() >= sizeof(addr.sun_path)) {
+				err = "invalid socket path";
+				socketPath_.clear();
+				return false;
+			}
+			std::memcpy(addr.sun_path, socketPath_.c_str(), socketPath_.size() + 1);
+			listen_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			// A stale socket from an earlier run would make bind fail
+			unlink(socketPath_.c_str());
+			if (listen_ < 0 || bind(listen_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(listen_, 16) != 0) {
+				err = socketPath_ + ": " + std::strerror(errno);
+				socketPath_.clear();
+				return false;
+			}
+			return true;
+		}
+		const auto colon = spec.rfind(':');
+		std::string host = colon == std::string::npos ? std::string() : spec.substr(0, colon);
+		const std::string port = colon == std::string::npos ? spec : spec.substr(colon + 1);
+		if (host.size() > 1 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		addrinfo *res = nullptr;
+		if (int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res); rc != 0) {
+			err = spec + ": " + gai_strerror(rc);
+			return false;
+		}
+		for (addrinfo *ai = res; ai && listen_ < 0; ai = ai->ai_next) {
+			int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+			if (fd < 0) continue;
+			int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 16) == 0) listen_ = fd;
+			else close(fd);
+		}
+		if (listen_ < 0) err = spec + ": " + std::strerror(errno);
+		freeaddrinfo(res);
+		return listen_ >= 0;
+	}
+
+	// One request per connection; the body is the same for every path
+	void serve(int fd) {
+		char buf[4096];
+		std::string request;
+		pollfd p{fd, POLLIN, 0};
+		while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos && request.size() < 16384 && poll(&p, 1, 1000) > 0) {
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0) break;
+			request.append(buf, static_cast<std::size_t>(n));
+		}
+		const bool get = request.rfind("GET ", 0) == 0;
+		const std::string body = get ? render() : "only GET is supported\n";
+		std::string reply = std::string(get ? "HTTP/1.0 200 OK" : "HTTP/1.0 405 Method Not Allowed") + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+		for (std::size_t off = 0; off < reply.size();) {
+			ssize_t n = send(fd, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+			if (n <= 0) break;
+			off += static_cast<std::size_t>(n);
+		}
+		close(fd);
+	}
+
+	// Written to a temporary and renamed, so the collector never sees half a file
+	void writeFile() {
+		const std::string tmp = file_->string() + ".optimz-tmp";
+		{
+			std::ofstream out(tmp);
+			out << render();
+			if (!out) return;
+		}
+		if (rename(tmp.c_str(), file_->c_str()) != 0) unlink(tmp.c_str());
+	}
+
+	void run() {
+		// Signals belong to the main thread (--watch waits for them on a signalfd)
+		sigset_t all;
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, nullptr);
+		auto nextWrite = Clock::now();
+		for (;;) {
+			if (file_ && Clock::now() >= nextWrite) {
+				writeFile();
+				nextWrite = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(interval_));
+			}
+			pollfd fds[2] = {{wake_, POLLIN, 0}, {listen_, POLLIN, 0}};
+			int timeout = -1;
+			if (file_) timeout = static_cast<int>(std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(nextWrite - Clock::now()).count()));
+			if (poll(fds, listen_ >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) break;
+			if (fds[0].revents) break;
+			if (listen_ >= 0 && (fds[1].revents & POLLIN)) {
+				int fd = accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+				if (fd >= 0) serve(fd);
+			}
+		}
+		if (file_) writeFile();
+	}
+
+	const unsigned workers_;
+	std::optional<fs::path> file_;
+	double interval_ = 10;
+	int listen_ = -1;
+	int wake_ = -1;
+	std::string socketPath_;
+	std::thread thread_;
+
+	mutable std::mutex mu_;
+	std::uint64_t filesOk_ = 0, filesFailed_ = 0, cacheHits_ = 0;
+	std::uint64_t bytesIn_ = 0, bytesOut_ = 0;
+	std::uint64_t queued_ = 0;
+	double busySeconds_ = 0;
+	std::multiset<Clock::time_point> inFlight_;
+	std::time_t lastProgress_ = 0;
+	std::map<std::string, StepStats> steps_;
+};
+
+// Scratch directories for staged copies, best first: tmpfs, then TMPDIR.
+// Mounts that are read-only or noexec are skipped, since the startup guard
+// and memory measurement run the staged binary.
+static std::vector<fs::path> defaultStagingRoots() {
+	std::vector<fs::path> roots{"/dev/shm"};
+	if (const char *tmp = ::getenv("TMPDIR"); tmp && *tmp) roots.emplace_back(tmp);
+	roots.emplace_back("/tmp");
+	std::vector<fs::path> usable;
+	for (const auto &root : roots) {
+		struct statvfs vfs{};
+		if (access(root.c_str(), W_OK | X_OK) != 0 || statvfs(root.c_str(), &vfs) != 0) continue;
+		if (vfs.f_flag & (ST_RDONLY | ST_NOEXEC)) continue;
+		if (std::find(usable.begin(), usable.end(), root) == usable.end()) usable.push_back(root);
+	}
+	return usable;
+}
+
+// A private copy of one target in a scratch directory. All passes run on
+// the copy, and commit() writes the result over the original with a
+// single rename, so the original is read once, written once and never
+// left half-rewritten.
+class StagedFile {
+public:
+	StagedFile(const fs::path &target, const std::vector<fs::path> &roots) {
+		const std::uintmax_t size = fileSize(target);
+		for (const auto &root : roots) {
+			// Room for the copy plus the temporaries tools write next to it
+			struct statvfs vfs{};
+			if (statvfs(root.c_str(), &vfs) != 0 || static_cast<std::uintmax_t>(vfs.f_bavail) * vfs.f_frsize < 4 * size) continue;
+			std::string tmpl = (root / "optimz-XXXXXX").string();
+			if (!mkdtemp(tmpl.data())) continue;
+			dir_ = tmpl;
+			path_ = dir_ / target.filename();
+			source_ = FileStamp::of(target);
+			std::error_code ec;
+			fs::copy_file(target, path_, ec);
+			if (!ec && stat(path_.c_str(), &staged_) == 0) return;
+			fs::remove_all(dir_, ec);
+			dir_.clear();
+			path_.clear();
+		}
+	}
+	// Copies a stream (stdin) into the first usable root as `name`
+	StagedFile(int fd, const std::string &name, const std::vector<fs::path> &roots) {
+		for (const auto &root : roots) {
+			std::string tmpl = (root / "optimz-XXXXXX").string();
+			if (!mkdtemp(tmpl.data())) continue;
+			dir_ = tmpl;
+			path_ = dir_ / name;
+			int out = open(path_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0755);
+			bool ok = out >= 0;
+			char buf[1 << 16];
+			ssize_t got;
+			while (ok && (got = read(fd, buf, sizeof(buf))) != 0) {
+				if (got < 0) {
+					if (errno == EINTR) continue;
+					ok = false;
+				} else if (write(out, buf, static_cast<std::size_t>(got)) != got) {
+					ok = false;
+				}
+			}
+			if (out >= 0 && close(out) != 0) ok = false;
+			if (ok && stat(path_.c_str(), &staged_) == 0) return;
+			std::error_code ec;
+			fs::remove_all(dir_, ec);
+			dir_.clear();
+			path_.clear();
+			// The stream cannot be rewound for another root
+			return;
+		}
+	}
+	~StagedFile() {
+		std::error_code ec;
+		if (!dir_.empty()) fs::remove_all(dir_, ec);
+	}
+	StagedFile(const StagedFile &) = delete;
+	StagedFile &operator=(const StagedFile &) = delete;
+
+	bool ok() const { return !path_.empty(); }
+	const fs::path &path() const { return path_; }
+
+	// Tools either rewrite in place or rename a new file over the copy
+	bool changed() const {
+		struct stat st{};
+		if (stat(path_.c_str(), &st) != 0) return true;
+		return st.st_ino != staged_.st_ino || st.st_size != staged_.st_size || st.st_ctim.tv_sec != staged_.st_ctim.tv_sec || st.st_ctim.tv_nsec != staged_.st_ctim.tv_nsec;
+	}
+
+	bool commit(const fs::path &target, std::string &err) const {
+		MappedFile file(path_);
+		if (!file.ok()) {
+			err = "cannot read staged copy";
+			return false;
+		}
+		// Something else wrote the target since it was copied; its
+		// version wins over a result built from the older one
+		if (source_ && !(FileStamp::of(target) == *source_)) {
+			err = "it changed while being optimized";
+			return false;
+		}
+		return replaceFile(target, {{file.data(), file.size()}}, err);
+	}
+
+private:
+	fs::path dir_;
+	fs::path path_;
+	struct stat staged_{};
+	std::optional<FileStamp> source_; // the target as copied, when staged from one
+};
+
+// Writes `src` to `output`: "-" is stdout, anything else is replaced with
+// one rename. A new output file takes the mode of `src`.
+static bool emitFile(const fs::path &src, const fs::path &output, std::string &err) {
+	MappedFile file(src);
+	if (!file.ok()) {
+		err = "cannot read " + src.string();
+		return false;
+	}
+	if (output == "-") {
+		std::size_t done = 0;
+		while (done < file.size()) {
+			ssize_t n = write(STDOUT_FILENO, file.data() + done, file.size() - done);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				err = std::strerror(errno);
+				return false;
+			}
+			done += static_cast<std::size_t>(n);
+		}
+		return true;
+	}
+	struct stat st{};
+	if (stat(output.c_str(), &st) != 0) {
+		if (stat(src.c_str(), &st) != 0) st.st_mode = 0755;
+		int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+		if (fd < 0) {
+			err = std::strerror(errno);
+			return false;
+		}
+		close(fd);
+	}
+	return replaceFile(output, {{file.data(), file.size()}}, err);
+}
+
+// Backs up `target` and runs up to `passes` optimization passes over it,
+// or copies a cached result into place when this exact input was seen
+// before. With opts.output set, `target` is left alone and the result is
+// written there instead. `label` prefixes progress lines in batch mode and
+// is empty otherwise.
+static FileResult optimizeTarget(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label) {
+	FileResult r;
+	r.path = target;
+	auto start = std::chrono::steady_clock::now();
+	r.sizeBefore = fileSize(target);
+	r.sizeAfter = r.sizeBefore;
+	const bool inPlace = !opts.output;
+	std::optional<FileKind> kind = classifyFile(target);
+	// Nothing execs a file without execute bits (a tar member's mode says
+	// so), so a PIE-looking ET_DYN among them is at most a library and
+	// never reaches UPX or sstrip
+	if (kind == FileKind::Executable && !isExecutableFile(target)) kind = FileKind::SharedLibrary;
+	// Only executables can be run for the before/after measurements
+	const bool runnable = kind == FileKind::Executable;
+	if (kind && inPlace && opts.backup && !(opts.backupStore ? opts.backupStore->backupOnce(target) : backupOnce(target))) return r;
+	if (opts.measureMemory && runnable) r.memoryBefore = measureMemory(smokeCommand(target, opts.smokeCmd), 30);
+	if (opts.loaderStats && runnable) r.loaderBefore = measureLoaderStats(smokeCommand(target, opts.smokeCmd));
+	if (opts.verify && kind) {
+		r.verifyBefore = probeFile(target, *kind, opts);
+		r.inputHash = hashFile(target);
+		// A backup kept from an earlier run holds older contents; a failed
+		// check then rolls back to a copy of these instead
+		fs::path bak = target;
+		bak += ".bak";
+		const bool matches = r.inputHash && (opts.backupStore ? opts.backupStore->holds(target, *r.inputHash) : hashFile(bak) == r.inputHash);
+		if (inPlace && opts.backup && !matches) {
+			std::string tmpl = target.string() + ".optimz-rollback-XXXXXX";
+			int fd = mkstemp(tmpl.data());
+			if (fd >= 0) {
+				close(fd);
+				struct stat st{};
+				if (copyContents(target, tmpl) && stat(target.c_str(), &st) == 0 && chmod(tmpl.c_str(), st.st_mode & 07777) == 0) r.rollback = tmpl;
+				else unlink(tmpl.c_str());
+			}
+			if (r.rollback.empty()) LogLine() << label << "Cannot keep a copy of the input to roll back to; a failed check leaves the result";
+		}
+	}
+
+	// Records the outcome once `result` holds the optimized binary
+	auto finish = [&](const fs::path &result) {
+		if (!inPlace) {
+			// Nothing reaches the output unless it passes; in place, the
+			// caller verifies (in batch runs, alongside the next file)
+			if (!verifyResult(r, result, opts, label)) {
+				r.wallSeconds = secondsSince(start);
+				return false;
+			}
+			std::string err;
+			if (!emitFile(result, *opts.output, err)) {
+				LogLine() << label << "Failed to write " << (*opts.output == "-" ? std::string("stdout") : opts.output->string()) << ": " << err;
+				r.wallSeconds = secondsSince(start);
+				return false;
+			}
+		}
+		r.sizeAfter = fileSize(result);
+		r.ok = true;
+		r.wallSeconds = secondsSince(start);
+		if (opts.measureMemory && runnable) {
+			r.memoryAfter = measureMemory(smokeCommand(result, opts.smokeCmd), 30);
+			logMemory(r, label);
+		}
+		if (opts.loaderStats && runnable) {
+			r.loaderAfter = measureLoaderStats(smokeCommand(result, opts.smokeCmd));
+			logLoaderStats(r, label);
+		}
+		return true;
+	};
+	if (!kind) {
+		LogLine() << label << "Not an ELF binary, shared library, object or archive; left unchanged";
+		finish(target);
+		return r;
+	}
+
+	std::optional<std::string> key;
+	if (opts.cache) key = opts.cache->keyFor(target);
+	if (key) {
+		auto hit = opts.cache->lookup(*key);
+		// A result linking split debug info is only a hit with its debug
+		// file, which goes into this run's --split-debug directory
+		std::optional<fs::path> debugFile;
+		if (hit && opts.splitDebugDir) debugFile = linkedDebugFile(*opts.splitDebugDir, *hit);
+		if (debugFile) {
+			auto debugHit = opts.cache->lookup(*key + ".debug");
+			std::error_code ec;
+			if (debugHit) fs::create_directories(debugFile->parent_path(), ec);
+			if (debugHit && !ec) fs::copy_file(*debugHit, *debugFile, fs::copy_options::overwrite_existing, ec);
+			if (!debugHit || ec) {
+				LogLine() << label << "Cached result has no usable debug file; optimizing instead";
+				hit.reset();
+			}
+		}
+		if (hit) {
+			if (!inPlace || copyContents(*hit, target)) {
+				r.cacheHit = true;
+				if (finish(inPlace ? target : *hit)) LogLine() << label << "Cache hit; size: " << r.sizeAfter << " bytes";
+				return r;
+			}
+			LogLine() << label << "Failed to apply cached result; optimizing instead";
+		}
+	}
+
+	// Writing elsewhere always needs a private copy to work on
+	std::optional<StagedFile> staged;
+	if (!opts.stagingRoots.empty() || !inPlace) {
+		staged.emplace(target, opts.stagingRoots.empty() ? defaultStagingRoots() : opts.stagingRoots);
+		if (!staged->ok() && !inPlace) {
+			LogLine() << label << "Cannot stage a scratch copy";
+			return r;
+		}
+		if (!staged->ok()) LogLine() << label << "Cannot stage a scratch copy; optimizing in place";
+	}
+	const fs::path work = staged && staged->ok() ? staged->path() : target;
+
+	FileState state;
+	state.kind = *kind;
+	for (int i = 1; i <= opts.passes; ++i) {
+		LogLine() << label << "Pass " << i << "/" << opts.passes;
+		r.passes.emplace_back();
+		bool shrank = optimizeOnce(work, tools, opts, label, r.passes.back(), state);
+		if (!shrank) {
+			LogLine() << label << "No further changes; stopping early.";
+			break;
+		}
+	}
+	if (inPlace && work != target && staged->changed()) {
+		std::string err;
+		if (!staged->commit(target, err)) {
+			LogLine() << label << "Failed to write back the optimized binary: " << err;
+			r.wallSeconds = secondsSince(start);
+			return r;
+		}
+	}
+	if (!finish(inPlace ? target : work)) return r;
+	if (!key) return r;
+	// The debug file first, so an entry never hits without it
+	std::optional<fs::path> debugFile;
+	if (opts.splitDebugDir) debugFile = linkedDebugFile(*opts.splitDebugDir, work);
+	if (debugFile && !opts.cache->store(*key + ".debug", *debugFile)) {
+		LogLine() << label << "Failed to store debug file in cache";
+		return r;
+	}
+	if (!opts.cache->store(*key, work)) LogLine() << label << "Failed to store result in cache";
+	return r;
+}
+
+// optimizeTarget() into `r`, then verifies an in-place result: on
+// `verifiers` when given, so checking it overlaps the next file, and here
+// otherwise. opts.metrics counts the file and `done` runs once the outcome,
+// verification included, is final. `r` must outlive that.
+static void optimizeFile(const fs::path &target, const Tools &tools, const Options &opts, const std::string &label, FileResult &r, WorkPool *verifiers = nullptr, std::function<void()> done = {}) {
+	std::optional<std::chrono::steady_clock::time_point> started;
+	if (opts.metrics) started = opts.metrics->started();
+	r = optimizeTarget(target, tools, opts, label);
+	auto settle = [&r, &opts, target, label, started, done] {
+		if (r.ok && !opts.output) verifyResult(r, target, opts, label);
+		if (!r.rollback.empty()) unlink(r.rollback.c_str());
+		if (started) opts.metrics->finished(r, *started);
+		if (done) done();
+	};
+	if (verifiers && r.ok && r.verifyBefore && !opts.output) verifiers->submit(settle);
+	else settle();
+}
+
+static bool isBackupName(const fs::path &p) {
+	return p.extension() == ".bak";
+}
+
+// Temporaries Opt itself creates next to a target (write-back, BOLT,
+// pack candidates, restore); never optimized on their own.
+static bool isScratchName(const fs::path &p) {
+	return p.filename().string().find(".optimz-") != std::string::npos;
+}
+
+// Walks `dir` and appends every regular ELF executable that is not a backup
+// or one of Opt's temporaries.
+static void collectCandidates(const fs::path &dir, std::vector<fs::path> &out) {
+	std::error_code ec;
+	fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec);
+	if (ec) {
+		LogLine() << "Cannot read directory " << dir << ": " << ec.message();
+		return;
+	}
+	for (auto end = fs::recursive_directory_iterator(); it != end; it.increment(ec)) {
+		if (ec) break;
+		const fs::path &p = it->path();
+		if (it->is_symlink(ec) || isBackupName(p) || isScratchName(p)) continue;
+		if (isOptimizable(p)) out.push_back(p);
+	}
+}
+
+static std::string jsonEscape(const std::string &s) {
+	std::string out;
+	for (unsigned char c : s) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				char buf[8];
+				std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			} else {
+				out += static_cast<char>(c);
+			}
+		}
+	}
+	return out;
+}
+
+static void writeStepJson(std::ostream &os, const StepRecord &s) {
+	os << "{\"name\":\"" << jsonEscape(s.name) << "\",\"wall_ms\":" << s.wallSeconds * 1e3 << ",\"cpu_ms\":" << s.cpuSeconds * 1e3
+	   << ",\"bytes_before\":" << s.sizeBefore << ",\"bytes_after\":" << s.sizeAfter << ",\"exit_code\":" << s.exitCode << "}";
+}
+
+static void writeMemoryJson(std::ostream &os, const char *key, const MemorySample &m) {
+	os << "\"" << key << "\":{\"peak_rss_kb\":" << m.peakRssKb << ",\"major_faults\":" << m.majorFaults << ",\"exit_code\":" << m.exitCode;
+	if (m.atExit) os << ",\"rss_kb\":" << m.rssKb << ",\"pss_kb\":" << m.pssKb;
+	os << "}";
+}
+
+static void writeLoaderJson(std::ostream &os, const char *key, const LoaderStats &l) {
+	os << "\"" << key << "\":{\"startup_time\":\"" << jsonEscape(l.startupTime) << "\",\"relocations\":\"" << jsonEscape(l.relocations)
+	   << "\",\"relocations_from_cache\":\"" << jsonEscape(l.relocationsFromCache) << "\"}";
+}
+
+// Per-file, per-pass step records plus a batch rollup per step name.
+static void writeJsonReport(std::ostream &os, const std::vector<FileResult> &results, double wallSeconds) {
+	struct Rollup {
+		std::size_t runs = 0;
+		std::size_t failures = 0;
+		double wallSeconds = 0;
+		double cpuSeconds = 0;
+		std::uintmax_t bytesSaved = 0;
+	};
+	std::vector<std::pair<std::string, Rollup>> rollup;
+	std::size_t failed = 0, hits = 0;
+	std::uintmax_t before = 0, after = 0;
+
+	os << "{\"files\":[";
+	for (std::size_t i = 0; i < results.size(); ++i) {
+		const FileResult &r = results[i];
+		if (i) os << ",";
+		os << "{\"path\":\"" << jsonEscape(r.path.string()) << "\",\"ok\":" << (r.ok ? "true" : "false") << ",\"cache_hit\":" << (r.cacheHit ? "true" : "false")
+		   << ",\"bytes_before\":" << r.sizeBefore << ",\"bytes_after\":" << r.sizeAfter << ",\"wall_ms\":" << r.wallSeconds * 1e3;
+		if (r.verifyBefore) {
+			os << ",\"verified\":" << (r.verified ? "true" : "false");
+			if (!r.verifyError.empty()) os << ",\"verify_error\":\"" << jsonEscape(r.verifyError) << "\"";
+		}
+		if (r.memoryBefore && r.memoryAfter) {
+			os << ",\"memory\":{";
+			writeMemoryJson(os, "before", *r.memoryBefore);
+			os << ",";
+			writeMemoryJson(os, "after", *r.memoryAfter);
+			os << "}";
+		}
+		if (r.loaderBefore && r.loaderAfter) {
+			os << ",\"loader\":{";
+			writeLoaderJson(os, "before", *r.loaderBefore);
+			os << ",";
+			writeLoaderJson(os, "after", *r.loaderAfter);
+			os << "}";
+		}
+		os << ",\"passes\":[";
+		for (std::size_t p = 0; p < r.passes.size(); ++p) {
+			if (p) os << ",";
+			os << "{\"pass\":" << (p + 1) << ",\"steps\":[";
+			for (std::size_t k = 0; k < r.passes[p].steps.size(); ++k) {
+				const StepRecord &s = r.passes[p].steps[k];
+				if (k) os << ",";
+				writeStepJson(os, s);
+				auto it = std::find_if(rollup.begin(), rollup.end(), [&](const auto &e) { return e.first == s.name; });
+				if (it == rollup.end()) it = rollup.insert(rollup.end(), {s.name, Rollup{}});
+				Rollup &agg = it->second;
+				++agg.runs;
+				if (s.exitCode != 0) ++agg.failures;
+				agg.wallSeconds += s.wallSeconds;
+				agg.cpuSeconds += s.cpuSeconds;
+				if (s.exitCode == 0 && s.sizeAfter < s.sizeBefore) agg.bytesSaved += s.sizeBefore - s.sizeAfter;
+			}
+			os << "]}";
+		}
+		os << "]}";
+		if (!r.ok) {
+			++failed;
+			continue;
+		}
+		if (r.cacheHit) ++hits;
+		before += r.sizeBefore;
+		after += r.sizeAfter;
+	}
+	os << "],\"summary\":{\"files\":" << results.size() << ",\"failed\":" << failed << ",\"cache_hits\":" << hits << ",\"bytes_before\":" << before
+	   << ",\"bytes_after\":" << after << ",\"wall_ms\":" << wallSeconds * 1e3 << ",\"steps\":{";
+	for (std::size_t i = 0; i < rollup.size(); ++i) {
+		const Rollup &agg = rollup[i].second;
+		if (i) os << ",";
+		os << "\"" << jsonEscape(rollup[i].first) << "\":{\"runs\":" << agg.runs << ",\"failures\":" << agg.failures << ",\"wall_ms\":" << agg.wallSeconds * 1e3
+		   << ",\"cpu_ms\":" << agg.cpuSeconds * 1e3 << ",\"bytes_saved\":" << agg.bytesSaved << "}";
+	}
+	os << "}}}\n";
+}
+
+// --estimate output: per-file attribution and predicted step savings, plus
+// the batch totals per category and step.
+static void writeEstimateJson(std::ostream &os, const std::vector<fs::path> &paths, const std::vector<std::optional<SizeEstimate>> &estimates, double wallSeconds) {
+	SizeEstimate total;
+	std::vector<std::pair<std::string, std::uintmax_t>> steps;
+	auto categories = [](std::ostream &os, const SizeEstimate &e) {
+		os << "\"headers\":" << e.headers << ",\"loadable\":" << e.loadable << ",\"symbols\":" << e.symbols << ",\"debug\":" << e.debug << ",\"notes\":" << e.notes
+		   << ",\"rpath\":" << e.rpath << ",\"section_headers\":" << e.sectionHeaders << ",\"other\":" << e.other << ",\"padding\":" << e.padding;
+	};
+	std::size_t failed = 0;
+	os << "{\"files\":[";
+	for (std::size_t i = 0; i < paths.size(); ++i) {
+		if (i) os << ",";
+		os << "{\"path\":\"" << jsonEscape(paths[i].string()) << "\",\"ok\":" << (estimates[i] ? "true" : "false");
+		if (!estimates[i]) {
+			++failed;
+			os << "}";
+			continue;
+		}
+		const SizeEstimate &e = *estimates[i];
+		os << ",\"bytes\":" << e.fileSize << ",";
+		categories(os, e);
+		os << ",\"entropy_bits\":" << e.entropyBits << ",\"steps\":{";
+		for (std::size_t k = 0; k < e.steps.size(); ++k) {
+			if (k) os << ",";
+			os << "\"" << e.steps[k].first << "\":" << e.steps[k].second;
+			auto it = std::find_if(steps.begin(), steps.end(), [&](const auto &s) { return s.first == e.steps[k].first; });
+			if (it == steps.end()) it = steps.insert(steps.end(), {e.steps[k].first, 0});
+			it->second += e.steps[k].second;
+		}
+		os << "},\"predicted_bytes\":" << e.predictedSize << "}";
+		total.fileSize += e.fileSize;
+		total.headers += e.headers;
+		total.loadable += e.loadable;
+		total.symbols += e.symbols;
+		total.debug += e.debug;
+		total.notes += e.notes;
+		total.rpath += e.rpath;
+		total.sectionHeaders += e.sectionHeaders;
+		total.other += e.other;
+		total.padding += e.padding;
+		total.predictedSize += e.predictedSize;
+	}
+	os << "],\"summary\":{\"files\":" << paths.size() << ",\"failed\":" << failed << ",\"bytes\":" << total.fileSize << ",";
+	categories(os, total);
+	os << ",\"steps\":{";
+	for (std::size_t k = 0; k < steps.size(); ++k) {
+		if (k) os << ",";
+		os << "\"" << steps[k].first << "\":" << steps[k].second;
+	}
+	os << "},\"predicted_bytes\":" << total.predictedSize << ",\"wall_ms\":" << wallSeconds * 1e3 << "}}\n";
+}
+
+static void logEstimate(const SizeEstimate &e, const std::string &label) {
+	std::ostringstream line;
+	line.precision(2);
+	line << std::fixed << label << e.fileSize << " bytes: loadable " << e.loadable << ", headers " << e.headers << ", symbols " << e.symbols << ", debug " << e.debug
+	     << ", notes " << e.notes << ", rpath " << e.rpath << ", section headers " << e.sectionHeaders << ", other " << e.other << ", padding " << e.padding
+	     << "; entropy " << e.entropyBits << " bits/byte";
+	LogLine() << line.str();
+	std::ostringstream steps;
+	steps << label << "Predicted:";
+	for (const auto &[name, bytes] : e.steps) steps << " " << name << " -" << bytes;
+	if (e.steps.empty()) steps << " nothing to remove";
+	steps << " (" << e.fileSize << " -> ~" << e.predictedSize << " bytes)";
+	LogLine() << steps.str();
+}
+
+// Long-running mode: optimizes every ELF executable written or moved into
+// `dirs` once it has been quiet for `debounceSeconds`. Tool detection, the
+// cache and the worker pool stay warm for the whole run. Returns on
+// SIGINT/SIGTERM after the queued files finish.
+static int watchDirectories(const std::vector<fs::path> &dirs, bool recursive, const Tools &tools, const Options &opts, unsigned jobs, double debounceSeconds) {
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	// Blocked before the pool starts so its threads inherit the mask
+	pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+	int sigFd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	int inFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (sigFd < 0 || inFd < 0) {
+		LogLine() << "Cannot start watching: " << std::strerror(errno);
+		return 1;
+	}
+
+	std::unordered_map<int, fs::path> watches;
+	std::function<void(const fs::path &)> addWatch = [&](const fs::path &dir) {
+		int wd = inotify_add_watch(inFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+		if (wd < 0) {
+			LogLine() << "Cannot watch " << dir << ": " << std::strerror(errno);
+			return;
+		}
+		watches[wd] = dir;
+		if (!recursive) return;
+		std::error_code ec;
+		for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+			if (it->is_directory(ec) && !it->is_symlink(ec)) addWatch(it->path());
+		}
+	};
+	for (const auto &dir : dirs) addWatch(dir);
+	if (watches.empty()) return 1;
+
+	using Clock = std::chrono::steady_clock;
+	std::map<fs::path, Clock::time_point> settling; // path -> when it counts as complete
+	std::set<std::uint32_t> ownMoves; // cookies of Opt's temporaries renamed over a target
+	std::mutex mu;
+	std::set<fs::path> inFlight;
+	std::set<fs::path> rerun;              // written again while in flight
+	std::map<fs::path, FileStamp> written; // what Opt left behind, per path
+	std::size_t optimized = 0, failed = 0;
+	const auto debounce = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(debounceSeconds));
+
+	WorkPool pool(jobs);
+	std::function<void(const fs::path &)> dispatch = [&](const fs::path &path) {
+		if (isBackupName(path) || isScratchName(path) || !isOptimizable(path)) return;
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			if (inFlight.count(path)) {
+				rerun.insert(path);
+				return;
+			}
+			auto it = written.find(path);
+			if (it != written.end() && FileStamp::of(path) == it->second) return;
+			inFlight.insert(path);
+		}
+		if (opts.metrics) opts.metrics->enqueued();
+		pool.submit([&, path] {
+			FileResult r;
+			optimizeFile(path, tools, opts, path.string() + ": ", r);
+			bool again;
+			{
+				std::lock_guard<std::mutex> lock(mu);
+				inFlight.erase(path);
+				// The newer contents are not Opt's, whether or not the
+				// write-back went through; the next run decides
+				again = rerun.erase(path) != 0;
+				if (again) written.erase(path);
+				else if (auto stamp = FileStamp::of(path)) written[path] = *stamp;
+				if (!again) ++(r.ok ? optimized : failed);
+			}
+			if (again) dispatch(path);
+		});
+	};
+
+	LogLine() << "Watching " << watches.size() << " director" << (watches.size() == 1 ? "y" : "ies") << "; Ctrl-C to stop";
+	alignas(struct inotify_event) char buf[64 * 1024];
+	for (;;) {
+		int timeoutMs = -1;
+		if (!settling.empty()) {
+			auto first = std::min_element(settling.begin(), settling.end(), [](const auto &a, const auto &b) { return a.second < b.second; })->second;
+			timeoutMs = static_cast<int>(std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(first - Clock::now()).count() + 1));
+		}
+		struct pollfd fds[2] = {{inFd, POLLIN, 0}, {sigFd, POLLIN, 0}};
+		if (poll(fds, 2, timeoutMs) < 0 && errno != EINTR) break;
+		if (fds[1].revents & POLLIN) break;
+		if (fds[0].revents & POLLIN) {
+			ssize_t n;
+			while ((n = read(inFd, buf, sizeof(buf))) > 0) {
+				for (char *p = buf; p < buf + n;) {
+					auto *ev = reinterpret_cast<struct inotify_event *>(p);
+					p += sizeof(struct inotify_event) + ev->len;
+					if (ev->mask & IN_Q_OVERFLOW) {
+						LogLine() << "Watch: event queue overflowed; some files may have been missed";
+						continue;
+					}
+					auto dir = watches.find(ev->wd);
+					if (dir == watches.end() || !ev->len) continue;
+					fs::path path = dir->second / ev->name;
+					// Opt's own write-backs are renames from a scratch name
+					if ((ev->mask & IN_MOVED_FROM) && !(ev->mask & IN_ISDIR)) {
+						if (isScratchName(path)) ownMoves.insert(ev->cookie);
+						continue;
+					}
+					if ((ev->mask & IN_MOVED_TO) && ownMoves.erase(ev->cookie)) continue;
+					if (ev->mask & IN_ISDIR) {
+						if (!recursive || !(ev->mask & (IN_CREATE | IN_MOVED_TO))) continue;
+						addWatch(path);
+						// Files may have landed before the watch was in place
+						std::vector<fs::path> found;
+						collectCandidates(path, found);
+						for (const auto &f : found) settling[f] = Clock::now() + debounce;
+						continue;
+					}
+					if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) settling[path] = Clock::now() + debounce;
+				}
+			}
+		}
+		const auto now = Clock::now();
+		for (auto it = settling.begin(); it != settling.end();) {
+			if (it->second > now) {
+				++it;
+				continue;
+			}
+			dispatch(it->first);
+			it = settling.erase(it);
+		}
+	}
+
+	LogLine() << "Stopping; waiting for queued files";
+	pool.wait();
+	close(inFd);
+	close(sigFd);
+	LogLine() << "Watch summary: " << optimized << " optimized, " << failed << " failed";
+	LogLine() << "Done.";
+	return failed ? 1 : 0;
+}
+
+// Child process filtering a byte stream (gzip -dc, zstd -c, ...) from
+// inFd to outFd. Returns -1 if it cannot be started.
+static pid_t spawnFilter(const std::vector<std::string> &args, int inFd, int outFd) {
+	std::vector<char *> argv;
+	for (const auto &a : args) argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+	pid_t pid = -1;
+	int rc = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	return rc == 0 ? pid : -1;
+}
+
+static int waitFilter(pid_t pid) {
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) return -1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Buffered exact-length reads from a pipe or file.
+class ByteReader {
+public:
+	explicit ByteReader(int fd) : fd_(fd), buf_(1 << 20) {}
+
+	// Bytes already consumed from the fd (e.g. while sniffing the format)
+	void preload(const unsigned char *p, std::size_t n) {
+		std::copy(p, p + n, buf_.begin());
+		end_ = n;
+		consumed_ += n;
+	}
+
+	bool read(void *dst, std::size_t n) {
+		auto *out = static_cast<unsigned char *>(dst);
+		while (n) {
+			if (pos_ == end_ && !fill()) return false;
+			std::size_t k = std::min(n, end_ - pos_);
+			std::memcpy(out, buf_.data() + pos_, k);
+			pos_ += k;
+			out += k;
+			n -= k;
+		}
+		return true;
+	}
+
+	// Hands out whatever is buffered, refilling when empty; 0 at EOF
+	std::size_t chunk(const unsigned char *&p, std::size_t max) {
+		if (pos_ == end_ && !fill()) return 0;
+		std::size_t k = std::min(max, end_ - pos_);
+		p = buf_.data() + pos_;
+		pos_ += k;
+		return k;
+	}
+
+	std::uint64_t offset() const { return consumed_ - (end_ - pos_); }
+
+private:
+	bool fill() {
+		for (;;) {
+			ssize_t n = ::read(fd_, buf_.data(), buf_.size());
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			pos_ = 0;
+			end_ = static_cast<std::size_t>(n);
+			consumed_ += end_;
+			return true;
+		}
+	}
+
+	int fd_;
+	std::vector<unsigned char> buf_;
+	std::size_t pos_ = 0;
+	std::size_t end_ = 0;
+	std::uint64_t consumed_ = 0;
+};
+
+class ByteWriter {
+public:
+	explicit ByteWriter(int fd) : fd_(fd) { buf_.reserve(1 << 20); }
+
+	bool write(const void *p, std::size_t n) {
+		const auto *in = static_cast<const unsigned char *>(p);
+		if (buf_.size() + n > buf_.capacity() && !flush()) return false;
+		if (n >= buf_.capacity()) return writeAll(in, n);
+		buf_.insert(buf_.end(), in, in + n);
+		return true;
+	}
+
+	bool flush() {
+		bool ok = writeAll(buf_.data(), buf_.size());
+		buf_.clear();
+		return ok;
+	}
+
+private:
+	bool writeAll(const unsigned char *p, std::size_t n) {
+		while (n) {
+			ssize_t k = ::write(fd_, p, n);
+			if (k < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			p += k;
+			n -= static_cast<std::size_t>(k);
+		}
+		return true;
+	}
+
+	int fd_;
+	std::vector<unsigned char> buf_;
+};
+
+static constexpr std::size_t kTarBlock = 512;
+
+static std::uint64_t tarNumber(const unsigned char *f, std::size_t n) {
+	std::uint64_t v = 0;
+	if (f[0] & 0x80) {
+		// GNU base-256 for values that do not fit the octal field
+		for (std::size_t i = 1; i < n; ++i) v = (v << 8) | f[i];
+		return v;
+	}
+	for (std::size_t i = 0; i < n && f[i]; ++i) {
+		if (f[i] == ' ') continue;
+		if (f[i] < '0' || f[i] > '7') break;
+		v = (v << 3) | static_cast<std::uint64_t>(f[i] - '0');
+	}
+	return v;
+}
+
+static void tarSetNumber(unsigned char *f, std::size_t n, std::uint64_t v) {
+	if (v < (1ULL << (3 * (n - 1)))) {
+		char tmp[24];
+		std::snprintf(tmp, sizeof(tmp), "%0*llo", static_cast<int>(n - 1), static_cast<unsigned long long>(v));
+		std::memcpy(f, tmp, n);
+		return;
+	}
+	std::memset(f, 0, n);
+	f[0] = 0x80;
+	for (std::size_t i = n - 1; i > 0 && v; --i, v >>= 8) f[i] = static_cast<unsigned char>(v & 0xff);
+}
+
+static unsigned tarChecksum(const unsigned char *h) {
+	unsigned sum = 0;
+	for (std::size_t i = 0; i < kTarBlock; ++i) sum += i >= 148 && i < 156 ? ' ' : h[i];
+	return sum;
+}
+
+static void tarSealHeader(unsigned char *h) {
+	char tmp[8];
+	std::snprintf(tmp, sizeof(tmp), "%06o", tarChecksum(h));
+	std::memcpy(h + 148, tmp, 6);
+	h[154] = 0;
+	h[155] = ' ';
+}
+
+static std::size_t tarPadding(std::uint64_t size) {
+	return static_cast<std::size_t>((kTarBlock - size % kTarBlock) % kTarBlock);
+}
+
+// "len key=value\n" records of a pax extended header
+static std::map<std::string, std::string> parsePax(const std::string &pax) {
+	std::map<std::string, std::string> out;
+	for (std::size_t pos = 0; pos < pax.size();) {
+		std::size_t sp = pax.find(' ', pos);
+		std::size_t len = sp == std::string::npos ? 0 : std::strtoull(pax.c_str() + pos, nullptr, 10);
+		if (!len || pos + len > pax.size() || sp >= pos + len) break;
+		std::string rec = pax.substr(sp + 1, pos + len - sp - 2);
+		std::size_t eq = rec.find('=');
+		if (eq != std::string::npos) out[rec.substr(0, eq)] = rec.substr(eq + 1);
+		pos += len;
+	}
+	return out;
+}
+
+// Replaces the size record of a pax header; false if it has none.
+static bool rewritePaxSize(std::string &pax, std::uint64_t size) {
+	std::string out;
+	bool found = false;
+	for (std::size_t pos = 0; pos < pax.size();) {
+		std::size_t sp = pax.find(' ', pos);
+		std::size_t len = sp == std::string::npos ? 0 : std::strtoull(pax.c_str() + pos, nullptr, 10);
+		if (!len || pos + len > pax.size() || sp >= pos + len) return false;
+		if (pax.compare(sp + 1, 5, "size=") == 0) {
+			// The length prefix counts its own digits
+			std::string body = " size=" + std::to_string(size) + "\n";
+			std::size_t total = body.size() + std::to_string(body.size()).size();
+			if (std::to_string(total).size() != std::to_string(body.size()).size()) ++total;
+			out += std::to_string(total) + body;
+			found = true;
+		} else {
+			out.append(pax, pos, len);
+		}
+		pos += len;
+	}
+	if (found) pax = out;
+	return found;
+}
+
+enum class TarCompression { None, Gzip, Zstd };
+
+struct TarMember {
+	struct Meta {
+		std::array<unsigned char, kTarBlock> header;
+		std::string data;
+	};
+	std::vector<Meta> meta; // pax and GNU long-name entries in front of it
+	std::array<unsigned char, kTarBlock> header;
+	std::string name;
+	std::uint64_t size = 0;
+	std::string data; // content of buffered non-ELF members
+	fs::path spool;   // content of ELF members, optimized in place
+	bool done = true; // false while the optimization job runs
+};
+
+// Optimizes the ELF members of a tar stream and copies everything else
+// through unchanged, in the original order. ELF members are spooled to
+// `scratch` and optimized on the pool; a bounded window of members (and of
+// buffered bytes) may wait behind a running job, so memory and scratch use
+// do not grow with the archive.
+static bool streamTar(ByteReader &in, ByteWriter &out, const fs::path &scratch, const Tools &tools, const Options &opts, unsigned jobs, std::vector<FileResult> &results) {
+	std::mutex mu;
+	std::condition_variable cv;
+	std::deque<std::unique_ptr<TarMember>> window;
+	const std::size_t maxWindow = std::max<std::size_t>(4, 4 * jobs);
+	const std::size_t maxBuffered = 64 << 20;
+	const std::uint64_t inlineLimit = 1 << 20;
+	std::size_t buffered = 0;
+	std::size_t seq = 0;
+	bool ok = true;
+	std::vector<std::unique_ptr<FileResult>> found;
+
+	auto writeMember = [&](TarMember &m) {
+		std::uint64_t size = m.size;
+		if (!m.spool.empty()) size = fileSize(m.spool);
+		bool resized = size != m.size;
+		for (auto &meta : m.meta) {
+			if (resized && meta.header[156] == 'x' && rewritePaxSize(meta.data, size)) {
+				tarSetNumber(meta.header.data() + 124, 12, meta.data.size());
+				tarSealHeader(meta.header.data());
+			}
+			static const unsigned char zeros[kTarBlock] = {};
+			ok = ok && out.write(meta.header.data(), kTarBlock) && out.write(meta.data.data(), meta.data.size()) && out.write(zeros, tarPadding(meta.data.size()));
+		}
+		if (resized) {
+			tarSetNumber(m.header.data() + 124, 12, size);
+			tarSealHeader(m.header.data());
+		}
+		ok = ok && out.write(m.header.data(), kTarBlock);
+		if (m.spool.empty()) {
+			ok = ok && out.write(m.data.data(), m.data.size());
+		} else {
+			int fd = open(m.spool.c_str(), O_RDONLY | O_CLOEXEC);
+			char buf[1 << 16];
+			std::uint64_t left = size;
+			ssize_t n;
+			while (ok && fd >= 0 && left && (n = ::read(fd, buf, sizeof(buf))) > 0) {
+				ok = out.write(buf, static_cast<std::size_t>(n));
+				left -= std::min<std::uint64_t>(left, static_cast<std::uint64_t>(n));
+			}
+			if (fd < 0 || left) ok = false;
+			if (fd >= 0) close(fd);
+			std::error_code ec;
+			fs::remove(m.spool, ec);
+		}
+		static const unsigned char zeros[kTarBlock] = {};
+		ok = ok && out.write(zeros, tarPadding(size));
+		if (!ok) LogLine() << "Tar: cannot write the output archive";
+	};
+	// Writes members from the front of the window: finished ones always,
+	// and waiting for the front job while more than `keep` members (or too
+	// many buffered bytes) are queued
+	auto drain = [&](std::size_t keep) {
+		for (;;) {
+			std::unique_ptr<TarMember> m;
+			{
+				std::unique_lock<std::mutex> lock(mu);
+				if (window.empty()) return;
+				if (!window.front()->done && window.size() <= keep && buffered <= maxBuffered) return;
+				cv.wait(lock, [&] { return window.front()->done; });
+				m = std::move(window.front());
+				window.pop_front();
+				buffered -= m->data.size();
+			}
+			writeMember(*m);
+		}
+	};
+	// Copies the last `n` content bytes of a `size`-byte member, plus the
+	// member's padding, straight from input to output
+	auto passThrough = [&](std::uint64_t n, std::uint64_t size) {
+		for (std::uint64_t left = n + tarPadding(size); left && ok;) {
+			const unsigned char *p;
+			std::size_t k = in.chunk(p, static_cast<std::size_t>(std::min<std::uint64_t>(left, 1 << 20)));
+			if (!k) {
+				LogLine() << "Tar: archive is truncated";
+				ok = false;
+				break;
+			}
+			ok = out.write(p, k);
+			left -= k;
+		}
+	};
+
+	WorkPool pool(jobs);
+	std::vector<TarMember::Meta> meta;
+	std::map<std::string, std::string> pax;
+	std::string longName;
+	while (ok) {
+		auto m = std::make_unique<TarMember>();
+		unsigned char *h = m->header.data();
+		if (!in.read(h, kTarBlock)) {
+			LogLine() << "Tar: archive ends without an end-of-archive marker";
+			ok = false;
+			break;
+		}
+		if (std::all_of(h, h + kTarBlock, [](unsigned char c) { return c == 0; })) {
+			// End of archive: everything after it is copied verbatim
+			drain(0);
+			ok = ok && out.write(h, kTarBlock);
+			const unsigned char *p;
+			for (std::size_t k; ok && (k = in.chunk(p, 1 << 20));) ok = out.write(p, k);
+			break;
+		}
+		if (tarNumber(h + 148, 8) != tarChecksum(h)) {
+			LogLine() << "Tar: bad header checksum at offset " << in.offset() - kTarBlock << " (not a tar archive?)";
+			ok = false;
+			break;
+		}
+		const char type = static_cast<char>(h[156]);
+		std::uint64_t size = tarNumber(h + 124, 12);
+		if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+			if (size > (16u << 20)) {
+				LogLine() << "Tar: oversized extended header at offset " << in.offset() - kTarBlock;
+				ok = false;
+				break;
+			}
+			TarMember::Meta entry{m->header, std::string(size, '\0')};
+			unsigned char pad[kTarBlock];
+			if (!in.read(entry.data.data(), size) || !in.read(pad, tarPadding(size))) {
+				ok = false;
+				break;
+			}
+			if (type == 'x') {
+				for (auto &[k, v] : parsePax(entry.data)) pax[k] = v;
+			} else if (type == 'L') {
+				longName = entry.data.c_str();
+			}
+			meta.push_back(std::move(entry));
+			continue;
+		}
+
+		m->meta = std::move(meta);
+		meta.clear();
+		if (pax.count("size")) size = std::strtoull(pax["size"].c_str(), nullptr, 10);
+		if (pax.count("path")) m->name = pax["path"];
+		else if (!longName.empty()) m->name = longName;
+		else {
+			std::string base(reinterpret_cast<const char *>(h), strnlen(reinterpret_cast<const char *>(h), 100));
+			std::string prefix(reinterpret_cast<const char *>(h + 345), strnlen(reinterpret_cast<const char *>(h + 345), 155));
+			m->name = std::memcmp(h + 257, "ustar", 5) == 0 && !prefix.empty() ? prefix + "/" + base : base;
+		}
+		pax.clear();
+		longName.clear();
+		m->size = size;
+
+		// Hard links, devices, directories and sparse files carry no
+		// content of their own to optimize
+		const bool regular = type == '0' || type == '\0' || type == '7';
+		const std::uint64_t mode = tarNumber(h + 100, 8);
+		unsigned char head[64] = {};
+		const std::size_t headLen = regular ? static_cast<std::size_t>(std::min<std::uint64_t>(size, sizeof(head))) : 0;
+		if (headLen && !in.read(head, headLen)) {
+			LogLine() << "Tar: archive is truncated";
+			ok = false;
+			break;
+		}
+		// Executables by mode; libraries, objects and archives by content
+		const unsigned elfType = head[EI_DATA] == ELFDATA2MSB ? head[16] << 8 | head[17] : head[17] << 8 | head[16];
+		const bool optimizable = hasElfMagic(head, headLen) ? elfType == ET_DYN || elfType == ET_REL || (elfType == ET_EXEC && (mode & 0111)) : hasArchiveMagic(head, headLen);
+		if (headLen == sizeof(head) && optimizable) {
+			m->spool = scratch / (std::to_string(seq++) + "-" + fs::path(m->name).filename().string());
+			// The spool keeps the member's execute bits: without them an ET_DYN
+			// that looks like a PIE is optimized as a library
+			int fd = open(m->spool.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600 | (mode & 0111));
+			ByteWriter spool(fd);
+			bool spooled = fd >= 0 && spool.write(head, headLen);
+			for (std::uint64_t left = size - headLen; spooled && left;) {
+				const unsigned char *p;
+				std::size_t k = in.chunk(p, static_cast<std::size_t>(std::min<std::uint64_t>(left, 1 << 20)));
+				spooled = k && spool.write(p, k);
+				left -= k;
+			}
+			spooled = spooled && spool.flush();
+			if (fd >= 0 && close(fd) != 0) spooled = false;
+			unsigned char pad[kTarBlock];
+			if (!spooled || !in.read(pad, tarPadding(size))) {
+				LogLine() << "Tar: cannot spool " << m->name;
+				ok = false;
+				break;
+			}
+			m->done = false;
+			TarMember *member = m.get();
+			found.push_back(std::make_unique<FileResult>());
+			FileResult *result = found.back().get();
+			{
+				std::lock_guard<std::mutex> lock(mu);
+				window.push_back(std::move(m));
+			}
+			if (opts.metrics) opts.metrics->enqueued();
+			pool.submit([&, member, result] {
+				optimizeFile(member->spool, tools, opts, member->name + ": ", *result);
+				result->path = member->name;
+				std::lock_guard<std::mutex> lock(mu);
+				member->done = true;
+				cv.notify_all();
+			});
+			drain(maxWindow);
+			continue;
+		}
+
+		bool idle;
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			idle = window.empty();
+		}
+		if (!idle && size > inlineLimit) {
+			// Too big to buffer behind the pending jobs: wait for them instead
+			drain(0);
+			idle = true;
+		}
+		if (idle) {
+			for (auto &entry : m->meta) {
+				static const unsigned char zeros[kTarBlock] = {};
+				ok = ok && out.write(entry.header.data(), kTarBlock) && out.write(entry.data.data(), entry.data.size()) && out.write(zeros, tarPadding(entry.data.size()));
+			}
+			ok = ok && out.write(h, kTarBlock) && out.write(head, headLen);
+			passThrough(size - headLen, size);
+			continue;
+		}
+		m->data.assign(reinterpret_cast<const char *>(head), headLen);
+		m->data.resize(size);
+		unsigned char pad[kTarBlock];
+		if (!in.read(m->data.data() + headLen, size - headLen) || !in.read(pad, tarPadding(size))) {
+			LogLine() << "Tar: archive is truncated";
+			ok = false;
+			break;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			buffered += m->data.size();
+			window.push_back(std::move(m));
+		}
+		drain(maxWindow);
+	}
+	pool.wait();
+	if (ok) drain(0);
+	ok = ok && out.flush();
+	for (auto &r : found) results.push_back(std::move(*r));
+	return ok;
+}
+
+// Opens `input` ("-" for stdin) and `output` ("-" for stdout) as tar
+// streams, piping them through gzip or zstd when the input is compressed.
+// The output uses the compression of the input and replaces an existing
+// file with one rename.
+static bool optimizeTar(const fs::path &input, const fs::path &output, const std::vector<fs::path> &scratchRoots, const Tools &tools, const Options &opts, unsigned jobs, std::vector<FileResult> &results) {
+	int inFd = input == "-" ? STDIN_FILENO : open(input.c_str(), O_RDONLY | O_CLOEXEC);
+	if (inFd < 0) {
+		LogLine() << "Cannot open " << input << ": " << std::strerror(errno);
+		return false;
+	}
+	unsigned char magic[4] = {};
+	std::size_t got = 0;
+	while (got < sizeof(magic)) {
+		ssize_t n = ::read(inFd, magic + got, sizeof(magic) - got);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		got += static_cast<std::size_t>(n);
+	}
+	TarCompression comp = TarCompression::None;
+	if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) comp = TarCompression::Gzip;
+	else if (got == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) comp = TarCompression::Zstd;
+	const char *codecName = comp == TarCompression::Gzip ? "gzip" : "zstd";
+	// Empty for a plain tar, which is read and written as is
+	std::optional<std::string> codec;
+	if (comp != TarCompression::None) codec = comp == TarCompression::Gzip ? tools.gzip : tools.zstd;
+	if (comp != TarCompression::None && !codec) {
+		LogLine() << codecName << " not found in PATH; needed for " << input;
+		return false;
+	}
+
+	std::string scratch = ((scratchRoots.empty() ? fs::temp_directory_path() : scratchRoots.front()) / "optimz-tar-XXXXXX").string();
+	if (!mkdtemp(scratch.data())) {
+		LogLine() << "Cannot create a scratch directory: " << std::strerror(errno);
+		return false;
+	}
+	std::string tmpOut;
+	int outFd = STDOUT_FILENO;
+	if (output != "-") {
+		tmpOut = output.string() + ".optimz-XXXXXX";
+		outFd = mkostemp(tmpOut.data(), O_CLOEXEC);
+		struct stat st{};
+		if (outFd >= 0) fchmod(outFd, input != "-" && fstat(inFd, &st) == 0 ? st.st_mode & 07777 : 0644);
+	}
+	// A failed filter must surface as an error, not kill us on write
+	std::signal(SIGPIPE, SIG_IGN);
+
+	bool ok = outFd >= 0;
+	if (!ok) LogLine() << "Cannot create " << tmpOut << ": " << std::strerror(errno);
+	auto closeFd = [](int &fd) {
+		if (fd >= 0) close(fd);
+		fd = -1;
+	};
+	pid_t decoder = -1, encoder = -1;
+	int readFd = inFd, writeFd = outFd;
+	std::thread feeder;
+	if (ok && codec) {
+		int from[2] = {-1, -1}, feed[2] = {-1, -1}, to[2] = {-1, -1};
+		// A seekable input goes to the decoder directly; a pipe is fed the
+		// sniffed bytes first and then the rest of the stream
+		const bool seekable = lseek(inFd, 0, SEEK_SET) == 0;
+		ok = pipe2(from, O_CLOEXEC) == 0 && (seekable || pipe2(feed, O_CLOEXEC) == 0) && pipe2(to, O_CLOEXEC) == 0;
+		if (ok) decoder = spawnFilter({*codec, "-d", "-c", "-q"}, seekable ? inFd : feed[0], from[1]);
+		if (ok && decoder > 0) encoder = spawnFilter({*codec, "-c", "-q"}, to[0], outFd);
+		ok = ok && decoder > 0 && encoder > 0;
+		if (!ok) LogLine() << "Cannot start " << *codec;
+		closeFd(from[1]);
+		closeFd(feed[0]);
+		closeFd(to[0]);
+		readFd = from[0];
+		writeFd = to[1];
+		if (ok && !seekable) {
+			feeder = std::thread([sink = feed[1], inFd, magic, got] {
+				bool fed = ::write(sink, magic, got) == static_cast<ssize_t>(got);
+				char buf[1 << 16];
+				for (ssize_t n; fed && (n = ::read(inFd, buf, sizeof(buf))) != 0;) {
+					if (n < 0) {
+						fed = errno == EINTR;
+						continue;
+					}
+					fed = ::write(sink, buf, static_cast<std::size_t>(n)) == n;
+				}
+				close(sink);
+			});
+		} else {
+			closeFd(feed[1]);
+		}
+	}
+	if (ok) {
+		ByteReader reader(readFd);
+		if (!codec) reader.preload(magic, got);
+		ByteWriter writer(writeFd);
+		ok = streamTar(reader, writer, scratch, tools, opts, jobs, results);
+	}
+	if (codec) {
+		closeFd(writeFd);
+		if (encoder > 0 && waitFilter(encoder) != 0 && ok) {
+			LogLine() << *codec << " failed while compressing the output";
+			ok = false;
+		}
+		if (!ok && decoder > 0) kill(decoder, SIGTERM);
+		closeFd(readFd);
+		if (decoder > 0 && waitFilter(decoder) != 0 && ok) {
+			LogLine() << *codec << " failed while decompressing " << input;
+			ok = false;
+		}
+		// On failure the feeder may still be blocked reading stdin
+		if (feeder.joinable()) ok ? feeder.join() : feeder.detach();
+	}
+	if (input != "-") closeFd(inFd);
+	if (output != "-" && outFd >= 0) {
+		if (close(outFd) != 0) ok = false;
+		if (ok && rename(tmpOut.c_str(), output.c_str()) != 0) {
+			LogLine() << "Cannot replace " << output << ": " << std::strerror(errno);
+			ok = false;
+		}
+		if (!ok) unlink(tmpOut.c_str());
+	}
+	std::error_code ec;
+	fs::remove_all(scratch, ec);
+	return ok;
+}
+
+static void usage(const char *argv0) {
+	std::cerr << "Usage: " << argv0 << " [options] <program_path>... -<times>\n";
+	std::cerr << "\tPerforms multiple optimization passes over ELF executables, shared libraries, objects and archives.\n";
+	std::cerr << "\t<times> defaults to 1 if omitted. Example: " << argv0 << " ./a.out -2\n";
+	std::cerr << "Options:\n";
+	std::cerr << "\t-r, --recursive   Descend into directory arguments and optimize every ELF executable, shared\n";
+	std::cerr << "\t                  library, object and ar archive found\n";
+	std::cerr << "\t-j N, --jobs=N    Optimize up to N files concurrently (default: number of cores)\n";
+	std::cerr << "\t--cache-dir=DIR   Result cache location (default: $XDG_CACHE_HOME/optimz)\n";
+	std::cerr << "\t--no-cache        Always run the tools, never reuse or store cached results\n";
+	std::cerr << "\t--max-startup-regression=PCT\n";
+	std::cerr << "\t                  Time the binary before and after UPX and undo packing if its median\n";
+	std::cerr << "\t                  exec-to-exit latency grows by more than PCT percent\n";
+	std::cerr << "\t--pack-search[=S] Pack copies with several UPX settings in parallel (within S seconds)\n";
+	std::cerr << "\t                  and keep the smallest, or leave the binary unpacked\n";
+	std::cerr << "\t--pack-jobs=N     Concurrent packer processes for --pack-search (default: cores)\n";
+	std::cerr << "\t--pack-objective=O\n";
+	std::cerr << "\t                  size (default) or size+startup: size times startup latency ratio\n";
+	std::cerr << "\t--startup-runs=K  Timed runs per side for the startup guard (default: 5)\n";
+	std::cerr << "\t--smoke-cmd=CMD   Command timed by the startup guard; {} is replaced by the binary\n";
+	std::cerr << "\t                  Split on whitespace; quote ('...' or \"...\") or \\-escape to keep spaces\n";
+	std::cerr << "\t--profile=P       size (default), startup (no upx), rss (no upx or sstrip, so text pages\n";
+	std::cerr << "\t                  stay shared) or debuggable (keep symbols and debug info, compressed)\n";
+	std::cerr << "\t--profile-file=F  Run the steps listed in F instead of a built-in profile\n";
+	std::cerr << "\t--measure-memory  Run the original and optimized binary and compare RSS, PSS and major faults\n";
+	std::cerr << "\t--bolt-profile=F  Reorder the binary with llvm-bolt using F (perf.data or .fdata) before stripping\n";
+	std::cerr << "\t--bolt-args=ARGS  Optimization flags for llvm-bolt instead of the defaults\n";
+	std::cerr << "\t--analyze-needed  Report relocation counts and DT_NEEDED libraries nothing binds to\n";
+	std::cerr << "\t--prune-needed    Also remove those libraries with patchelf --remove-needed\n";
+	std::cerr << "\t--loader-stats    Compare LD_DEBUG=statistics before and after optimization\n";
+	std::cerr << "\t--split-debug=DIR Keep symbols and debug info in DIR/.build-id/xx/yyyy.debug and link them\n";
+	std::cerr << "\t                  from the stripped binary instead of discarding them\n";
+	std::cerr << "\t--stage-dir=DIR   Run the passes on a copy in DIR (default: /dev/shm, then $TMPDIR or /tmp)\n";
+	std::cerr << "\t--no-staging      Rewrite the target in place after every step\n";
+	std::cerr << "\t--backup=B        bak (default): copy to <path>.bak; store: one deduplicated, reflinked or\n";
+	std::cerr << "\t                  zstd-compressed object per input in a shared store\n";
+	std::cerr << "\t--backup-dir=DIR  Location of the backup store (default: ~/.local/share/optimz/backups)\n";
+	std::cerr << "\t--restore         Put the backed-up originals of the given paths back (with the store and\n";
+	std::cerr << "\t                  no paths: everything in it; directories select the paths below them)\n";
+	std::cerr << "\t--watch           Keep running and optimize ELF executables as they are written or moved\n";
+	std::cerr << "\t                  into the given directories (with -r: and their subdirectories)\n";
+	std::cerr << "\t--debounce=MS     Quiet time before a written file is picked up in --watch mode (default: 200)\n";
+	std::cerr << "\t-o OUT, --output=OUT\n";
+	std::cerr << "\t                  Write the result to OUT (- for stdout) and leave the input untouched;\n";
+	std::cerr << "\t                  a single input of - reads the binary from stdin (default output: stdout)\n";
+	std::cerr << "\t--tar             The single input (- for stdin) is a tar archive or OCI layer, optionally\n";
+	std::cerr << "\t                  gzip/zstd-compressed; its ELF members are optimized while it streams to\n";
+	std::cerr << "\t                  -o OUT (default: replace the archive; stdout for stdin)\n";
+	std::cerr << "\t--estimate        Run no tool; attribute each file's bytes to symbols, debug info, notes,\n";
+	std::cerr << "\t                  RPATH, section headers and padding and predict every step's savings\n";
+	std::cerr << "\t--metrics-listen=ADDR\n";
+	std::cerr << "\t                  Serve Prometheus metrics over HTTP on ADDR (unix:PATH, HOST:PORT or :PORT)\n";
+	std::cerr << "\t--metrics-file=F  Rewrite F in the textfile-collector format every interval and at exit\n";
+	std::cerr << "\t--metrics-interval=S\n";
+	std::cerr << "\t                  Seconds between --metrics-file updates (default: 10)\n";
+	std::cerr << "\t--compress-debug=zstd Compress debug sections with zstd (built in via libzstd, else objcopy)\n";
+	std::cerr << "\t                  instead of zlib\n";
+	std::cerr << "\t--zstd-level=N    zstd level for built-in debug compression, 1-22 (default: 12)\n";
+	std::cerr << "\t--page-size=N     Run compact-layout for pages of N bytes (4K, 16K, 64K): closes the file\n";
+	std::cerr << "\t                  padding between segments and lowers p_align to N, so the result only\n";
+	std::cerr << "\t                  loads with pages no larger than N; saves file size, not mapped pages\n";
+	std::cerr << "\t--verify          Check each result still loads (headers, interpreter, dynamic section, ldd);\n";
+	std::cerr << "\t                  restore the backup if it does not\n";
+	std::cerr << "\t--verify-smoke    Also run the smoke command sandboxed and compare its exit status\n";
+	std::cerr << "\t--verify-timeout=S Time limit for each sandboxed smoke run (default: 10)\n";
+	std::cerr << "\t--shard=i/N       Process only the files whose content hash falls in shard i of N\n";
+	std::cerr << "\t--remote-cache=URL Back the result cache with GET/PUT of URL/<key> (via curl)\n";
+	std::cerr << "\t--journal=FILE    Record every file's input/output hash and status in FILE as the run goes\n";
+	std::cerr << "\t--resume          Skip files the journal (default: the cache directory's) records as done\n";
+	std::cerr << "\t                  and recheck the ones an interrupted run left in flight\n";
+	std::cerr << "\t--report=json     Print per-file, per-pass step timings and sizes as JSON on stdout\n";
+	std::cerr << "\t--engine=E        Use E (native or tool) for every step the built-in engine supports\n";
+	std::cerr << "\t--engine=STEP=E   Per step: strip, debug or metadata (default: native, tool as fallback)\n";
+}
+
+static bool parseCount(const std::string &s, int &out) {
+	try {
+		std::size_t used = 0;
+		out = std::stoi(s, &used);
+		return used == s.size();
+	} catch (...) {
+		return false;
+	}
+}
+
+// Splits a command line into words the way sh quotes them: '...' is
+// literal, a backslash escapes \ or " inside "..." and any character
+// outside quotes. Nothing is expanded. Fails on an unterminated quote.
+static bool splitWords(const std::string &s, std::vector<std::string> &out) {
+	out.clear();
+	std::string word;
+	bool inWord = false;
+	for (std::size_t i = 0; i < s.size(); ++i) {
+		const char c = s[i];
+		if (c == ' ' || c == '\t' || c == '\n') {
+			if (inWord) out.push_back(word);
+			word.clear();
+			inWord = false;
+			continue;
+		}
+		inWord = true;
+		if (c == '\'') {
+			const std::size_t end = s.find('\'', i + 1);
+			if (end == std::string::npos) return false;
+			word.append(s, i + 1, end - i - 1);
+			i = end;
+		} else if (c == '"') {
+			for (++i; i < s.size() && s[i] != '"'; ++i) {
+				if (s[i] == '\\' && i + 1 < s.size() && (s[i + 1] == '"' || s[i + 1] == '\\')) ++i;
+				word += s[i];
+			}
+			if (i == s.size()) return false;
+		} else if (c == '\\' && i + 1 < s.size()) {
+			word += s[++i];
+		} else {
+			word += c;
+		}
+	}
+	if (inWord) out.push_back(word);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<fs::path> inputs;
+	int passes = 1;
+	bool recursive = false;
+	bool useCache = true;
+	bool jsonReport = false;
+	int startupRuns = 5;
+	bool staging = true;
+	std::optional<fs::path> stageDir;
+	bool useStore = false;
+	bool restore = false;
+	bool watch = false;
+	bool tarMode = false;
+	bool estimate = false;
+	bool resume = false;
+	std::optional<VerifySettings> verify;
+	bool zstdDebug = false;
+	bool profileFromFile = false;
+	int zstdLevel = 12;
+	unsigned shardIndex = 0, shardCount = 0;
+	std::string remoteCache;
+	std::optional<fs::path> journalPath;
+	std::string metricsListen;
+	std::optional<fs::path> metricsFile;
+	double metricsInterval = 10;
+	fs::path tarOutput;
+	double debounceSeconds = 0.2;
+	std::optional<fs::path> backupDir = defaultBackupDir();
+	std::optional<fs::path> cacheDir = defaultCacheDir();
+	Options opts;
+	unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; ++i) {
+		std::string a = argv[i];
+		if (a == "-h" || a == "--help") {
+			usage(argv[0]);
+			return 0;
+		} else if (a == "-r" || a == "--recursive") {
+			recursive = true;
+		} else if (a == "--no-cache") {
+			useCache = false;
+		} else if (a.rfind("--max-startup-regression=", 0) == 0) {
+			std::string v = a.substr(25);
+			if (!v.empty() && v.back() == '%') v.pop_back();
+			char *end = nullptr;
+			double pct = std::strtod(v.c_str(), &end);
+			if (v.empty() || *end || pct < 0) {
+				std::cerr << "Invalid startup regression budget: " << a.substr(25) << "\n";
+				return 1;
+			}
+			if (!opts.startupGuard) opts.startupGuard.emplace();
+			opts.startupGuard->maxRegressionPct = pct;
+		} else if (a == "--pack-search" || a.rfind("--pack-search=", 0) == 0) {
+			if (!opts.packSearch) opts.packSearch.emplace();
+			if (a.size() > 13) {
+				std::string v = a.substr(14);
+				if (!v.empty() && v.back() == 's') v.pop_back();
+				char *end = nullptr;
+				double secs = std::strtod(v.c_str(), &end);
+				if (v.empty() || *end || secs < 0) {
+					std::cerr << "Invalid pack search budget: " << a.substr(14) << "\n";
+					return 1;
+				}
+				opts.packSearch->budgetSeconds = secs;
+			}
+		} else if (a.rfind("--pack-jobs=", 0) == 0) {
+			int n = 0;
+			if (!parseCount(a.substr(12), n) || n < 1) {
+				std::cerr << "Invalid pack job count: " << a.substr(12) << "\n";
+				return 1;
+			}
+			if (!opts.packSearch) opts.packSearch.emplace();
+			opts.packSearch->jobs = static_cast<unsigned>(n);
+		} else if (a.rfind("--pack-objective=", 0) == 0) {
+			std::string v = a.substr(17);
+			if (v != "size" && v != "size+startup") {
+				std::cerr << "Unknown pack objective: " << v << " (expected size or size+startup)\n";
+				return 1;
+			}
+			if (!opts.packSearch) opts.packSearch.emplace();
+			opts.packSearch->objective = v == "size" ? PackObjective::Size : PackObjective::SizeStartup;
+		} else if (a.rfind("--startup-runs=", 0) == 0) {
+			int n = 0;
+			if (!parseCount(a.substr(15), n) || n < 1) {
+				std::cerr << "Invalid startup run count: " << a.substr(15) << "\n";
+				return 1;
+			}
+			startupRuns = n;
+		} else if (a.rfind("--smoke-cmd=", 0) == 0) {
+			if (!splitWords(a.substr(12), opts.smokeCmd)) {
+				std::cerr << "Unterminated quote in smoke command: " << a.substr(12) << "\n";
+				return 1;
+			}
+		} else if (a.rfind("--profile=", 0) == 0) {
+			auto preset = presetPipeline(a.substr(10));
+			if (!preset) {
+				std::cerr << "Unknown profile: " << a.substr(10) << " (expected size, startup, rss or debuggable)\n";
+				return 1;
+			}
+			opts.pipeline = std::move(*preset);
+			profileFromFile = false;
+		} else if (a.rfind("--profile-file=", 0) == 0) {
+			std::string err;
+			auto loaded = loadProfileFile(a.substr(15), err);
+			if (!loaded) {
+				std::cerr << "Invalid profile file " << a.substr(15) << ": " << err << "\n";
+				return 1;
+			}
+			opts.pipeline = std::move(*loaded);
+			profileFromFile = true;
+		} else if (a.rfind("--bolt-profile=", 0) == 0) {
+			opts.boltProfile = fs::path(a.substr(15));
+			if (!fs::is_regular_file(*opts.boltProfile)) {
+				std::cerr << "BOLT profile not found: " << *opts.boltProfile << "\n";
+				return 1;
+			}
+		} else if (a.rfind("--bolt-args=", 0) == 0) {
+			std::istringstream words(a.substr(12));
+			opts.boltArgs.clear();
+			for (std::string w; words >> w;) opts.boltArgs.push_back(w);
+		} else if (a.rfind("--backup=", 0) == 0) {
+			std::string v = a.substr(9);
+			if (v != "bak" && v != "store") {
+				std::cerr << "Unknown backup mode: " << v << " (expected bak or store)\n";
+				return 1;
+			}
+			useStore = v == "store";
+		} else if (a.rfind("--backup-dir=", 0) == 0) {
+			backupDir = fs::path(a.substr(13));
+			useStore = true;
+		} else if (a == "-o" || a.rfind("--output=", 0) == 0) {
+			if (a == "-o") {
+				if (i + 1 >= argc) {
+					std::cerr << "Option -o needs an output path\n";
+					return 1;
+				}
+				opts.output = fs::path(argv[++i]);
+			} else {
+				opts.output = fs::path(a.substr(9));
+			}
+		} else if (a == "--tar") {
+			tarMode = true;
+		} else if (a == "--watch") {
+			watch = true;
+		} else if (a.rfind("--metrics-listen=", 0) == 0) {
+			metricsListen = a.substr(17);
+		} else if (a.rfind("--metrics-file=", 0) == 0) {
+			metricsFile = fs::path(a.substr(15));
+		} else if (a.rfind("--metrics-interval=", 0) == 0) {
+			std::string v = a.substr(19);
+			if (!v.empty() && v.back() == 's') v.pop_back();
+			char *end = nullptr;
+			metricsInterval = std::strtod(v.c_str(), &end);
+			if (v.empty() || *end || metricsInterval <= 0) {
+				std::cerr << "Invalid metrics interval: " << a.substr(19) << "\n";
+				return 1;
+			}
+		} else if (a == "--shard" || a.rfind("--shard=", 0) == 0) {
+			std::string v;
+			if (a == "--shard") {
+				if (i + 1 >= argc) {
+					std::cerr << "--shard requires a value\n";
+					return 1;
+				}
+				v = argv[++i];
+			} else {
+				v = a.substr(8);
+			}
+			auto slash = v.find('/');
+			int index = 0, count = 0;
+			if (slash == std::string::npos || !parseCount(v.substr(0, slash), index) || !parseCount(v.substr(slash + 1), count) || index < 1 || index > count) {
+				std::cerr << "Invalid shard: " << v << " (expected i/N with 1 <= i <= N)\n";
+				return 1;
+			}
+			shardIndex = static_cast<unsigned>(index);
+			shardCount = static_cast<unsigned>(count);
+		} else if (a.rfind("--remote-cache=", 0) == 0) {
+			remoteCache = a.substr(15);
+		} else if (a.rfind("--compress-debug=", 0) == 0) {
+			const std::string v = a.substr(17);
+			if (v != "zlib" && v != "zstd") {
+				std::cerr << "Unknown debug compression: " << v << " (expected zlib or zstd)\n";
+				return 1;
+			}
+			zstdDebug = v == "zstd";
+		} else if (a.rfind("--zstd-level=", 0) == 0) {
+			if (!parseCount(a.substr(13), zstdLevel) || zstdLevel < 1 || zstdLevel > 22) {
+				std::cerr << "Invalid zstd level: " << a.substr(13) << " (expected 1 to 22)\n";
+				return 1;
+			}
+		} else if (a.rfind("--page-size=", 0) == 0) {
+			const std::string v = a.substr(12);
+			char *end = nullptr;
+			unsigned long long n = std::strtoull(v.c_str(), &end, 10);
+			if (end != v.c_str() && (*end == 'K' || *end == 'k') && end[1] == '\0') n *= 1024, ++end;
+			if (end == v.c_str() || *end || n < 4096 || (n & (n - 1))) {
+				std::cerr << "Invalid page size: " << v << " (expected a power of two of at least 4K, e.g. 4K, 16K or 64K)\n";
+				return 1;
+			}
+			opts.pageSize = n;
+		} else if (a == "--verify" || a == "--verify-smoke") {
+			if (!verify) verify.emplace();
+			if (a == "--verify-smoke") verify->smoke = true;
+		} else if (a.rfind("--verify-timeout=", 0) == 0) {
+			char *end = nullptr;
+			const std::string v = a.substr(17);
+			double t = std::strtod(v.c_str(), &end);
+			if (v.empty() || *end || !(t > 0)) {
+				std::cerr << "Invalid verification timeout: " << v << "\n";
+				return 1;
+			}
+			if (!verify) verify.emplace();
+			verify->limits.timeoutSeconds = t;
+		} else if (a.rfind("--journal=", 0) == 0) {
+			journalPath = fs::path(a.substr(10));
+		} else if (a == "--resume") {
+			resume = true;
+		} else if (a == "--estimate") {
+			estimate = true;
+		} else if (a.rfind("--debounce=", 0) == 0) {
+			int ms = 0;
+			if (!parseCount(a.substr(11), ms) || ms < 0) {
+				std::cerr << "Invalid debounce interval: " << a.substr(11) << "\n";
+				return 1;
+			}
+			debounceSeconds = ms / 1000.0;
+		} else if (a == "--restore") {
+			restore = true;
+		} else if (a.rfind("--stage-dir=", 0) == 0) {
+			stageDir = fs::path(a.substr(12));
+			staging = true;
+		} else if (a == "--no-staging") {
+			staging = false;
+		} else if (a.rfind("--split-debug=", 0) == 0) {
+			opts.splitDebugDir = fs::path(a.substr(14));
+		} else if (a == "--analyze-needed") {
+			opts.analyzeNeeded = true;
+		} else if (a == "--prune-needed") {
+			opts.pruneNeeded = true;
+		} else if (a == "--loader-stats") {
+			opts.loaderStats = true;
+		} else if (a == "--measure-memory") {
+			opts.measureMemory = true;
+		} else if (a.rfind("--report=", 0) == 0) {
+			std::string v = a.substr(9);
+			if (v != "json" && v != "text") {
+				std::cerr << "Unknown report format: " << v << " (expected json or text)\n";
+				return 1;
+			}
+			jsonReport = v == "json";
+		} else if (a.rfind("--cache-dir=", 0) == 0) {
+			cacheDir = fs::path(a.substr(12));
+		} else if (a.rfind("--engine=", 0) == 0) {
+			std::string v = a.substr(9);
+			std::string step;
+			if (auto eq = v.find('='); eq != std::string::npos) {
+				step = v.substr(0, eq);
+				v = v.substr(eq + 1);
+			}
+			if (v != "native" && v != "tool") {
+				std::cerr << "Unknown engine: " << v << " (expected native or tool)\n";
+				return 1;
+			}
+			Engine e = v == "native" ? Engine::Native : Engine::Tool;
+			if (step.empty() || step == "strip") opts.stripEngine = e;
+			if (step.empty() || step == "debug") opts.debugEngine = e;
+			if (step.empty() || step == "metadata") opts.metadataEngine = e;
+			if (!step.empty() && step != "strip" && step != "debug" && step != "metadata") {
+				std::cerr << "Unknown step for --engine: " << step << "\n";
+				return 1;
+			}
+		} else if (a == "-j" || a.rfind("-j", 0) == 0 || a.rfind("--jobs=", 0) == 0) {
+			std::string v;
+			if (a == "-j") {
+				if (i + 1 >= argc) {
+					std::cerr << "-j requires a value\n";
+					return 1;
+				}
+				v = argv[++i];
+			} else {
+				v = a.substr(a[1] == 'j' ? 2 : 7);
+			}
+			int n = 0;
+			if (!parseCount(v, n) || n < 1) {
+				std::cerr << "Invalid job count: " << v << "\n";
+				return 1;
+			}
+			jobs = static_cast<unsigned>(n);
+		} else if (a.size() > 1 && a[0] == '-' && a != "-") {
+			if (!std::isdigit(static_cast<unsigned char>(a[1]))) {
+				std::cerr << "Unknown option: " << a << "\n";
+				return 1;
+			}
+			if (!parseCount(a.substr(1), passes)) {
+				std::cerr << "Invalid optimization count: " << a << "\n";
+				return 1;
+			}
+		} else {
+			inputs.emplace_back(a);
+		}
+	}
+	// One PATH scan resolves the step tools and every helper
+	Tools tools = detectTools(useCache ? cacheDir : std::nullopt);
+	if (useStore) {
+		if (!backupDir) {
+			std::cerr << "No backup store location (set HOME or use --backup-dir=DIR)\n";
+			return 1;
+		}
+		opts.backupStore.emplace(*backupDir, tools.zstd);
+	}
+	if (restore) {
+		std::vector<fs::path> paths;
+		for (const auto &input : inputs) {
+			if (opts.backupStore && fs::is_directory(input)) {
+				auto below = opts.backupStore->paths(input);
+				paths.insert(paths.end(), below.begin(), below.end());
+			} else {
+				paths.push_back(input);
+			}
+		}
+		if (inputs.empty() && opts.backupStore) paths = opts.backupStore->paths();
+		if (paths.empty()) {
+			std::cerr << (inputs.empty() && opts.backupStore ? "No backups recorded.\n" : "No paths to restore.\n");
+			return 1;
+		}
+		int failed = 0;
+		for (const auto &path : paths) {
+			std::string err;
+			if (opts.backupStore ? opts.backupStore->restore(path, err) : restoreBak(path, err)) {
+				std::cerr << "Restored " << path.string() << "\n";
+			} else {
+				std::cerr << "Cannot restore " << path.string() << ": " << err << "\n";
+				++failed;
+			}
+		}
+		return failed ? 1 : 0;
+	}
+	if (inputs.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (passes < 1) passes = 1;
+
+	if (watch && jsonReport) {
+		std::cerr << "--report=json cannot be combined with --watch\n";
+		return 1;
+	}
+	// Watch mode tells a newer write from its own by staging every file
+	if (watch && !staging) {
+		std::cerr << "--no-staging cannot be combined with --watch\n";
+		return 1;
+	}
+	if (verify && tarMode) {
+		std::cerr << "--verify cannot check tar members, whose libraries ship with them\n";
+		return 1;
+	}
+	if (verify) {
+		verify->ldd = tools.ldd;
+		if (!tools.ldd) LogLine() << "ldd not found; --verify will not check library resolution";
+		opts.verify = verify;
+	}
+	if (shardCount && (watch || tarMode || opts.output)) {
+		std::cerr << "--shard applies to batch runs, not --watch, --tar or -o\n";
+		return 1;
+	}
+	if (!remoteCache.empty() && !useCache) {
+		std::cerr << "--remote-cache backs the local cache and cannot be combined with --no-cache\n";
+		return 1;
+	}
+	if ((journalPath || resume) && (watch || tarMode || opts.output || estimate)) {
+		std::cerr << "--journal and --resume apply to batch runs, not --watch, --tar, -o or --estimate\n";
+		return 1;
+	}
+	if (estimate && (watch || tarMode || opts.output)) {
+		std::cerr << "--estimate cannot be combined with --watch, --tar or -o\n";
+		return 1;
+	}
+	if (tarMode) {
+		if (inputs.size() != 1 || recursive || watch) {
+			std::cerr << "--tar takes exactly one archive\n";
+			return 1;
+		}
+		if (inputs[0] != "-" && !fs::is_regular_file(inputs[0])) {
+			std::cerr << "Archive not found: " << inputs[0] << "\n";
+			return 1;
+		}
+		// The output option names the archive; members are rewritten in scratch
+		tarOutput = opts.output.value_or(inputs[0]);
+		opts.output.reset();
+		if (tarOutput == "-" && jsonReport) {
+			std::cerr << "--report=json cannot be combined with output to stdout\n";
+			return 1;
+		}
+	}
+	const bool fromStdin = !tarMode && std::find(inputs.begin(), inputs.end(), fs::path("-")) != inputs.end();
+	if (fromStdin && !opts.output && !estimate) opts.output = fs::path("-");
+	if (opts.output && (inputs.size() != 1 || recursive || watch)) {
+		std::cerr << "-o and stdin input take exactly one file\n";
+		return 1;
+	}
+	if (opts.output && *opts.output == "-" && jsonReport) {
+		std::cerr << "--report=json cannot be combined with output to stdout\n";
+		return 1;
+	}
+	// Read the pipe up front; from here on the copy is an ordinary input
+	std::optional<StagedFile> stdinCopy;
+	if (fromStdin) {
+		stdinCopy.emplace(STDIN_FILENO, "stdin", staging && stageDir ? std::vector<fs::path>{*stageDir} : defaultStagingRoots());
+		if (!stdinCopy->ok()) {
+			std::cerr << "Cannot read stdin into a scratch file\n";
+			return 1;
+		}
+		if (!classifyFile(stdinCopy->path())) {
+			std::cerr << "Input on stdin is not an ELF binary or archive.\n";
+			return 1;
+		}
+		inputs = {stdinCopy->path()};
+	}
+
+	// Journaled runs record every file; resuming skips what an earlier run
+	// finished and rechecks what it left in flight
+	std::optional<Journal> journal;
+	std::map<std::string, Journal::Entry> previous;
+	std::set<std::string> restored;
+	if (resume && !journalPath && cacheDir) journalPath = *cacheDir / "journal";
+	if (resume && !journalPath) {
+		std::cerr << "No journal location (set HOME or use --journal=FILE)\n";
+		return 1;
+	}
+	if (journalPath) {
+		journal.emplace(*journalPath);
+		if (resume) previous = journal->load();
+		std::string err;
+		if (!journal->open(err)) {
+			std::cerr << "Cannot open journal " << err << "\n";
+			return 1;
+		}
+	}
+	// A file caught mid-rewrite that no longer parses would be dropped by
+	// target discovery, so it goes back to its backup first
+	for (const auto &[key, e] : previous) {
+		if (e.status != Journal::Status::Started) continue;
+		const bool inScope = std::any_of(inputs.begin(), inputs.end(), [&](const fs::path &in) {
+			const std::string root = Journal::key(in);
+			return key == root || (key.size() > root.size() && key.compare(0, root.size(), root) == 0 && key[root.size()] == '/');
+		});
+		const fs::path path(key);
+		std::error_code ec;
+		if (!inScope || !fs::is_regular_file(path, ec) || classifyFile(path) || toHex(hashFile(path).value_or(0)) == e.input) continue;
+		std::string err;
+		if (opts.backupStore ? opts.backupStore->restore(path, err) : restoreBak(path, err)) {
+			restored.insert(key);
+			LogLine() << key << ": Interrupted rewrite left it unreadable; restored from backup";
+		} else {
+			LogLine() << key << ": Interrupted rewrite left it unreadable and it cannot be restored: " << err;
+		}
+	}
+
+	std::vector<fs::path> targets;
+	for (const auto &target : inputs) {
+		if (tarMode) break;
+		if (!fs::exists(target)) {
+			std::cerr << "Target not found: " << target << "\n";
+			return 1;
+		}
+		if (watch) {
+			if (!fs::is_directory(target)) {
+				std::cerr << "--watch needs directories: " << target << "\n";
+				return 1;
+			}
+			continue;
+		}
+		if (fs::is_directory(target)) {
+			if (!recursive) {
+				std::cerr << "Target is a directory (use --recursive): " << target << "\n";
+				return 1;
+			}
+			collectCandidates(target, targets);
+			continue;
+		}
+		auto kind = classifyFile(target);
+		if (!kind) {
+			std::cerr << "Target is not an ELF binary or an archive of ELF objects. Skipping.\n";
+			return 1;
+		}
+		if (*kind == FileKind::Executable && !isExecutableFile(target)) {
+			std::cerr << "Target is an executable without execute permission: " << target << "\n";
+			return 1;
+		}
+		targets.push_back(target);
+	}
+
+	// The same file may be reached through several arguments
+	std::set<fs::path> seen;
+	targets.erase(std::remove_if(targets.begin(), targets.end(), [&](const fs::path &p) {
+		              std::error_code ec;
+		              return !seen.insert(fs::weakly_canonical(p, ec)).second;
+	              }),
+	              targets.end());
+	if (targets.empty() && !watch && !tarMode) {
+		std::cerr << "No ELF binaries or archives found.\n";
+		return 1;
+	}
+
+	// Nodes given the same inputs agree on the split without talking to
+	// each other, and identical files always land on the same node
+	if (shardCount) {
+		const std::size_t total = targets.size();
+		targets.erase(std::remove_if(targets.begin(), targets.end(), [&](const fs::path &t) {
+			              return hashFile(t).value_or(0) % shardCount != shardIndex - 1;
+		              }),
+		              targets.end());
+		LogLine() << "Shard " << shardIndex << "/" << shardCount << ": " << targets.size() << " of " << total << " file" << (total == 1 ? "" : "s");
+		if (targets.empty()) {
+			LogLine() << "Done.";
+			return 0;
+		}
+	}
+
+	if (estimate) {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::optional<SizeEstimate>> estimates(targets.size());
+		WorkPool pool(static_cast<unsigned>(std::min<std::size_t>(jobs, targets.size())));
+		for (std::size_t i = 0; i < targets.size(); ++i) {
+			pool.submit([&, i] { estimates[i] = estimateSavings(targets[i], opts); });
+		}
+		pool.wait();
+		std::size_t failed = 0;
+		std::uintmax_t before = 0, after = 0;
+		for (std::size_t i = 0; i < targets.size(); ++i) {
+			std::string label = targets.size() > 1 ? targets[i].string() + ": " : std::string();
+			if (!estimates[i]) {
+				LogLine() << label << "No ELF headers to estimate from";
+				++failed;
+				continue;
+			}
+			logEstimate(*estimates[i], label);
+			before += estimates[i]->fileSize;
+			after += estimates[i]->predictedSize;
+		}
+		if (targets.size() > 1) {
+			double pct = before ? 100.0 * static_cast<double>(before - after) / static_cast<double>(before) : 0.0;
+			std::ostringstream line;
+			line.precision(1);
+			line << std::fixed << "Summary: " << (targets.size() - failed) << " estimated, " << failed << " failed, " << before << " -> ~" << after << " bytes (saved ~" << (before - after) << ", " << pct << "%)";
+			LogLine() << line.str();
+		}
+		if (jsonReport) writeEstimateJson(std::cout, targets, estimates, secondsSince(start));
+		return failed ? 1 : 0;
+	}
+
+	const bool anyNative = opts.stripEngine == Engine::Native || opts.debugEngine == Engine::Native || opts.metadataEngine == Engine::Native;
+	if (!anyNative && !tools.strip && !tools.objcopy && !tools.upx) {
+		std::cerr << "No optimization tools found in PATH (llvm-strip/strip, llvm-objcopy/objcopy, upx).\n";
+		return 1;
+	}
+
+	if (zstdDebug && !Zstd::get() && !tools.objcopyZstd) {
+		LogLine() << "zstd debug compression needs libzstd.so.1 or an objcopy that supports --compress-debug-sections=zstd; using zlib";
+	} else if (zstdDebug) {
+		opts.zstdDebugLevel = zstdLevel;
+	}
+	// Cores left idle by fewer files than jobs go to the files' own threads
+	const std::size_t fileWorkers = watch || tarMode ? jobs : std::max<std::size_t>(1, std::min<std::size_t>(jobs, targets.size()));
+	opts.fileThreads = std::max(1u, std::thread::hardware_concurrency() / static_cast<unsigned>(fileWorkers));
+
+	// A profile file lists compact-layout itself; presets only get it here
+	if (opts.pageSize && !opts.pipeline.has(Step::CompactLayout)) {
+		if (profileFromFile) {
+			std::cerr << "--page-size needs compact-layout in the profile file\n";
+			return 1;
+		}
+		opts.pipeline.add(Step::CompactLayout);
+	}
+
+	opts.passes = passes;
+	resolvePipeline(opts.pipeline, tools, opts);
+	if (opts.startupGuard) {
+		opts.startupGuard->runs = startupRuns;
+	}
+	if (opts.packSearch) {
+		opts.packSearch->startupRuns = startupRuns;
+	}
+	if (staging) {
+		if (stageDir) opts.stagingRoots.push_back(*stageDir);
+		else opts.stagingRoots = defaultStagingRoots();
+	}
+	if (useCache && cacheDir) {
+		std::ostringstream salt;
+		salt << toolFingerprint(tools) << "passes=" << passes << "\nprofile=" << opts.pipeline.describe() << "\nengines=" << static_cast<int>(opts.stripEngine) << static_cast<int>(opts.debugEngine) << static_cast<int>(opts.metadataEngine) << "\n";
+		if (opts.pruneNeeded) salt << "prune-needed\n";
+		// Not the directory: the link holds only the debug file's name and
+		// CRC, and a hit installs the cached debug file in this run's DIR
+		if (opts.splitDebugDir) salt << "split-debug\n";
+		if (opts.pageSize) salt << "page-size=" << *opts.pageSize << "\n";
+		// objcopy ignores the level, so only the native path depends on it
+		if (opts.zstdDebugLevel) salt << "compress-debug=zstd," << (Zstd::get() ? *opts.zstdDebugLevel : 0) << "\n";
+		if (opts.packSearch) salt << "pack-search=" << static_cast<int>(opts.packSearch->objective) << "," << opts.packSearch->budgetSeconds << "," << opts.packSearch->startupRuns << "\n";
+		// Whether UPX was kept depends on what the guard measured: a result
+		// packed without it must not be served to a guarded run
+		if (opts.startupGuard) salt << "startup-guard=" << opts.startupGuard->maxRegressionPct << "," << opts.startupGuard->runs << "," << opts.startupGuard->timeoutSeconds << "\n";
+		if (opts.startupGuard || opts.packSearch) {
+			salt << "smoke=";
+			for (const auto &w : opts.smokeCmd) salt << " " << w;
+			salt << "\n";
+		}
+		if (opts.boltProfile) {
+			salt << "bolt=" << toHex(hashFile(*opts.boltProfile).value_or(0));
+			for (const auto &arg : opts.boltArgs) salt << " " << arg;
+			salt << "\n";
+		}
+		opts.cache.emplace(*cacheDir, salt.str());
+		if (!remoteCache.empty()) {
+			if (!tools.curl) {
+				std::cerr << "--remote-cache needs curl on PATH\n";
+				return 1;
+			}
+			opts.cache->setRemote(remoteCache, *tools.curl);
+		}
+	} else if (!remoteCache.empty()) {
+		std::cerr << "--remote-cache needs a local cache directory (set HOME or use --cache-dir=DIR)\n";
+		return 1;
+	}
+
+	std::optional<Metrics> metrics;
+	if (!metricsListen.empty() || metricsFile) {
+		metrics.emplace(jobs);
+		std::string err;
+		if (!metrics->start(metricsListen, metricsFile, metricsInterval, err)) {
+			std::cerr << "Cannot serve metrics: " << err << "\n";
+			return 1;
+		}
+		opts.metrics = &*metrics;
+	}
+
+	if (watch) return watchDirectories(inputs, recursive, tools, opts, jobs, debounceSeconds);
+
+	if (resume) {
+		std::size_t skipped = 0;
+		targets.erase(std::remove_if(targets.begin(), targets.end(), [&](const fs::path &t) {
+			              auto it = previous.find(Journal::key(t));
+			              if (it == previous.end()) return false;
+			              const std::string now = toHex(hashFile(t).value_or(0));
+			              const Journal::Entry &e = it->second;
+			              if (e.status == Journal::Status::Done && now == e.output) return ++skipped, true;
+			              // Interrupted mid-pipeline: every step leaves a valid file, so
+			              // it continues from where it is
+			              if (e.status == Journal::Status::Started && now != e.input && !restored.count(it->first)) LogLine() << t.string() << ": Resuming a partially optimized file";
+			              return false;
+		              }),
+		              targets.end());
+		if (skipped) LogLine() << "Resume: " << skipped << " file" << (skipped == 1 ? "" : "s") << " already done";
+		if (targets.empty()) {
+			LogLine() << "Done.";
+			return 0;
+		}
+	}
+
+	const bool batch = targets.size() > 1 || tarMode;
+	auto runStart = std::chrono::steady_clock::now();
+	std::vector<FileResult> results(targets.size());
+	bool tarFailed = false;
+	if (tarMode) {
+		const fs::path &archive = inputs[0];
+		std::error_code ec;
+		if (archive != "-" && fs::equivalent(archive, tarOutput, ec) && !(opts.backupStore ? opts.backupStore->backupOnce(archive) : backupOnce(archive))) return 1;
+		// Members are spooled to scratch already and need no backup
+		const std::vector<fs::path> scratchRoots = opts.stagingRoots.empty() ? defaultStagingRoots() : opts.stagingRoots;
+		opts.backup = false;
+		opts.stagingRoots.clear();
+		tarFailed = !optimizeTar(archive, tarOutput, scratchRoots, tools, opts, jobs, results);
+	} else {
+		// Verification runs on its own workers, so checking one file overlaps
+		// optimizing the next
+		const unsigned workers = static_cast<unsigned>(std::min<std::size_t>(jobs, targets.size()));
+		std::optional<WorkPool> verifiers;
+		if (opts.verify && !opts.output) verifiers.emplace(workers);
+		WorkPool pool(workers);
+		for (std::size_t i = 0; i < targets.size(); ++i) {
+			if (opts.metrics) opts.metrics->enqueued();
+			pool.submit([&, i] {
+				std::string label = batch ? targets[i].string() + ": " : std::string();
+				const std::string key = journal ? Journal::key(targets[i]) : std::string();
+				const std::string input = journal ? toHex(hashFile(targets[i]).value_or(0)) : std::string();
+				if (journal) journal->started(key, input);
+				optimizeFile(targets[i], tools, opts, label, results[i], verifiers ? &*verifiers : nullptr, [&, i, key, input] {
+					if (journal) journal->finished(key, input, results[i].ok ? std::optional<std::string>(toHex(hashFile(targets[i]).value_or(0))) : std::nullopt);
+				});
+			});
+		}
+		pool.wait();
+		if (verifiers) verifiers->wait();
+	}
+
+	std::size_t failed = 0;
+	std::uintmax_t totalBefore = 0, totalAfter = 0;
+	for (const auto &r : results) {
+		if (!r.ok) {
+			++failed;
+			continue;
+		}
+		totalBefore += r.sizeBefore;
+		totalAfter += r.sizeAfter;
+	}
+	if (batch) {
+		std::uintmax_t saved = totalBefore > totalAfter ? totalBefore - totalAfter : 0;
+		double pct = totalBefore ? 100.0 * static_cast<double>(saved) / static_cast<double>(totalBefore) : 0.0;
+		std::ostringstream line;
+		line.precision(1);
+		line << std::fixed << "Summary: " << (results.size() - failed) << " optimized, " << failed << " failed, " << totalBefore << " -> " << totalAfter << " bytes (saved " << saved << ", " << pct << "%)";
+		LogLine() << line.str();
+	}
+
+	if (jsonReport) writeJsonReport(std::cout, results, secondsSince(runStart));
+
+	LogLine() << "Done.";
+	return failed || tarFailed ? 1 : 0;
+}